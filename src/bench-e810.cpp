@@ -0,0 +1,168 @@
+/*
+ * In-process benchmark of the e810 behavioral model.
+ *
+ * Runs e810_bm against a scripted guest (see e810-guest.hpp).
+ *
+ * Measures
+ *   - tx: TX doorbell -> EthSend
+ *   - rx: EthRx -> descriptor writeback
+ *   - rx burst: EthRxBurst -> descriptor writeback
+ *   - mmio: RegRead/RegWrite dispatch of hot registers
+ *
+ * Usage: bench-e810 [packets per run]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syslog.h>
+#include <time.h>
+
+#include <memory>
+#include <vector>
+
+#include "e810-guest.hpp"
+#include "util.hpp"
+
+using namespace e810_guest;
+
+static const uint32_t NB_FLOWS = 64;
+
+// packets per doorbell (tx) or between two tail updates (rx)
+static const uint32_t BATCH = 32;
+static const size_t MMIO_ITERATIONS = 10000000;
+
+static const size_t PKT_SIZES[] = { 64, 128, 256, 512, 1024, 1518 };
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *what, size_t pkt_len, uint64_t pkts, uint64_t ns) {
+  double ns_per_pkt = (double)ns / pkts;
+  printf("%-8s %5zu B  %8.2f ns/pkt  %7.3f Mpps\n", what, pkt_len, ns_per_pkt,
+         1000.0 / ns_per_pkt);
+}
+
+// TX doorbell -> EthSend. Includes refilling the descriptors, which is one
+// 16B store per packet.
+static void bench_tx(E810Guest &guest, SinkDriver &driver, uint64_t nb_pkts) {
+  uint32_t tail = 0;
+  for (size_t pkt_len : PKT_SIZES) {
+    for (uint32_t i = 0; i < RING_LEN; i++)
+      build_packet(guest.at<uint8_t>(TX_BUFS + i * BUF_SIZE), pkt_len, i % NB_FLOWS);
+
+    uint64_t sent_before = driver.sent;
+    uint64_t batches = nb_pkts / BATCH;
+    uint64_t start = now_ns();
+    for (uint64_t b = 0; b < batches; b++) {
+      for (uint32_t i = 0; i < BATCH; i++)
+        guest.tx_fill((tail + i) % RING_LEN, pkt_len);
+      tail = (tail + BATCH) % RING_LEN;
+      guest.reg_write(QTX_COMM_DBELL(0), tail);
+    }
+    uint64_t end = now_ns();
+
+    uint64_t sent = driver.sent - sent_before;
+    if (sent != batches * BATCH)
+      die("tx: model sent %lu of %lu packets", sent, batches * BATCH);
+    report("tx", pkt_len, sent, end - start);
+  }
+}
+
+// EthRx (or EthRxBurst of BATCH packets) -> descriptor writeback. Includes
+// checking and refilling the used descriptors.
+static void bench_rx(E810Guest &guest, uint64_t nb_pkts) {
+  uint32_t next = 0; // next descriptor the model writes back
+  uint32_t tail = RING_LEN - 1;
+  for (bool burst : { false, true }) {
+    for (size_t pkt_len : PKT_SIZES) {
+      std::vector<std::vector<uint8_t>> packets(NB_FLOWS, std::vector<uint8_t>(pkt_len));
+      for (uint32_t f = 0; f < NB_FLOWS; f++)
+        build_packet(packets[f].data(), pkt_len, f);
+
+      std::vector<nicbm::Runner::Device::EthFrame> frames(BATCH);
+      uint64_t batches = nb_pkts / BATCH;
+      uint64_t start = now_ns();
+      for (uint64_t b = 0; b < batches; b++) {
+        for (uint32_t i = 0; i < BATCH; i++) {
+          const auto &pkt = packets[(b * BATCH + i) % NB_FLOWS];
+          if (burst)
+            frames[i] = { {}, pkt.data(), pkt.size(), nullptr };
+          else
+            guest.model->EthRx(0, {}, pkt.data(), pkt.size());
+        }
+        if (burst)
+          guest.model->EthRxBurst(0, frames);
+        for (uint32_t i = 0; i < BATCH; i++) {
+          if (!guest.rx_done(0, next))
+            die("rx: model dropped packets (descriptor %u not written back)", next);
+          guest.rx_refill(0, next);
+          next = (next + 1) % RING_LEN;
+        }
+        tail = (tail + BATCH) % RING_LEN;
+        guest.reg_write(QRX_TAIL(0), tail);
+      }
+      uint64_t end = now_ns();
+      report(burst ? "rx burst" : "rx", pkt_len, batches * BATCH, end - start);
+    }
+  }
+}
+
+static void bench_mmio(E810Guest &guest) {
+  struct mmio_access {
+    const char *name;
+    uint64_t addr;
+    bool write;
+  };
+  const mmio_access accesses[] = {
+    { "read  tx head", QTX_COMM_HEAD(0), false },
+    { "read  dyn ctl", GLINT_DYN_CTL(1), false },
+    { "read  stats counter", GLPRT_UPRCL(0), false },
+    { "read  unmatched (switch)", PFINT_OICR, false },
+    { "write dyn ctl", GLINT_DYN_CTL(1), true },
+    { "write itr", GLINT_ITR(0, 1), true },
+  };
+
+  for (const auto &access : accesses) {
+    uint32_t sum = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < MMIO_ITERATIONS; i++) {
+      if (access.write)
+        guest.reg_write(access.addr, 0);
+      else
+        sum += guest.reg_read(access.addr);
+    }
+    uint64_t end = now_ns();
+    // keep the compiler from optimizing the reads away
+    __asm__ volatile("" : : "r"(sum));
+    double ns = (double)(end - start) / MMIO_ITERATIONS;
+    printf("mmio %-24s %8.2f ns/access  %7.3f M/s\n", access.name, ns, 1000.0 / ns);
+  }
+}
+
+int main(int argc, char **argv) {
+  uint64_t nb_pkts = 2000000;
+  if (argc > 1)
+    nb_pkts = strtoull(argv[1], NULL, 0);
+  if (nb_pkts < BATCH)
+    die("need at least %u packets per run", BATCH);
+
+  // the model logs every DMA at LOG_DEBUG
+  LOG_LEVEL = LOG_ERR;
+
+  auto driver = std::make_shared<SinkDriver>();
+  E810Harness harness(driver, std::make_shared<GuestDevice>(driver));
+  E810Guest &guest = *harness.guest;
+  guest.txq_setup(0);
+  guest.rxq_setup(0);
+
+  printf("%lu packets per run, %u per doorbell\n", nb_pkts, BATCH);
+  bench_tx(guest, *driver, nb_pkts);
+  bench_rx(guest, nb_pkts);
+  bench_mmio(guest);
+
+  return 0;
+}
@@ -30,6 +30,9 @@ private:
   epoll_callback tapCallback;
   int efd = 0; // if non-null: eventfd registered for this->tap->fd
 
+  // segmented rx packets are copied here to pass them to the model
+  std::unique_ptr<char[]> rx_linear = std::make_unique<char[]>(Driver::MAX_BUF);
+
   void registerDriverEpoll(std::shared_ptr<Driver> driver, int efd) {
     if (driver->fd == 0)
       return;
@@ -101,7 +104,7 @@ public:
           Util::rte_delay_us_block(100);
         }
         this_->vfu_ctx_mutex.lock();
-        this_->ethRx(rxBuf.data, rxBuf.used);
+        this_->ethRx(rxBuf.linear(this_->rx_linear.get()), rxBuf.used);
         this_->vfu_ctx_mutex.unlock();
       }
     }
@@ -109,7 +112,7 @@ public:
     // printf("interrupt_throtteling register: %d\n", e1000_interrupt_throtteling_reg(this_->e1000, -1));
   }
 
-  void ethRx(char *data, size_t len) {
+  void ethRx(const char *data, size_t len) {
     if (e1000_rx_is_ready(e1000)) {
       e1000_receive(e1000, (uint8_t*)data, len);
     } else {
@@ -4,6 +4,7 @@
 #include "interrupts/simbricks.hpp"
 #include "libsimbricks/simbricks/nicbm/nicbm.h"
 #include "libvfio-user.h"
+#include "memfd.hpp"
 #include "sims/nic/e810_bm/e810_bm.h"
 #include "sims/nic/e810_bm/e810_ptp.h"
 #include "src/devices/vmux-device.hpp"
@@ -15,8 +16,11 @@
 #include <cstring>
 #include <memory>
 #include <net/ethernet.h>
+#include <shared_mutex>
 #include <string>
 #include <ctime>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #define NUM_MSIX_IRQs 16 // choose small to avoid unneccessary polling in processAllPollTimers
 
@@ -39,6 +43,32 @@ private:
   std::vector<std::shared_ptr<InterruptThrottlerSimbricks>> irqThrottle;
   std::shared_ptr<std::vector<std::shared_ptr<VmuxDevice>>> broadcast_destinations;
 
+  // segmented rx packets are copied here to pass them to the model
+  std::unique_ptr<char[]> rx_linear = std::make_unique<char[]>(Driver::MAX_BUF);
+  // received packets not yet passed to the model (see rx_burst_flush())
+  std::vector<nicbm::Runner::Device::EthFrame> rx_burst;
+
+  // The model locks its queues itself, so the rx thread does not take
+  // vfu_ctx_mutex. It holds this lock instead while the model may DMA, so
+  // that the runner thread cannot change the guest memory mappings meanwhile.
+  std::shared_mutex dma_mutex;
+
+  // Tail registers of the first DOORBELL_QUEUES tx and rx queues are written
+  // by KVM into doorbell_shadow and signaled through ioeventfds, instead of
+  // each write being a vfio-user message (see init_doorbells()).
+  static const unsigned DOORBELL_QUEUES = 64;
+  struct Doorbell {
+    int fd;
+    uint32_t reg; // BAR offset
+  };
+  std::vector<Doorbell> doorbells; // doorbell i is at offset 4 * i in doorbell_shadow
+  std::unique_ptr<MemFd> doorbell_shadow;
+  int doorbell_epfd = -1; // epoll over all doorbell fds
+
+  // Copy of the register bar. Its statistics counter pages are mmapped by the
+  // guest, so that reading them does not trap (see e810_bm::set_reg_mirror()).
+  std::unique_ptr<MemFd> bar_mirror;
+
   void registerDriverEpoll(std::shared_ptr<Driver> driver, int efd) {
     if (driver->fd == 0)
       return;
@@ -96,6 +126,9 @@ public:
 
     // set up vfio-user register mediation
     this->init_bar_callbacks(*vfu);
+#ifdef BUILD_IOEVENTFD
+    this->init_doorbells(*vfu);
+#endif
 
     // set up irqs
     this->init_irqs(*vfu);
@@ -112,18 +145,70 @@ public:
     this->init_general_callbacks(*vfu);
   };
 
-  void processAllPollTimers() {
+  ~E810EmulatedDevice() {
+    for (auto &doorbell : this->doorbells)
+      close(doorbell.fd);
+    if (this->doorbell_epfd >= 0)
+      close(this->doorbell_epfd);
+  }
+
+  int doorbell_fd() override {
+    return this->doorbell_epfd;
+  }
+
+  // Apply the latest tail of every rung doorbell. Several rings of one
+  // doorbell since the last call result in a single tail update.
+  void process_doorbells() override {
+    struct epoll_event events[2 * DOORBELL_QUEUES];
+    int n = epoll_wait(this->doorbell_epfd, events, 2 * DOORBELL_QUEUES, 0);
+    if (n <= 0)
+      return;
+    // reset the eventfds before reading the values, so that no update is lost
+    for (int i = 0; i < n; i++) {
+      uint64_t rings;
+      if (read(this->doorbells[events[i].data.u32].fd, &rings, sizeof(rings)) < 0 && errno != EAGAIN)
+        die("cannot read doorbell eventfd");
+    }
+    // runs on the runner thread, which is the only one changing DMA mappings:
+    // the model's queue locks suffice
+    auto *shadow = (std::atomic<uint32_t> *)this->doorbell_shadow->ptr();
+    for (int i = 0; i < n; i++) {
+      uint32_t idx = events[i].data.u32;
+      uint32_t val = shadow[idx].load(std::memory_order_acquire);
+      this->model->RegWrite(E810EmulatedDevice::BAR_REGS, this->doorbells[idx].reg, &val, sizeof(val));
+    }
+  }
+
+  // returns the number of poll timers still armed
+  size_t processAllPollTimers() {
+    size_t armed = 0;
     for (size_t i = 0; i < NUM_MSIX_IRQs; i++) {
       this->irqThrottle[i]->processPollTimer();
+      armed += this->irqThrottle[i]->pollTimerArmed();
     }
+    return armed;
   }
 
 
   // forward rx event callback from tap to this E1000EmulatedDevice
   static void driver_cb(int vm_number, void *this__) {
     E810EmulatedDevice *this_ = (E810EmulatedDevice*) this__;
+    this_->poll_driver(vm_number);
+  }
+
+  size_t poll_rx() override {
+    return this->poll_driver(this->device_id);
+  }
 
-    this_->processAllPollTimers();
+  // Returns the amount of work done (or pending): packets received or
+  // injected, deferred interrupts that have yet to be sent and staged tx
+  // packets that have yet to be flushed.
+  size_t poll_driver(int vm_number) {
+    E810EmulatedDevice *this_ = this;
+    size_t work = 0;
+
+    // deferred interrupts are sent by polling, so don't back off while one is pending
+    work += this_->processAllPollTimers();
 
     auto ptp_target_vm = this_->ptp_target_vm_idx.load();
 
@@ -131,8 +216,10 @@ public:
     this_->driver->recv(vm_number); // recv assumes the Device does not handle packet of other VMs until recv_consumed()!
     for (unsigned q_idx = 0; q_idx < this_->driver->max_queues_per_vm; q_idx++) {
       auto &rxq = this_->driver->get_rx_queue(vm_number, q_idx);
+      work += rxq.nb_bufs_used;
       for (uint16_t i = 0; i < rxq.nb_bufs_used; i++) {
         auto &rxBuf = rxq.rxBufs[i];
+        const char *packet = rxBuf.linear(this_->rx_linear.get());
 
         // handle PTP mediation
         if (ptp_target_vm != -1) { // we are default queue and PTP mediation is enabled
@@ -140,46 +227,65 @@ public:
           // TODO avoid this overhead by using queue 0 for the last available VM
 
           // check rx packets for PTP multicasts
-          char* packet = rxBuf.data;
           auto len = rxBuf.used;
           if (len >= sizeof(struct ether_header)) {
             struct ethhdr* packet_hdr = (struct ethhdr*) packet;
             uint64_t dst_mac = 0xFFFFFFFFFFFF & *(uint64_t*)(packet_hdr->h_dest);
             if (dst_mac == 0x000000191b01) { // PTP MAC 01:1b:19:00:00:00
-              auto descriptor = vmux_descriptor_alloc(len);
-              memcpy(descriptor->buf, packet, len);
-              // TODO push to other device
               auto second_vm = (*this_->broadcast_destinations)[ptp_target_vm];
-              if (!second_vm->inject_packets.push(descriptor)) {
+              auto descriptor = vmux_descriptor_alloc(len);
+              if (descriptor) {
+                memcpy(descriptor->buf, packet, len);
+                if (second_vm->inject_packet(this_->device_id, descriptor)) {
+                  second_vm->wake_rx();
+                  printf("pushed PTP packet to VM %d\n", ptp_target_vm);
+                  continue; // don't deliver this packet to our VM, we already delivered it to another one
+                }
                 // if injection queue is full, drop packet
                 vmux_descriptor_free(descriptor);
-              } else {
-                printf("pushed PTP packet to VM %d\n", ptp_target_vm);
-                continue; // don't deliver this packet to our VM, we already delivered it to another one
               }
             }
           }
         }
 
         // normal case (process rx for our VM)
-        this_->vfu_ctx_mutex.lock();
-        this_->model->EthRx(0, rxBuf.queue, rxBuf.data, rxBuf.used); // hardcode port 0
-        this_->vfu_ctx_mutex.unlock();
-
+        this_->rx_burst.push_back({ rxBuf.queue, packet, rxBuf.used, &rxBuf.meta });
+        if (UNLIKELY(rxBuf.segmented())) // the next segmented packet reuses rx_linear
+          this_->rx_burst_flush();
 			}
 		}
+    this_->rx_burst_flush();
     this_->driver->recv_consumed(vm_number);
 
+    // don't let tx packets linger in the driver's staging area. Packets that
+    // are not due yet count as pending work, so the poller does not sleep
+    // past their flush timeout.
+    if (UNLIKELY(this_->driver->tx_staged(vm_number))) {
+      this_->callbacks->EthFlush(true);
+      work += this_->driver->tx_staged(vm_number);
+    }
+
     // check if we received packets from other threads
-    // TODO we can extract that into a function called by the sending thread
-    vmux_descriptor *packet_descriptor;
-    if (UNLIKELY(this_->inject_packets.pop(packet_descriptor))) {
+    if (UNLIKELY(this_->has_injected())) {
       // TODO send these packets first
-      this_->vfu_ctx_mutex.lock();
-      this_->model->EthRx(0, {}, packet_descriptor->buf, packet_descriptor->len); // hardcode port 0
-      this_->vfu_ctx_mutex.unlock();
-      vmux_descriptor_free(packet_descriptor);
+      std::shared_lock dma_lock(this_->dma_mutex);
+      work += this_->drain_injected([this_](vmux_descriptor *packet_descriptor) {
+        this_->model->EthRx(0, {}, packet_descriptor->buf, packet_descriptor->len); // hardcode port 0
+        vmux_descriptor_free(packet_descriptor);
+      });
     }
+    return work;
+  }
+
+  // Pass all packets of rx_burst to the model at once: it takes its locks,
+  // writes back descriptors and signals interrupts once per burst.
+  void rx_burst_flush() {
+    if (this->rx_burst.empty())
+      return;
+    std::shared_lock dma_lock(this->dma_mutex);
+    this->model->EthRxBurst(0, this->rx_burst); // hardcode port 0
+    dma_lock.unlock();
+    this->rx_burst.clear();
   }
 
   void init_pci_ids() {
@@ -204,7 +310,7 @@ public:
 
     bool policy_accepts = this->policies->switchPolicy.add_switch_rule(vm_id, dst_addr, dst_queue);
     if (policy_accepts) {
-      bool rule_installed = driver->add_switch_rule(vm_id, dst_addr, dst_queue);
+      rule_installed = driver->add_switch_rule(vm_id, dst_addr, dst_queue);
     }
 
     this->policies->mutex.unlock();
@@ -217,13 +323,20 @@ public:
 
     bool policy_accepts = true; // this->policies->switchPolicy.add_switch_rule(vm_id, dst_addr, dst_queue); // etype is always fine, given that we merge it with the dstMAac matching rule
     if (policy_accepts) {
-      bool rule_installed = driver->add_switch_rule(vm_id, (uint8_t*)this->mac_addr, ethertype, dst_queue);
+      rule_installed = driver->add_switch_rule(vm_id, (uint8_t*)this->mac_addr, ethertype, dst_queue);
     }
 
     this->policies->mutex.unlock();
     return rule_installed;
   }
 
+  bool del_switch_etype_rule(int vm_id, uint16_t ethertype, uint16_t dst_queue) {
+    this->policies->mutex.lock();
+    bool rule_removed = driver->del_switch_rule(vm_id, (uint8_t*)this->mac_addr, ethertype, dst_queue);
+    this->policies->mutex.unlock();
+    return rule_removed;
+  }
+
 private:
   void init_general_callbacks(VfioUserServer &vfu) {
     int ret;
@@ -267,6 +380,53 @@ private:
     }
   }
 
+  // Register shadow ioeventfds for the tail registers. KVM completes guest
+  // writes to them without exiting to QEMU: it stores the value in shadow
+  // memory and signals the eventfd. Registers without one (e.g. if the VMM
+  // does not support them) are still written through vfio-user messages.
+  // libvfio-user cannot remove an ioeventfd again, so a failure only affects
+  // the doorbell it happened for.
+  void init_doorbells(VfioUserServer &vfu) {
+    this->doorbell_shadow = std::make_unique<MemFd>("vmux-doorbells", 2 * DOORBELL_QUEUES * sizeof(uint32_t));
+    this->doorbell_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->doorbell_epfd < 0)
+      die("cannot create doorbell epoll fd");
+
+    size_t failed = 0;
+    for (unsigned q = 0; q < DOORBELL_QUEUES; q++) {
+      const struct {
+        const char *name;
+        uint32_t reg;
+      } regs[] = { { "QTX_COMM_DBELL", (uint32_t)QTX_COMM_DBELL(q) },
+                   { "QRX_TAIL", (uint32_t)QRX_TAIL(q) } };
+      for (auto &[name, reg] : regs) {
+        uint32_t idx = this->doorbells.size();
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+          die("cannot create doorbell eventfd");
+        // no datamatch: every value is a valid tail
+        int ret = vfu_create_ioeventfd(vfu.vfu_ctx, E810EmulatedDevice::BAR_REGS, fd, reg,
+                                       sizeof(uint32_t), 0, 0, this->doorbell_shadow->fd(),
+                                       idx * sizeof(uint32_t));
+        if (ret < 0) {
+          printf("WARN: cannot create ioeventfd for %s(%u) at 0x%x (%s), using vfio-user messages for it\n",
+                 name, q, reg, strerror(errno));
+          close(fd);
+          failed++;
+          continue;
+        }
+        struct epoll_event e = {};
+        e.events = EPOLLIN;
+        e.data.u32 = idx;
+        if (epoll_ctl(this->doorbell_epfd, EPOLL_CTL_ADD, fd, &e) != 0)
+          die("cannot register doorbell eventfd to epoll");
+        this->doorbells.push_back({ fd, reg });
+      }
+    }
+    if_log_level(LOG_INFO, printf("Registered %zu doorbell ioeventfds (%zu failed)\n",
+                                  this->doorbells.size(), failed));
+  }
+
   void init_irqs(VfioUserServer &vfu) {
     int ret = vfu_setup_device_nr_irqs(
       vfu.vfu_ctx, VFU_DEV_MSIX_IRQ, NUM_MSIX_IRQs);
@@ -280,6 +440,8 @@ private:
                              [[maybe_unused]] vfu_reset_type_t type) {
     E810EmulatedDevice *device = (E810EmulatedDevice *)vfu_get_private(vfu_ctx);
     printf("resetting device\n"); // this happens at VM boot
+    // the guest installs its switch rules again, drop the ones of its previous life
+    device->driver->del_switch_rules(device->device_id);
     // device->model->SignalInterrupt(1, 1); // just as an example: do stuff
     return 0;
   }
@@ -287,8 +449,9 @@ private:
   static void dma_register_cb([[maybe_unused]] vfu_ctx_t *vfu_ctx,
                               [[maybe_unused]] vfu_dma_info_t *info) {
     printf("dma register cb\n");
-    std::shared_ptr<VfioUserServer> vfu_ =
-        ((E810EmulatedDevice *)vfu_get_private(vfu_ctx))->vfuServer;
+    E810EmulatedDevice *device = (E810EmulatedDevice *)vfu_get_private(vfu_ctx);
+    std::lock_guard dma_lock(device->dma_mutex);
+    std::shared_ptr<VfioUserServer> vfu_ = device->vfuServer;
     VfioUserServer *vfu =
         vfu_.get(); // lets hope vfu_ stays around until end of this function
                     // and map_dma_here only borrows vfu
@@ -299,8 +462,9 @@ private:
   static void dma_unregister_cb([[maybe_unused]] vfu_ctx_t *vfu_ctx,
                                 [[maybe_unused]] vfu_dma_info_t *info) {
     printf("dma unregister cb\n");
-    std::shared_ptr<VfioUserServer> vfu_ =
-        ((E810EmulatedDevice *)vfu_get_private(vfu_ctx))->vfuServer;
+    E810EmulatedDevice *device = (E810EmulatedDevice *)vfu_get_private(vfu_ctx);
+    std::lock_guard dma_lock(device->dma_mutex);
+    std::shared_ptr<VfioUserServer> vfu_ = device->vfuServer;
     VfioUserServer *vfu =
         vfu_.get(); // lets hope vfu_ stays around until end of this function
                     // and map_dma_here only borrows vfu
@@ -334,10 +498,17 @@ private:
       int flags = Util::convert_flags(region.flags);
       flags |= VFU_REGION_FLAG_RW;
       if (idx == E810EmulatedDevice::BAR_REGS) { // the bm only serves registers on bar 2
+        // Only pages without side effects may be mmapped: guest writes to
+        // them never reach the model.
+        this->bar_mirror = std::make_unique<MemFd>("vmux-e810-bar0", (size_t)region.len);
+        std::vector<struct iovec> mmap_areas;
+        for (auto &[offset, len] : e810::e810_bm::reg_mirror_ranges())
+          mmap_areas.push_back({ (void *)offset, len });
         ret = vfu_setup_region(vfu.vfu_ctx, idx, region.len,
-                               &(this->expected_access_callback), flags, NULL,
-                               0,      // nr. items in bar_mmap_areas
-                               -1, 0); // fd -1 and offset 0 because fd is unused
+                               &(this->expected_access_callback), flags,
+                               mmap_areas.data(), mmap_areas.size(),
+                               this->bar_mirror->fd(), 0);
+        this->model->set_reg_mirror(this->bar_mirror->ptr());
       } else {
         ret = vfu_setup_region(vfu.vfu_ctx, idx, region.len,
                                &(this->unexpected_access_callback), flags, NULL,
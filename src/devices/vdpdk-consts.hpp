@@ -11,8 +11,31 @@ namespace VDPDK_CONSTS {
   // Set if buffer is attached to an mbuf
   constexpr uint16_t TX_FLAG_ATTACHED = 1 << 1;
 
+  // Extensions of the guest interface. The guest reads the offered ones
+  // from the FEATURES register and writes back those it supports before it
+  // starts its rx queues. Without them, vmux behaves as if they didn't exist.
+  // packets may span several rx descriptors (RX_FLAG_MORE)
+  constexpr uint64_t FEATURE_RX_MULTI_DESC = 1;
+  // rx descriptors carry offload metadata (RX_OL_*)
+  constexpr uint64_t FEATURE_RX_META = 1 << 1;
+  constexpr uint64_t FEATURES_OFFERED = FEATURE_RX_MULTI_DESC | FEATURE_RX_META;
+
   constexpr size_t RX_DESC_SIZE = 0x20;
   constexpr uint16_t RX_FLAG_AVAIL = 1;
+  // Set on all but the last descriptor of a packet spread over several
+  // buffers (FEATURE_RX_MULTI_DESC)
+  constexpr uint16_t RX_FLAG_MORE = 1 << 1;
+  constexpr size_t MAX_RX_DESCS_PER_PKT = 16;
+  // Offload metadata, valid in the first descriptor of a packet
+  // (FEATURE_RX_META):
+  // u32 rss hash @12, u32 RTE_PTYPE_* @16, u16 vlan tci @20, u16 RX_OL_* @22
+  constexpr uint16_t RX_OL_RSS_HASH = 1;
+  constexpr uint16_t RX_OL_VLAN_STRIPPED = 1 << 1;
+  constexpr uint16_t RX_OL_IP_CKSUM_GOOD = 1 << 2;
+  constexpr uint16_t RX_OL_IP_CKSUM_BAD = 1 << 3;
+  constexpr uint16_t RX_OL_L4_CKSUM_GOOD = 1 << 4;
+  constexpr uint16_t RX_OL_L4_CKSUM_BAD = 1 << 5;
 
   constexpr size_t MAX_RX_QUEUES = 4;
+  constexpr size_t MAX_TX_QUEUES = 4;
 };
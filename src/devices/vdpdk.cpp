@@ -24,23 +24,43 @@ enum VDPDK_OFFSET {
   FLOW_CREATE = 0x200,
   FLOW_DESTROY = 0x240,
 
+  FEATURES = 0x280,
+
 };
 
-VdpdkDevice::VdpdkDevice(int device_id, std::shared_ptr<Driver> driver, const uint8_t (*mac_addr)[6])
+// Flow handles returned by FLOW_CREATE: valid bit | queue << 16 | ethertype
+static constexpr uint64_t FLOW_HANDLE_VALID = 1ULL << 32;
+
+VdpdkDevice::VdpdkDevice(int device_id, std::shared_ptr<Driver> driver, const uint8_t (*mac_addr)[6],
+                         size_t zero_copy_min_len)
 : VmuxDevice(device_id, driver, nullptr),
   txCtl{"vdpdk_tx", REGION_SIZE},
   rxCtl{"vdpdk_rx", REGION_SIZE},
   flowbuf{"vdpdk_flow", 0x1000},
-  dpdk_driver(std::dynamic_pointer_cast<Dpdk>(driver)) {
+  dpdk_driver(std::dynamic_pointer_cast<Dpdk>(driver)),
+  zero_copy_min_len(zero_copy_min_len) {
   if (!dpdk_driver) {
     die("Using vDPDK without the DPDK backend is not supported.");
   }
+  // every vDPDK tx queue gets its own DPDK tx queue
+  if (dpdk_driver->max_queues_per_vm < MAX_TX_QUEUES) {
+    die("vDPDK needs %zu DPDK queues per VM.", MAX_TX_QUEUES);
+  }
   if (rte_eal_iova_mode() != RTE_IOVA_VA) {
     die("vDPDK only supports virtual address IOVA mode. (Try using DPDK with --iova-mode=va)");
   }
 
   memcpy(this->mac_addr, mac_addr, 6);
 
+  if (zero_copy_min_len) {
+    // We need to reclaim zero-copy buffers before guest memory is unmapped
+    int ret = rte_eth_tx_done_cleanup(0, dpdk_driver->get_tx_queue_id(device_id, 0), 0);
+    if (ret == -ENOTSUP) {
+      printf("vDPDK: NIC does not support tx_done_cleanup, disabling zero-copy tx\n");
+      this->zero_copy_min_len = 0;
+    }
+  }
+
   // TODO figure out appropriate IDs
   this->info.pci_vendor_id = 0x1af4; // Red Hat Virtio Devices
   this->info.pci_device_id = 0x7abc; // Unused
@@ -56,6 +76,8 @@ VdpdkDevice::VdpdkDevice(int device_id, std::shared_ptr<Driver> driver, const ui
 
 void VdpdkDevice::setup_vfu(std::shared_ptr<VfioUserServer> vfu) {
   this->vfuServer = std::move(vfu);
+  // The NIC reads zero-copy buffers from guest memory directly
+  this->vfuServer->dpdk_dma_map = zero_copy_min_len != 0;
   auto ctx = this->vfuServer->vfu_ctx;
 
   int region_flags = VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM;
@@ -98,13 +120,15 @@ void VdpdkDevice::setup_vfu(std::shared_ptr<VfioUserServer> vfu) {
   }
 }
 
-void VdpdkDevice::rx_callback_fn(bool dma_invalidated) {
+unsigned VdpdkDevice::rx_callback_fn(bool dma_invalidated) {
   int vm_number = device_id;
+  unsigned nb_rx = 0;
   driver->recv(vm_number);
 
   for (unsigned q_idx = 0; q_idx < driver->max_queues_per_vm; q_idx++) {
     // We delay loading this until we actually know if packets were received
     std::shared_ptr<RxQueue> rxq{};
+    size_t rxq_target = 0;
     size_t ring_size;
     unsigned char *ring;
 
@@ -112,10 +136,13 @@ void VdpdkDevice::rx_callback_fn(bool dma_invalidated) {
     for (uint16_t i = 0; i < driver_rxq.nb_bufs_used; i++) {
       // If we reach this point, at least one packet was received
       auto &driver_rxBuf = driver_rxq.rxBufs[i];
+      // The driver may classify packets of rules it could not offload to the NIC
+      size_t target = driver_rxBuf.queue.value_or(q_idx);
 
       // Lock and load rx_queue parameters
-      if (!rxq) {
-        size_t rx_queues_idx = (size_t)q_idx % MAX_RX_QUEUES;
+      if (!rxq || target != rxq_target) {
+        rxq_target = target;
+        size_t rx_queues_idx = target % MAX_RX_QUEUES;
         rxq = rx_queues[rx_queues_idx].load();
         // If a queue with this index does not exist, fall back to queue 0
         // TODO: Maybe use a smarter mapping? For example in the case of
@@ -129,7 +156,7 @@ void VdpdkDevice::rx_callback_fn(bool dma_invalidated) {
         }
 
         ring_size = ((size_t)rxq->idx_mask + 1) * RX_DESC_SIZE;
-        ring = (unsigned char *)vfuServer->dma_local_addr(rxq->ring_iova, ring_size);
+        ring = ring_local_addr(rxq->ring_iova, ring_size);
         if (!ring) {
           printf("DMA unmapped during RX poll\n");
           break;
@@ -139,50 +166,116 @@ void VdpdkDevice::rx_callback_fn(bool dma_invalidated) {
       // if (i == 0)
       //   printf("recv: %u pkts on queue %u\n", (unsigned)driver_rxq.nb_bufs_used, q_idx);
 
-      unsigned char *buf_iova_addr = ring + (size_t)(rxq->idx & rxq->idx_mask) * RX_DESC_SIZE;
-      unsigned char *buf_len_addr = buf_iova_addr + 8;
-      unsigned char *desc_flags_addr = buf_len_addr + 2;
-
-      uint16_t flags = rte_read16(desc_flags_addr);
-      // If next descriptor is not available, we are out of buffers
-      if (!(flags & RX_FLAG_AVAIL)) {
+      if (!this->rx_place(*rxq, ring, driver_rxBuf))
         break;
-      }
-
-      // If FLAG_AVAIL is set, we own the buffer and can copy the packet into it
-      uint64_t buf_iova;
-      memcpy(&buf_iova, buf_iova_addr, 8);
-      uint16_t buf_len;
-      memcpy(&buf_len, buf_len_addr, 2);
-      void *buf_addr = vfuServer->dma_local_addr(buf_iova, buf_len);
-      if (!buf_addr) {
-        printf("Invalid packet iova!\n");
-        break;
-      }
+      nb_rx++;
+    }
+  }
 
-      // Check sizes
-      size_t pkt_len = driver_rxBuf.used;
-      uint16_t pkt_len_u16 = pkt_len;
-      if (pkt_len > buf_len || pkt_len > pkt_len_u16) {
-        printf("Packet too large (%lx > %x)\n", (unsigned long)pkt_len, (unsigned)buf_len);
-        break;
-      }
+  driver->recv_consumed(vm_number);
+  return nb_rx;
+}
 
-      // Copy data
-      memcpy(buf_addr, driver_rxBuf.data, pkt_len);
-      memcpy(buf_len_addr, &pkt_len_u16, 2);
+// Fill the offload metadata fields of the first rx descriptor of a packet
+static void rx_write_meta(unsigned char *desc, const Driver::RxMeta &meta) {
+  using L3 = Driver::RxMeta::L3;
+  using L4 = Driver::RxMeta::L4;
+  uint32_t ptype = RTE_PTYPE_UNKNOWN;
+  if (meta.l3_type != L3::UNKNOWN) {
+    ptype = RTE_PTYPE_L2_ETHER |
+            (meta.l3_type == L3::IPV4 ? RTE_PTYPE_L3_IPV4_EXT_UNKNOWN : RTE_PTYPE_L3_IPV6_EXT_UNKNOWN);
+    switch (meta.l4_type) {
+      case L4::NONE: ptype |= RTE_PTYPE_L4_NONFRAG; break;
+      case L4::FRAG: ptype |= RTE_PTYPE_L4_FRAG; break;
+      case L4::TCP: ptype |= RTE_PTYPE_L4_TCP; break;
+      case L4::UDP: ptype |= RTE_PTYPE_L4_UDP; break;
+      case L4::SCTP: ptype |= RTE_PTYPE_L4_SCTP; break;
+      case L4::ICMP: ptype |= RTE_PTYPE_L4_ICMP; break;
+      default: break;
+    }
+  }
 
-      // Release buffer back to VM
-      flags &= ~RX_FLAG_AVAIL;
-      rte_write16(flags, desc_flags_addr);
+  uint16_t ol = 0;
+  if (meta.flags & Driver::RxMeta::RSS_HASH) ol |= RX_OL_RSS_HASH;
+  if (meta.flags & Driver::RxMeta::VLAN_STRIPPED) ol |= RX_OL_VLAN_STRIPPED;
+  if (meta.flags & Driver::RxMeta::L3_CSUM_GOOD) ol |= RX_OL_IP_CKSUM_GOOD;
+  if (meta.flags & Driver::RxMeta::L3_CSUM_BAD) ol |= RX_OL_IP_CKSUM_BAD;
+  if (meta.flags & Driver::RxMeta::L4_CSUM_GOOD) ol |= RX_OL_L4_CKSUM_GOOD;
+  if (meta.flags & Driver::RxMeta::L4_CSUM_BAD) ol |= RX_OL_L4_CKSUM_BAD;
+
+  memcpy(desc + 12, &meta.rss_hash, 4);
+  memcpy(desc + 16, &ptype, 4);
+  memcpy(desc + 20, &meta.vlan_tci, 2);
+  memcpy(desc + 22, &ol, 2);
+}
 
-      // Go to next descriptor
-      // Index wraps naturally on overflow
-      rxq->idx++;
+bool VdpdkDevice::rx_place(RxQueue &rxq, unsigned char *ring, const Driver::RxBuf &pkt) {
+  // Find enough available descriptors. Packets larger than one guest buffer
+  // are spread over several, all but the last flagged RX_FLAG_MORE. Guests
+  // that don't know RX_FLAG_MORE only get packets that fit into one.
+  unsigned char *descs[MAX_RX_DESCS_PER_PKT];
+  // guest buffers may span several regions
+  struct iovec bufs[MAX_RX_DESCS_PER_PKT][MAX_BUF_SEGS];
+  size_t buf_nb_segs[MAX_RX_DESCS_PER_PKT];
+  uint16_t buf_lens[MAX_RX_DESCS_PER_PKT];
+  size_t max_descs = (rxq.features & FEATURE_RX_MULTI_DESC) ? MAX_RX_DESCS_PER_PKT : 1;
+  size_t nb_descs = 0;
+  size_t space = 0;
+  do {
+    if (nb_descs == max_descs || nb_descs > rxq.idx_mask) {
+      printf("Packet too large (%lx > %lx)\n", (unsigned long)pkt.used, (unsigned long)space);
+      return false;
+    }
+    // Index wraps naturally on overflow
+    uint16_t idx = rxq.idx + nb_descs;
+    unsigned char *desc = ring + (size_t)(idx & rxq.idx_mask) * RX_DESC_SIZE;
+    uint16_t flags = rte_read16(desc + 10);
+    // If next descriptor is not available, we are out of buffers
+    if (!(flags & RX_FLAG_AVAIL))
+      return false;
+
+    // If FLAG_AVAIL is set, we own the buffer and can copy the packet into it
+    uint64_t buf_iova;
+    memcpy(&buf_iova, desc, 8);
+    uint16_t buf_len;
+    memcpy(&buf_len, desc + 8, 2);
+    buf_nb_segs[nb_descs] = vfuServer->dma_local_sgl(buf_iova, buf_len, bufs[nb_descs], MAX_BUF_SEGS);
+    if (!buf_nb_segs[nb_descs] && buf_len > 0) {
+      printf("Invalid packet iova!\n");
+      return false;
+    }
+    descs[nb_descs] = desc;
+    buf_lens[nb_descs] = buf_len;
+    nb_descs++;
+    space += buf_len;
+  } while (space < pkt.used);
+
+  // Copy data
+  size_t off = 0;
+  for (size_t d = 0; d < nb_descs; d++) {
+    uint16_t len = std::min<size_t>(pkt.used - off, buf_lens[d]);
+    memcpy(descs[d] + 8, &len, 2);
+    for (size_t s = 0; s < buf_nb_segs[d] && len > 0; s++) {
+      size_t seg_len = std::min<size_t>(len, bufs[d][s].iov_len);
+      pkt.copy_out(off, (char *)bufs[d][s].iov_base, seg_len);
+      off += seg_len;
+      len -= seg_len;
     }
   }
+  if (rxq.features & FEATURE_RX_META)
+    rx_write_meta(descs[0], pkt.meta);
+
+  // Release buffers back to VM. The first one goes last, so the whole packet
+  // is there once the guest sees it.
+  for (size_t d = nb_descs; d-- > 0;) {
+    uint16_t flags = rte_read16(descs[d] + 10) & ~(RX_FLAG_AVAIL | RX_FLAG_MORE);
+    if (d + 1 < nb_descs)
+      flags |= RX_FLAG_MORE;
+    rte_write16(flags, descs[d] + 10);
+  }
 
-  driver->recv_consumed(vm_number);
+  rxq.idx += nb_descs;
+  return true;
 }
 
 // void VdpdkDevice::rx_callback_static(int vm_number, void *this__) {
@@ -224,13 +317,13 @@ ssize_t VdpdkDevice::region_access_write(char *buf, size_t count, unsigned offse
       if (count != 2) return -1;
       uint16_t queue_idx;
       memcpy(&queue_idx, buf, 2);
-      if (queue_idx != 0) {
+      if (queue_idx >= MAX_TX_QUEUES) {
         printf("TX_QUEUE_STOP: Invalid queue idx %d", (int)queue_idx);
         return count;
       }
 
       // Stop polling
-      tx_queue = nullptr;
+      tx_queues[queue_idx] = nullptr;
       return count;
     }
 
@@ -247,12 +340,28 @@ ssize_t VdpdkDevice::region_access_write(char *buf, size_t count, unsigned offse
       return count;
     }
 
+    case FEATURES: {
+      if (count != 8) return -1;
+      uint64_t acked;
+      memcpy(&acked, buf, 8);
+      features = acked & FEATURES_OFFERED;
+      printf("FEATURES: guest acknowledged %lx\n", (unsigned long)features.load());
+      return count;
+    }
+
     case FLOW_DESTROY: {
       if (count != 8) return -1;
       uint64_t handle;
       memcpy(&handle, buf, 8);
 
-      // TODO: actually disable rule
+      if (!(handle & FLOW_HANDLE_VALID)) {
+        printf("FLOW_DESTROY: Invalid handle %lx\n", (unsigned long)handle);
+        return count;
+      }
+      uint16_t etype = handle & 0xFFFF;
+      uint16_t queue_idx = (handle >> 16) & 0xFFFF;
+      if (!driver->del_switch_rule(device_id, mac_addr, etype, queue_idx))
+        printf("FLOW_DESTROY: No rule for handle %lx\n", (unsigned long)handle);
       return count;
     }
   }
@@ -280,7 +389,7 @@ ssize_t VdpdkDevice::region_access_read(char *buf, size_t count, unsigned offset
       if (count != 1) return -1;
       uint16_t queue_idx;
       memcpy(&queue_idx, txCtl.ptr() + 10, 2);
-      if (queue_idx != 0) {
+      if (queue_idx >= MAX_TX_QUEUES) {
         printf("TX_QUEUE_START: Invalid queue idx %d", (int)queue_idx);
         *buf = 1;
         return count;
@@ -293,6 +402,11 @@ ssize_t VdpdkDevice::region_access_read(char *buf, size_t count, unsigned offset
 
       printf("TX_QUEUE_START: idx: %d, ring_addr: %llx, mask: %x\n",
              (int)queue_idx, (unsigned long long)ring_addr, (unsigned)idx_mask);
+      if (!ring_local_addr(ring_addr, ((size_t)idx_mask + 1) * TX_DESC_SIZE)) {
+        printf("TX_QUEUE_START: ring is not mapped contiguously\n");
+        *buf = 1;
+        return count;
+      }
 
       auto txq = std::make_shared<TxQueue>();
       txq->ring_iova = ring_addr;
@@ -300,8 +414,11 @@ ssize_t VdpdkDevice::region_access_read(char *buf, size_t count, unsigned offset
       txq->front_idx = 0;
       txq->back_idx = 0;
       txq->ring = NULL;
+      txq->dpdk_queue_idx = dpdk_driver->get_tx_queue_id(device_id, queue_idx);
+      txq->nb_inflight = 0;
+      txq->completed = std::make_unique<bool[]>((size_t)idx_mask + 1);
 
-      tx_queue = txq;
+      tx_queues[queue_idx] = txq;
 
       *buf = 0;
       return count;
@@ -324,11 +441,17 @@ ssize_t VdpdkDevice::region_access_read(char *buf, size_t count, unsigned offset
 
       printf("RX_QUEUE_START: idx: %d, ring_addr: %llx, mask: %x\n",
              (int)queue_idx, (unsigned long long)ring_addr, (unsigned)idx_mask);
+      if (!ring_local_addr(ring_addr, ((size_t)idx_mask + 1) * RX_DESC_SIZE)) {
+        printf("RX_QUEUE_START: ring is not mapped contiguously\n");
+        *buf = 1;
+        return count;
+      }
 
       auto rxq = std::make_shared<RxQueue>();
       rxq->ring_iova = ring_addr;
       rxq->idx_mask = idx_mask;
       rxq->idx = 0;
+      rxq->features = features.load();
 
       rx_queues[queue_idx] = rxq;
 
@@ -336,6 +459,13 @@ ssize_t VdpdkDevice::region_access_read(char *buf, size_t count, unsigned offset
       return count;
     }
 
+    case FEATURES: {
+      if (count != 8) return -1;
+      uint64_t offered = FEATURES_OFFERED;
+      memcpy(buf, &offered, 8);
+      return count;
+    }
+
     case FLOW_CREATE: {
       if (count != 8) return -1;
 
@@ -386,10 +516,10 @@ ssize_t VdpdkDevice::region_access_read(char *buf, size_t count, unsigned offset
       }
 
       uint16_t etype = rte_be_to_cpu_16(spec.type);
-      // Don't need handles for now, because we cannot remove rules, so return dummy value
+      // The handle encodes the rule itself, the driver refcounts identical rules
       uint64_t ret =
         driver->add_switch_rule(device_id, mac_addr, etype, action.index)
-        ? 0 : -1;
+        ? FLOW_HANDLE_VALID | ((uint64_t)action.index << 16) | etype : -1;
       memcpy(buf, &ret, 8);
 
       return count;
@@ -400,13 +530,27 @@ ssize_t VdpdkDevice::region_access_read(char *buf, size_t count, unsigned offset
   return -1;
 }
 
-void VdpdkDevice::tx_poll(bool dma_invalidated) {
+unsigned VdpdkDevice::tx_poll(bool dma_invalidated) {
+  unsigned nb_desc = 0;
+  for (size_t q_idx = 0; q_idx < MAX_TX_QUEUES; q_idx++) {
+    nb_desc += tx_poll_queue(q_idx, dma_invalidated);
+  }
+  return nb_desc;
+}
+
+unsigned VdpdkDevice::tx_poll_queue(size_t q_idx, bool dma_invalidated) {
   constexpr bool DEBUG_OUTPUT = false;
-  constexpr bool ZERO_COPY = false;
 
+  auto &tx_queue = tx_queues[q_idx];
   std::shared_ptr<TxQueue> queue_data = tx_queue.load();
+  if (queue_data != tx_polled[q_idx]) {
+    // The queue was stopped or restarted. The old one may still have buffers
+    // in flight, which point back to it.
+    tx_drain_queue(tx_polled[q_idx].get());
+    tx_polled[q_idx] = queue_data;
+  }
   if (!queue_data) {
-    return;
+    return 0;
   }
 
   uint16_t &idx = queue_data->back_idx;
@@ -415,50 +559,22 @@ void VdpdkDevice::tx_poll(bool dma_invalidated) {
   size_t ring_size = ((size_t)idx_mask + 1) * TX_DESC_SIZE;
 
   if (dma_invalidated || !queue_data->ring) {
-    unsigned char *ring = (unsigned char *)vfuServer->dma_local_addr(queue_data->ring_iova, ring_size);
+    unsigned char *ring = ring_local_addr(queue_data->ring_iova, ring_size);
     queue_data->ring = ring;
     if (!ring) {
       printf("Invalid ring_iova\n");
       tx_queue = nullptr;
-      return;
+      return 0;
     }
   }
 
-  uint16_t queue_idx = dpdk_driver->get_tx_queue_id(device_id, 0);
+  uint16_t queue_idx = queue_data->dpdk_queue_idx;
   struct rte_mempool *pool = dpdk_driver->tx_mbuf_pools[queue_idx];
-  // assert(rte_pktmbuf_priv_size(pool) >= sizeof(struct rte_mbuf_ext_shared_info) + TX_DESC_SIZE);
 
   constexpr unsigned burst_size = 128;
   struct rte_mbuf *mbufs[burst_size];
   unsigned nb_mbufs_used = 0;
-
-  rte_mbuf_extbuf_free_callback_t free_cb;
-  if constexpr (ZERO_COPY) {
-    free_cb = [](void *addr, void *opaque) {
-      // opaque points to the copied descriptor, with the dma address replaced
-      // with a pointer to the queue data;
-      uintptr_t uptr;
-      TxQueue *queue_data;
-      memcpy(&uptr, opaque, sizeof(uptr));
-      queue_data = (TxQueue *)uptr;
-
-      unsigned char *desc_addr = queue_data->ring +
-                                 (size_t)(queue_data->front_idx & queue_data->idx_mask) * TX_DESC_SIZE;
-      // TODO: can be removed
-      // It should be impossible that a buffer is freed without a corresponding available descriptor
-      uint16_t flags = rte_read16_relaxed(desc_addr + 10);
-      assert(flags & TX_FLAG_AVAIL);
-
-      // Copy descriptor into ring, skipping the dma/queue pointer
-      rte_memcpy(desc_addr + 8, (char *)opaque + 8, TX_DESC_SIZE - 8);
-      // Unset FLAG_AVAIL to return buffer to guest
-      memcpy(&flags, (char *)opaque + 10, 2);
-      flags &= ~TX_FLAG_AVAIL;
-      rte_write16(flags, (char *)desc_addr + 10);
-
-      queue_data->front_idx++;
-    };
-  }
+  unsigned nb_desc = 0;
 
   constexpr unsigned debug_interval = 10000000;
   thread_local unsigned debug_counter = debug_interval;
@@ -521,17 +637,15 @@ void VdpdkDevice::tx_poll(bool dma_invalidated) {
       break;
     }
 
-    if constexpr (ZERO_COPY) {
-      // If this buffer is attached to an mbuf, we fully wrapped around and need
-      // to wait until this descriptor was sent by DPDK.
-      if (flags & TX_FLAG_ATTACHED) {
-        int freed = rte_eth_tx_done_cleanup(0, queue_idx, 0);
-        if constexpr (DEBUG_OUTPUT) {
-          nb_cleanup_calls++;
-          last_cleanup_result = freed;
-        }
-        break;
+    // If this buffer is still attached to an mbuf, we fully wrapped around and
+    // need to wait until this descriptor was sent by DPDK.
+    if ((uint16_t)(idx - queue_data->front_idx) > idx_mask) {
+      int freed = rte_eth_tx_done_cleanup(0, queue_idx, 0);
+      if constexpr (DEBUG_OUTPUT) {
+        nb_cleanup_calls++;
+        last_cleanup_result = freed;
       }
+      break;
     }
 
     // If FLAG_AVAIL is set, we own the buffer and need to send it
@@ -539,11 +653,13 @@ void VdpdkDevice::tx_poll(bool dma_invalidated) {
     memcpy(&buf_iova, buf_iova_addr, 8);
     uint16_t buf_len;
     memcpy(&buf_len, buf_len_addr, 2);
-    void *buf_addr = vfuServer->dma_local_addr(buf_iova, buf_len);
-    if (!buf_addr) {
+    struct iovec bufs[MAX_BUF_SEGS];
+    size_t nb_segs = vfuServer->dma_local_sgl(buf_iova, buf_len, bufs, MAX_BUF_SEGS);
+    if (!nb_segs && buf_len > 0) {
       printf("Invalid packet iova!\n");
       tx_queue = nullptr;
-      return;
+      // still send (and complete) what we have
+      break;
     }
 
     // Create pktmbuf
@@ -559,50 +675,58 @@ void VdpdkDevice::tx_poll(bool dma_invalidated) {
       }
       break;
     }
-    if (rte_pktmbuf_tailroom(mbuf) < buf_len) {
-      // Packet too large, drop it
-      printf("Packet from VM is too large for buffer.\n");
-      rte_pktmbuf_free(mbuf);
-    } else {
-      if constexpr (ZERO_COPY) {
-        // Initialize shared data info and copy descriptor into mbuf
-        auto shinfo = (struct rte_mbuf_ext_shared_info *)rte_mbuf_to_priv(mbuf);
-        unsigned char *mbuf_desc = (unsigned char *)rte_mbuf_to_priv(mbuf) + sizeof(*shinfo);
-        shinfo->free_cb = free_cb;
-        shinfo->fcb_opaque = mbuf_desc;
-        rte_mbuf_ext_refcnt_set(shinfo, 1);
-        memcpy(mbuf_desc + 8, buf_iova_addr + 8, TX_DESC_SIZE - 8);
-        // We also need to pass a pointer to the queue data to the free callback
-        uintptr_t uptr = (uintptr_t)queue_data.get();
-        memcpy(mbuf_desc, &uptr, sizeof(uintptr_t));
-
-        // We use IOVA as VA mode, so we can simply pass the buf_addr for buf_iova.
-        rte_pktmbuf_attach_extbuf(mbuf, buf_addr, (rte_iova_t)buf_addr, buf_len, shinfo);
-      } else {
-        // Copy data to mbuf
-        rte_memcpy(rte_pktmbuf_mtod(mbuf, void *), buf_addr, buf_len);
-      }
+    // buffers spanning several regions are copied
+    bool zero_copy = zero_copy_min_len && buf_len >= zero_copy_min_len && nb_segs == 1;
+    if (zero_copy) {
+      // Attach the guest buffer. It is handed back to the guest once DPDK frees
+      // the mbuf (see tx_extbuf_free_cb).
+      auto shinfo = (struct rte_mbuf_ext_shared_info *)rte_mbuf_to_priv(mbuf);
+      auto completion = (TxCompletion *)(shinfo + 1);
+      completion->queue = queue_data.get();
+      completion->idx = idx;
+      shinfo->free_cb = tx_extbuf_free_cb;
+      shinfo->fcb_opaque = completion;
+      rte_mbuf_ext_refcnt_set(shinfo, 1);
+
+      // We use IOVA as VA mode, so we can simply pass the buf_addr for buf_iova.
+      void *buf_addr = bufs[0].iov_base;
+      rte_pktmbuf_attach_extbuf(mbuf, buf_addr, (rte_iova_t)buf_addr, buf_len, shinfo);
       mbuf->data_len = buf_len;
       mbuf->pkt_len = buf_len;
-      mbuf->nb_segs = 1;
       mbufs[nb_mbufs_used++] = mbuf;
-    }
+      queue_data->nb_inflight++;
 
-    if constexpr (ZERO_COPY) {
       // Mark buffer as attached
       flags |= TX_FLAG_ATTACHED;
       // We do not synchronize across threads with this flag,
       // so no memory barrier is needed.
       rte_write16_relaxed(flags, desc_flags_addr);
     } else {
-      // Release buffer back to VM
-      flags &= ~TX_FLAG_AVAIL;
-      rte_write16(flags, desc_flags_addr);
+      if (rte_pktmbuf_tailroom(mbuf) < buf_len) {
+        // Packet too large, drop it
+        printf("Packet from VM is too large for buffer.\n");
+        rte_pktmbuf_free(mbuf);
+      } else {
+        // Copy data to mbuf
+        char *dst = rte_pktmbuf_mtod(mbuf, char *);
+        for (size_t s = 0; s < nb_segs; s++) {
+          rte_memcpy(dst, bufs[s].iov_base, bufs[s].iov_len);
+          dst += bufs[s].iov_len;
+        }
+        mbuf->data_len = buf_len;
+        mbuf->pkt_len = buf_len;
+        mbuf->nb_segs = 1;
+        mbufs[nb_mbufs_used++] = mbuf;
+      }
+
+      // Release buffer back to VM, after all older zero-copy buffers
+      queue_data->complete(idx);
     }
 
     // Go to next descriptor
     // Index wraps naturally on overflow
     idx++;
+    nb_desc++;
   }
 
   // Send packets in burst if buffer is full or no more packets are available
@@ -613,10 +737,90 @@ void VdpdkDevice::tx_poll(bool dma_invalidated) {
       rte_pktmbuf_free_bulk(mbufs + nb_tx, nb_mbufs_used - nb_tx);
     }
   }
+  return nb_desc;
+}
+
+unsigned char *VdpdkDevice::ring_local_addr(uintptr_t ring_iova, size_t ring_size) {
+  struct iovec iov;
+  if (vfuServer->dma_local_sgl(ring_iova, ring_size, &iov, 1) != 1)
+    return NULL;
+  return (unsigned char *)iov.iov_base;
+}
+
+void VdpdkDevice::TxQueue::complete(uint16_t desc_idx) {
+  completed[desc_idx & idx_mask] = true;
+  // The guest reclaims descriptors in ring order, so only hand back the
+  // oldest ones. Slots are only marked between front_idx and the descriptor
+  // being consumed, so this stops there.
+  while (completed[front_idx & idx_mask]) {
+    completed[front_idx & idx_mask] = false;
+    if (ring) {
+      unsigned char *desc_flags_addr = ring + (size_t)(front_idx & idx_mask) * TX_DESC_SIZE + 10;
+      uint16_t flags = rte_read16_relaxed(desc_flags_addr);
+      flags &= ~(TX_FLAG_AVAIL | TX_FLAG_ATTACHED);
+      rte_write16(flags, desc_flags_addr);
+    }
+    front_idx++;
+  }
+}
+
+void VdpdkDevice::tx_extbuf_free_cb(void *addr, void *opaque) {
+  static_assert(sizeof(TxCompletion) <= TX_DESC_SIZE,
+                "TxCompletion must fit into the private area of tx mbufs");
+  // Called by DPDK once the NIC is done with the buffer. This happens on the
+  // polling thread, in rte_eth_tx_burst() or rte_eth_tx_done_cleanup().
+  auto completion = (TxCompletion *)opaque;
+  TxQueue *queue_data = completion->queue;
+  queue_data->nb_inflight--;
+  queue_data->complete(completion->idx);
+}
+
+void VdpdkDevice::tx_drain_queue(TxQueue *queue_data) {
+  if (!queue_data || queue_data->nb_inflight == 0) {
+    return;
+  }
+  uint16_t queue_idx = queue_data->dpdk_queue_idx;
+  uint64_t deadline = rte_get_timer_cycles() + rte_get_timer_hz() * TX_DRAIN_TIMEOUT_MS / 1000;
+  while (queue_data->nb_inflight > 0 && rte_get_timer_cycles() <= deadline) {
+    rte_eth_tx_done_cleanup(0, queue_idx, 0);
+  }
+  if (queue_data->nb_inflight == 0) {
+    return;
+  }
+
+  // The NIC may still read the remaining buffers, so guest memory must not be
+  // unmapped yet. Stopping the queue waits for the NIC to disable it and
+  // frees all mbufs still in its ring.
+  printf("vDPDK: %u zero-copy tx buffers still in flight, restarting tx queue %u\n",
+         queue_data->nb_inflight, queue_idx);
+  if (rte_eth_dev_tx_queue_stop(0, queue_idx) != 0) {
+    printf("vDPDK: cannot stop tx queue %u, waiting for it to drain\n", queue_idx);
+  } else if (rte_eth_dev_tx_queue_start(0, queue_idx) != 0) {
+    die("vDPDK: cannot restart tx queue %u", queue_idx);
+  }
+  deadline = rte_get_timer_cycles() + rte_get_timer_hz() * TX_DRAIN_TIMEOUT_MS / 1000;
+  while (queue_data->nb_inflight > 0 && rte_get_timer_cycles() <= deadline) {
+    rte_eth_tx_done_cleanup(0, queue_idx, 0);
+  }
+  // unmapping guest memory now could let the NIC read freed memory
+  if (queue_data->nb_inflight > 0)
+    die("vDPDK: NIC still holds %u zero-copy tx buffers of queue %u", queue_data->nb_inflight, queue_idx);
+}
+
+void VdpdkDevice::tx_drain() {
+  for (size_t q_idx = 0; q_idx < MAX_TX_QUEUES; q_idx++) {
+    tx_drain_queue(tx_polled[q_idx].get());
+    // stopped queues are done now: don't keep their ring pointers around
+    if (tx_polled[q_idx] != tx_queues[q_idx].load()) {
+      tx_polled[q_idx] = nullptr;
+    }
+  }
 }
 
 void VdpdkDevice::dma_register_cb(vfu_ctx_t *ctx, vfu_dma_info_t *info) {
   dma_flag.test_and_set();
+  // parked polling threads hold the lock as well
+  wake_pollers();
   std::lock_guard guard(dma_mutex);
   dma_flag.clear();
   uint32_t flags = 0;
@@ -630,9 +834,10 @@ void VdpdkDevice::dma_register_cb_static(vfu_ctx_t *ctx, vfu_dma_info_t *info) {
 
 void VdpdkDevice::dma_unregister_cb(vfu_ctx_t *ctx, vfu_dma_info_t *info) {
   dma_flag.test_and_set();
+  // parked polling threads hold the lock as well
+  wake_pollers();
   std::lock_guard guard(dma_mutex);
   dma_flag.clear();
-  uint32_t flags = 0;
   VfioUserServer::unmap_dma_here(ctx, vfuServer.get(), info);
 }
 
@@ -641,7 +846,37 @@ void VdpdkDevice::dma_unregister_cb_static(vfu_ctx_t *ctx, vfu_dma_info_t *info)
   return this_->dma_unregister_cb(ctx, info);
 }
 
+const volatile void *VdpdkDevice::tx_monitor_addr() {
+  std::shared_ptr<TxQueue> queue_data;
+  for (auto &tx_queue : tx_queues) {
+    std::shared_ptr<TxQueue> q = tx_queue.load();
+    if (!q) {
+      continue;
+    }
+    // umwait can only monitor one address
+    if (queue_data) {
+      return nullptr;
+    }
+    queue_data = std::move(q);
+  }
+  if (!queue_data || !queue_data->ring) {
+    return nullptr;
+  }
+  // flags of the next descriptor, which the guest sets to TX_FLAG_AVAIL
+  return queue_data->ring + (size_t)(queue_data->back_idx & queue_data->idx_mask) * TX_DESC_SIZE + 10;
+}
+
+void VdpdkDevice::wake_pollers() {
+  if (rx_idle) {
+    rx_idle->wake();
+  }
+  if (tx_idle) {
+    tx_idle->wake();
+  }
+}
+
 void VdpdkThreads::tx_poll_thread_single(std::stop_token stop, std::shared_ptr<VdpdkDevice> dev) {
+  DriverThreadScope driver_thread(dev->driver);
   std::shared_lock dma_lock(dev->dma_mutex);
 
   while (true) {
@@ -653,6 +888,8 @@ void VdpdkThreads::tx_poll_thread_single(std::stop_token stop, std::shared_ptr<V
     bool dma_invalidated = false;
     // Check if DMA mapping wants to change
     if (dev->dma_flag.test()) {
+      // The NIC must not read from guest memory once it is unmapped
+      dev->tx_drain();
       // Release lock
       dma_lock.unlock();
       // Wait until vfio-user thread holds mutex
@@ -664,11 +901,13 @@ void VdpdkThreads::tx_poll_thread_single(std::stop_token stop, std::shared_ptr<V
       dma_invalidated = true;
     }
 
-    dev->tx_poll(dma_invalidated);
+    unsigned nb_tx = dev->tx_poll(dma_invalidated);
+    dev->tx_idle->poll_done(nb_tx > 0, nb_tx > 0 ? nullptr : dev->tx_monitor_addr());
   }
 }
 
 void VdpdkThreads::rx_poll_thread_single(std::stop_token stop, std::shared_ptr<VdpdkDevice> dev) {
+  DriverThreadScope driver_thread(dev->driver);
   std::shared_lock dma_lock(dev->dma_mutex);
 
   while (true) {
@@ -691,11 +930,14 @@ void VdpdkThreads::rx_poll_thread_single(std::stop_token stop, std::shared_ptr<V
       dma_invalidated = true;
     }
 
-    dev->rx_callback_fn(dma_invalidated);
+    unsigned nb_rx = dev->rx_callback_fn(dma_invalidated);
+    dev->rx_idle->poll_done(nb_rx > 0);
   }
 }
 
 void VdpdkThreads::tx_poll_thread_double(std::stop_token stop, std::shared_ptr<VdpdkDevice> dev1, std::shared_ptr<VdpdkDevice> dev2) {
+  DriverThreadScope driver_thread1(dev1->driver);
+  DriverThreadScope driver_thread2(dev2->driver);
   std::shared_lock dma_lock1(dev1->dma_mutex);
   std::shared_lock dma_lock2(dev2->dma_mutex);
 
@@ -708,6 +950,8 @@ void VdpdkThreads::tx_poll_thread_double(std::stop_token stop, std::shared_ptr<V
     bool dma_invalidated = false;
     // Check if DMA mapping wants to change
     if (dev1->dma_flag.test()) {
+      // The NIC must not read from guest memory once it is unmapped
+      dev1->tx_drain();
       // Release lock
       dma_lock1.unlock();
       // Wait until vfio-user thread holds mutex
@@ -719,11 +963,13 @@ void VdpdkThreads::tx_poll_thread_double(std::stop_token stop, std::shared_ptr<V
       dma_invalidated = true;
     }
 
-    dev1->tx_poll(dma_invalidated);
+    unsigned nb_tx = dev1->tx_poll(dma_invalidated);
 
     dma_invalidated = false;
     // Check if DMA mapping wants to change
     if (dev2->dma_flag.test()) {
+      // The NIC must not read from guest memory once it is unmapped
+      dev2->tx_drain();
       // Release lock
       dma_lock2.unlock();
       // Wait until vfio-user thread holds mutex
@@ -735,11 +981,16 @@ void VdpdkThreads::tx_poll_thread_double(std::stop_token stop, std::shared_ptr<V
       dma_invalidated = true;
     }
 
-    dev2->tx_poll(dma_invalidated);
+    nb_tx += dev2->tx_poll(dma_invalidated);
+
+    // both devices share the poller, so there is no single address to monitor
+    dev1->tx_idle->poll_done(nb_tx > 0);
   }
 }
 
 void VdpdkThreads::rx_poll_thread_double(std::stop_token stop, std::shared_ptr<VdpdkDevice> dev1, std::shared_ptr<VdpdkDevice> dev2) {
+  DriverThreadScope driver_thread1(dev1->driver);
+  DriverThreadScope driver_thread2(dev2->driver);
   std::shared_lock dma_lock1(dev1->dma_mutex);
   std::shared_lock dma_lock2(dev2->dma_mutex);
 
@@ -763,7 +1014,7 @@ void VdpdkThreads::rx_poll_thread_double(std::stop_token stop, std::shared_ptr<V
       dma_invalidated = true;
     }
 
-    dev1->rx_callback_fn(dma_invalidated);
+    unsigned nb_rx = dev1->rx_callback_fn(dma_invalidated);
 
     dma_invalidated = false;
     // Check if DMA mapping wants to change
@@ -779,11 +1030,14 @@ void VdpdkThreads::rx_poll_thread_double(std::stop_token stop, std::shared_ptr<V
       dma_invalidated = true;
     }
 
-    dev2->rx_callback_fn(dma_invalidated);
+    nb_rx += dev2->rx_callback_fn(dma_invalidated);
+
+    // both devices share the poller, so there is no single address to monitor
+    dev1->rx_idle->poll_done(nb_rx > 0);
   }
 }
 
-VdpdkThreads::VdpdkThreads(size_t sharing_thresh) : sharing_thresh(sharing_thresh) {}
+VdpdkThreads::VdpdkThreads(size_t sharing_thresh, bool adaptive) : sharing_thresh(sharing_thresh), adaptive(adaptive) {}
 
 void VdpdkThreads::add_device(std::shared_ptr<VdpdkDevice> dev, cpu_set_t rx_pin, cpu_set_t tx_pin) {
   Info info {
@@ -803,6 +1057,36 @@ static void pin_thread(std::jthread &jt, const char *name, cpu_set_t set) {
   }
 }
 
+std::shared_ptr<IdlePoller> VdpdkThreads::make_poller(std::string name, std::initializer_list<VdpdkDevice *> devs, bool rx) {
+  auto poller = std::make_shared<IdlePoller>(adaptive);
+  if (rx) {
+    // Sleep until the NIC receives packets for any of the devices
+    std::vector<std::pair<std::shared_ptr<Dpdk>, int>> notify;
+    for (VdpdkDevice *dev : devs) {
+      for (int fd : dev->dpdk_driver->rx_notify_fds(dev->device_id)) {
+        poller->add_wake_fd(fd, true);
+      }
+      notify.emplace_back(dev->dpdk_driver, dev->device_id);
+    }
+    poller->park_hook = [notify](bool parking) {
+      for (auto &[driver, vm_id] : notify) {
+        driver->rx_notify_enable(vm_id, parking);
+      }
+    };
+  }
+  for (VdpdkDevice *dev : devs) {
+    (rx ? dev->rx_idle : dev->tx_idle) = poller;
+  }
+  pollers.emplace_back(std::move(name), poller);
+  return poller;
+}
+
+void VdpdkThreads::print_stats() {
+  for (auto &[name, poller] : pollers) {
+    poller->print_stats(name.c_str());
+  }
+}
+
 void VdpdkThreads::start() {
   // Share polling threads between VMs
   if (start_info.size() > sharing_thresh) {
@@ -811,6 +1095,8 @@ void VdpdkThreads::start() {
     for (size_t i = 0; i < mid; i++) {
       auto dev1 = start_info[i].dev;
       auto dev2 = start_info[count - i - 1].dev;
+      make_poller(std::format("vdpdkRx{}_{}", dev1->device_id, dev2->device_id), { dev1.get(), dev2.get() }, true);
+      make_poller(std::format("vdpdkTx{}_{}", dev1->device_id, dev2->device_id), { dev1.get(), dev2.get() }, false);
       std::jthread rxthread{[dev1, dev2](std::stop_token stop) {
         rx_poll_thread_double(stop, dev1, dev2);
       }};
@@ -834,6 +1120,8 @@ void VdpdkThreads::start() {
     if (count % 2 != 0) {
       auto &info = start_info[mid];
       auto dev = info.dev;
+      make_poller(std::format("vdpdkRx{}", dev->device_id), { dev.get() }, true);
+      make_poller(std::format("vdpdkTx{}", dev->device_id), { dev.get() }, false);
       std::jthread rxthread{[dev](std::stop_token stop) {
         rx_poll_thread_single(stop, dev);
       }};
@@ -854,6 +1142,8 @@ void VdpdkThreads::start() {
   }
   for (auto &info: start_info) {
     auto dev = info.dev;
+    make_poller(std::format("vdpdkRx{}", dev->device_id), { dev.get() }, true);
+    make_poller(std::format("vdpdkTx{}", dev->device_id), { dev.get() }, false);
     std::jthread rxthread{[dev](std::stop_token stop) {
       rx_poll_thread_single(stop, dev);
     }};
@@ -3,8 +3,10 @@
 #include "devices/vdpdk-consts.hpp"
 #include "drivers/dpdk.hpp"
 #include "src/devices/vmux-device.hpp"
+#include "idle-poll.hpp"
 #include "memfd.hpp"
 #include <atomic>
+#include <initializer_list>
 #include <vector>
 #include <shared_mutex>
 #include <string>
@@ -12,7 +14,10 @@
 
 class VdpdkDevice : public VmuxDevice {
 public:
-  VdpdkDevice(int device_id, std::shared_ptr<Driver> driver, const uint8_t (*mac_addr)[6]);
+  // zero_copy_min_len: transmit guest buffers of at least this size without
+  // copying them (0: always copy)
+  VdpdkDevice(int device_id, std::shared_ptr<Driver> driver, const uint8_t (*mac_addr)[6],
+              size_t zero_copy_min_len = 0);
 
   void setup_vfu(std::shared_ptr<VfioUserServer> vfu) override;
 
@@ -32,10 +37,15 @@ private:
   // set if vfio-user wants to change dma mapping
   std::atomic_flag dma_flag;
 
+  // FEATURE_* acknowledged by the guest. Rx queues use those acknowledged
+  // when they were started.
+  std::atomic<uint64_t> features = 0;
+
   struct RxQueue {
     uintptr_t ring_iova;
     uint16_t idx_mask;
     uint16_t idx;
+    uint64_t features;
   };
   std::array<
     std::atomic<std::shared_ptr<RxQueue>>,
@@ -46,11 +56,48 @@ private:
     uintptr_t ring_iova;
     unsigned char *ring;
     uint16_t idx_mask;
+    // descriptors from front_idx to back_idx are being sent
     uint16_t front_idx, back_idx;
-  };
-  std::atomic<std::shared_ptr<TxQueue>> tx_queue;
+    uint16_t dpdk_queue_idx;
+    unsigned nb_inflight; // zero-copy buffers not yet freed by DPDK
+    std::unique_ptr<bool[]> completed; // per slot: sent, but not handed back yet
 
-  void rx_callback_fn(bool dma_invalidated);
+    // Mark a descriptor as sent and hand back all descriptors up to the
+    // oldest one still in flight.
+    void complete(uint16_t desc_idx);
+  };
+  // Stored in the private area of zero-copy mbufs, behind the shared info
+  struct TxCompletion {
+    TxQueue *queue;
+    uint16_t idx;
+  };
+  // each queue is sent on its own DPDK tx queue
+  std::array<
+    std::atomic<std::shared_ptr<TxQueue>>,
+    VDPDK_CONSTS::MAX_TX_QUEUES
+  > tx_queues;
+  // the queues as last seen by the tx thread. Keeps stopped queues alive until
+  // their zero-copy buffers are freed.
+  std::array<std::shared_ptr<TxQueue>, VDPDK_CONSTS::MAX_TX_QUEUES> tx_polled;
+  size_t zero_copy_min_len;
+  // how long to wait for the NIC to release zero-copy buffers
+  static constexpr uint64_t TX_DRAIN_TIMEOUT_MS = 100;
+  // guest memory regions a single packet buffer may span
+  static constexpr size_t MAX_BUF_SEGS = 4;
+
+  // back-off of the polling threads. Shared if a thread polls two devices.
+  std::shared_ptr<IdlePoller> rx_idle;
+  std::shared_ptr<IdlePoller> tx_idle;
+  void wake_pollers();
+
+  // local address of a descriptor ring. NULL if it is not mapped or spans
+  // several regions: we index rings directly.
+  unsigned char *ring_local_addr(uintptr_t ring_iova, size_t ring_size);
+
+  // returns the number of packets delivered to the guest
+  unsigned rx_callback_fn(bool dma_invalidated);
+  // copy one packet into the next guest buffers of rxq. False if it does not fit.
+  bool rx_place(RxQueue &rxq, unsigned char *ring, const Driver::RxBuf &pkt);
   // static void rx_callback_static(int vm_number, void *);
 
   ssize_t region_access_cb(char *buf, size_t count, loff_t offset, bool is_write);
@@ -64,19 +111,32 @@ private:
   void dma_unregister_cb(vfu_ctx_t *ctx, vfu_dma_info_t *info);
   static void dma_unregister_cb_static(vfu_ctx_t *ctx, vfu_dma_info_t *info);
 
-  void tx_poll(bool dma_invalidated);
+  // returns the number of descriptors consumed
+  unsigned tx_poll(bool dma_invalidated);
+  unsigned tx_poll_queue(size_t q_idx, bool dma_invalidated);
+  static void tx_extbuf_free_cb(void *addr, void *opaque);
+  // wait until the NIC is done with all zero-copy buffers. Called by the tx
+  // thread before guest memory may be unmapped.
+  void tx_drain();
+  void tx_drain_queue(TxQueue *queue_data);
+  // address the guest writes to when it posts the next tx descriptor, if
+  // there is a single active queue
+  const volatile void *tx_monitor_addr();
 
   friend class VdpdkThreads;
 };
 
 class VdpdkThreads {
 public:
-  explicit VdpdkThreads(size_t sharing_thresh);
+  VdpdkThreads(size_t sharing_thresh, bool adaptive);
   void add_device(std::shared_ptr<VdpdkDevice>, cpu_set_t rx_pin, cpu_set_t tx_pin);
   void start();
+  void print_stats();
 
 private:
   size_t sharing_thresh;
+  bool adaptive; // back off polling threads while idle
+  std::vector<std::pair<std::string, std::shared_ptr<IdlePoller>>> pollers;
   struct Info {
     std::shared_ptr<VdpdkDevice> dev;
     cpu_set_t rx_pin;
@@ -85,6 +145,8 @@ private:
   std::vector<Info> start_info;
   std::vector<std::jthread> threads;
 
+  std::shared_ptr<IdlePoller> make_poller(std::string name, std::initializer_list<VdpdkDevice *> devs, bool rx);
+
   static void tx_poll_thread_single(std::stop_token stop, std::shared_ptr<VdpdkDevice> dev);
   static void rx_poll_thread_single(std::stop_token stop, std::shared_ptr<VdpdkDevice> dev);
   static void tx_poll_thread_double(std::stop_token stop, std::shared_ptr<VdpdkDevice> dev1, std::shared_ptr<VdpdkDevice> dev2);
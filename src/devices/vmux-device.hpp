@@ -3,10 +3,13 @@
 #include "vfio-consumer.hpp"
 #include "drivers/driver.hpp"
 #include "policies/policies.hpp"
+#include "idle-poll.hpp"
 // #include "vfio-server.hpp"
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <memory>
-#include <boost/lockfree/queue.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
 
 class VfioUserServer;
 
@@ -72,18 +75,88 @@ public:
   std::shared_ptr<Driver> driver;
   std::shared_ptr<GlobalPolicies> policies;
 
-  boost::lockfree::queue<vmux_descriptor*> inject_packets; // allows other devices to inject packets here
+  static constexpr size_t MAX_INJECT_SOURCES = 64; // device ids of injecting devices must be below
+  static constexpr size_t INJECT_RING_SIZE = 64;
+  using InjectRing = boost::lockfree::spsc_queue<vmux_descriptor*, boost::lockfree::capacity<INJECT_RING_SIZE>>;
 
   int device_id;
 
   callback_fn rx_callback;
 
-  VmuxDevice(int device_id, std::shared_ptr<Driver> driver, std::shared_ptr<GlobalPolicies> policies) : driver(driver), policies(policies), inject_packets(64),  device_id(device_id), rx_callback(NULL) {};
+  // set if an RxThread polls this device. Used to wake it up when parked.
+  std::shared_ptr<IdlePoller> rx_poller;
+
+  VmuxDevice(int device_id, std::shared_ptr<Driver> driver, std::shared_ptr<GlobalPolicies> policies) : driver(driver), policies(policies), device_id(device_id), rx_callback(NULL) {};
+
+  virtual ~VmuxDevice() {
+    // don't leak switch rules in the NIC
+    if (this->driver)
+      this->driver->del_switch_rules(this->device_id);
+    for (auto &ring_ptr : this->inject_rings) {
+      InjectRing *ring = ring_ptr.load();
+      if (!ring)
+        continue;
+      ring->consume_all(vmux_descriptor_free);
+      delete ring;
+    }
+  }
+
+  /// Allows other devices to inject packets into this one. Must only be
+  /// called by one thread per source device (its rx thread). Returns false
+  /// if the ring from source to this device is full.
+  bool inject_packet(int source_id, vmux_descriptor *descriptor) {
+    if ((size_t)source_id >= MAX_INJECT_SOURCES)
+      die("Cannot inject packets from device %d", source_id);
+    InjectRing *ring = this->inject_rings[source_id].load(std::memory_order_acquire);
+    if (unlikely(!ring)) {
+      ring = new InjectRing();
+      this->inject_rings[source_id].store(ring, std::memory_order_release);
+    }
+    if (!ring->push(descriptor))
+      return false;
+    this->inject_pending.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  /// Cheap check for injected packets
+  bool has_injected() {
+    return this->inject_pending.load(std::memory_order_relaxed) != 0;
+  }
 
-  virtual ~VmuxDevice() = default;
+  /// Pop all injected packets. Must only be called by the thread polling
+  /// this device. Returns the number of packets passed to fn.
+  template <typename Fn>
+  size_t drain_injected(Fn fn) {
+    size_t drained = 0;
+    for (auto &ring_ptr : this->inject_rings) {
+      InjectRing *ring = ring_ptr.load(std::memory_order_acquire);
+      if (ring)
+        drained += ring->consume_all(fn);
+    }
+    this->inject_pending.fetch_sub(drained, std::memory_order_relaxed);
+    return drained;
+  }
 
   virtual void setup_vfu(std::shared_ptr<VfioUserServer> vfu) = 0;
 
+  /// Poll rx once (see RxThread). Returns the amount of work done. Devices
+  /// that can't tell report work on every poll, so they are never backed off.
+  virtual size_t poll_rx() {
+    this->rx_callback(this->device_id, this);
+    return 1;
+  }
+
+  /// Readable fd (or -1) that signals doorbell register writes which bypass
+  /// vfio-user messages. The VmuxRunner then calls process_doorbells().
+  virtual int doorbell_fd() { return -1; }
+  virtual void process_doorbells() {}
+
+  /// Notify the RxThread of this device about packets injected from elsewhere
+  void wake_rx() {
+    if (this->rx_poller)
+      this->rx_poller->wake();
+  }
+
   /// Attempt to install a rte_flow rule. Return false if installing failed or not possible due to policy.
   virtual bool add_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t dst_queue) {
     // the default device does not support switch rules
@@ -96,9 +169,19 @@ public:
     return false;
   }
 
+  /// Remove a rule installed by add_switch_etype_rule(). Return false if there is no such rule.
+  virtual bool del_switch_etype_rule(int vm_id, uint16_t ethertype, uint16_t dst_queue) {
+    return false;
+  }
+
   inline bool isMediating() {
     return this->driver->is_mediating(this->device_id);
   }
+
+private:
+  // inject_rings[src]: packets injected by device src. Allocated on first use.
+  std::array<std::atomic<InjectRing*>, MAX_INJECT_SOURCES> inject_rings = {};
+  std::atomic<size_t> inject_pending = 0; // packets in all inject rings
 };
 
 class StubDevice : public VmuxDevice {
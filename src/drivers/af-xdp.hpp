@@ -0,0 +1,486 @@
+#pragma once
+
+#include "src/drivers/driver.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <linux/ethtool.h>
+#include <linux/if.h>
+#include <linux/if_ether.h>
+#include <linux/sockios.h>
+#include <map>
+#include <optional>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <xdp/xsk.h>
+
+/**
+ * AF_XDP backend: the NIC stays with its kernel driver, packets are exchanged
+ * with it through XSK sockets.
+ *
+ * Every VM gets queues_per_vm consecutive NIC queues (queue q of VM v is NIC
+ * queue v * queues_per_vm + q), each with its own XSK socket and UMEM. Packets
+ * for a VM are steered to its queues with ethtool ntuple rules on the
+ * destination MAC. Without ntuple support (e.g. veth), everything arrives on
+ * NIC queue 0, which belongs to VM 0.
+ *
+ * libxdp loads the redirect program and falls back to generic (skb) XDP and
+ * copy mode if the NIC driver lacks native support, so this also runs on a
+ * veth pair.
+ *
+ * The UMEMs live in one hugepage arena on the NIC's NUMA node, so the rx
+ * threads of all VMs should run there too.
+ */
+class AfXdp : public Driver {
+private:
+  static constexpr unsigned MAX_QUEUES_PER_VM = 4;
+  static constexpr uint32_t RX_BURST = 32;
+  static constexpr uint32_t TX_BURST = 32;
+  static constexpr uint32_t RING_SIZE = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+  static constexpr uint32_t FRAME_SIZE = XSK_UMEM__DEFAULT_FRAME_SIZE;
+  // per socket: the first RING_SIZE frames are for rx, the others for tx
+  static constexpr uint32_t NUM_FRAMES = 2 * RING_SIZE;
+  static constexpr uint64_t TX_FLUSH_TIMEOUT_NS = 50000; // max time a packet may be staged for tx
+
+  struct XskQueue {
+    void *umem_area = nullptr;
+    struct xsk_umem *umem = nullptr;
+    struct xsk_socket *xsk = nullptr;
+    struct xsk_ring_prod fq;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_cons rx;
+    uint32_t rx_idx = 0; // first rx descriptor handed out by recv()
+    uint32_t nb_rx = 0;
+    std::vector<uint64_t> tx_frames; // unused tx frames (umem offsets)
+  };
+  std::vector<XskQueue> queues; // indexed by NIC queue
+
+  // per VM staging area for burst transmission. Staged packets have a
+  // reserved, but not yet submitted, tx descriptor.
+  struct TxStage {
+    std::atomic<uint16_t> nb_pkts = 0;
+    uint64_t first_ns = 0; // when the oldest staged packet was staged
+    // written by the sending thread only, read by print_stats
+    std::atomic<uint64_t> sent = 0;
+    std::atomic<uint64_t> dropped = 0;
+  };
+  std::vector<TxStage> tx_stages;
+
+  std::string ifname;
+  int ctl_fd; // for ethtool ioctls
+  unsigned queues_per_vm;
+  std::vector<bool> mediate; // per VM
+  std::vector<uint32_t> default_rule_locations; // ntuple rules of the VM MACs
+
+  // ntuple rules installed for switch rules of a VM
+  using NtupleMatch = std::pair<std::array<uint8_t, 6>, std::optional<uint16_t>>; // (dst MAC, etype)
+  struct NtupleRule {
+    uint32_t location;
+    uint32_t nic_queue;
+    unsigned refs;
+  };
+  std::vector<std::map<NtupleMatch, NtupleRule>> ntuple_rules; // per VM
+
+  uint32_t get_queue_id(int vm, int queue) {
+    return vm * this->queues_per_vm + queue;
+  }
+
+  static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  int ethtool_ioctl(void *cmd) {
+    struct ifreq ifr = {};
+    strncpy(ifr.ifr_name, this->ifname.c_str(), IFNAMSIZ - 1);
+    ifr.ifr_data = (char *)cmd;
+    return ioctl(this->ctl_fd, SIOCETHTOOL, &ifr);
+  }
+
+  unsigned nic_queue_count() {
+    struct ethtool_channels channels = {};
+    channels.cmd = ETHTOOL_GCHANNELS;
+    if (this->ethtool_ioctl(&channels) != 0)
+      return 1;
+    return std::max({ channels.combined_count, channels.rx_count, 1u });
+  }
+
+  // -1 if unknown
+  int nic_numa_node() {
+    std::ifstream file("/sys/class/net/" + this->ifname + "/device/numa_node");
+    int node = -1;
+    file >> node;
+    return file ? node : -1;
+  }
+
+  void setup_queue(XskQueue &xq, uint32_t nic_queue) {
+    size_t size = (size_t)NUM_FRAMES * FRAME_SIZE;
+    xq.umem_area = this->rx_arena->alloc(size, getpagesize());
+
+    struct xsk_umem_config umem_cfg = {};
+    umem_cfg.fill_size = RING_SIZE;
+    umem_cfg.comp_size = RING_SIZE;
+    umem_cfg.frame_size = FRAME_SIZE;
+    umem_cfg.frame_headroom = 0;
+    int ret = xsk_umem__create(&xq.umem, xq.umem_area, size, &xq.fq, &xq.cq, &umem_cfg);
+    if (ret) {
+      errno = -ret;
+      die("AfXdp: cannot create umem for queue %u", nic_queue);
+    }
+
+    struct xsk_socket_config xsk_cfg = {};
+    xsk_cfg.rx_size = RING_SIZE;
+    xsk_cfg.tx_size = RING_SIZE;
+    xsk_cfg.bind_flags = XDP_USE_NEED_WAKEUP;
+    ret = xsk_socket__create(&xq.xsk, this->ifname.c_str(), nic_queue, xq.umem,
+                             &xq.rx, &xq.tx, &xsk_cfg);
+    if (ret) {
+      errno = -ret;
+      die("AfXdp: cannot create xsk socket on %s queue %u", this->ifname.c_str(), nic_queue);
+    }
+
+    // hand all rx frames to the kernel
+    uint32_t idx;
+    if (xsk_ring_prod__reserve(&xq.fq, RING_SIZE, &idx) != RING_SIZE)
+      die("AfXdp: cannot populate fill ring");
+    for (uint32_t i = 0; i < RING_SIZE; i++)
+      *xsk_ring_prod__fill_addr(&xq.fq, idx + i) = (uint64_t)i * FRAME_SIZE;
+    xsk_ring_prod__submit(&xq.fq, RING_SIZE);
+
+    for (uint32_t i = RING_SIZE; i < NUM_FRAMES; i++)
+      xq.tx_frames.push_back((uint64_t)i * FRAME_SIZE);
+  }
+
+  // move the tx frames the kernel is done with back to the free list
+  void reclaim_tx_frames(XskQueue &xq) {
+    uint32_t idx;
+    uint32_t n = xsk_ring_cons__peek(&xq.cq, RING_SIZE, &idx);
+    if (n == 0)
+      return;
+    for (uint32_t i = 0; i < n; i++)
+      xq.tx_frames.push_back(*xsk_ring_cons__comp_addr(&xq.cq, idx + i));
+    xsk_ring_cons__release(&xq.cq, n);
+  }
+
+  // Returns the location of the new rule
+  std::optional<uint32_t> add_ntuple_rule(const uint8_t dst_addr[6], std::optional<uint16_t> etype, uint32_t nic_queue) {
+    struct ethtool_rxnfc nfc = {};
+    nfc.cmd = ETHTOOL_SRXCLSRLINS;
+    nfc.fs.flow_type = ETHER_FLOW;
+    memcpy(nfc.fs.h_u.ether_spec.h_dest, dst_addr, ETH_ALEN);
+    memset(nfc.fs.m_u.ether_spec.h_dest, 0xff, ETH_ALEN);
+    if (etype) {
+      nfc.fs.h_u.ether_spec.h_proto = htons(*etype);
+      nfc.fs.m_u.ether_spec.h_proto = 0xffff;
+    }
+    nfc.fs.ring_cookie = nic_queue;
+    nfc.fs.location = RX_CLS_LOC_ANY;
+    if (this->ethtool_ioctl(&nfc) != 0) {
+      printf("AfXdp: cannot add ntuple rule on %s: %s\n", this->ifname.c_str(), strerror(errno));
+      return {};
+    }
+    printf("added rule dst_mac %02x:%02x:%02x:%02x:%02x:%02x -> queue %u\n",
+           dst_addr[0], dst_addr[1], dst_addr[2], dst_addr[3], dst_addr[4], dst_addr[5], nic_queue);
+    return nfc.fs.location;
+  }
+
+  void del_ntuple_rule(uint32_t location) {
+    struct ethtool_rxnfc nfc = {};
+    nfc.cmd = ETHTOOL_SRXCLSRLDEL;
+    nfc.fs.location = location;
+    if (this->ethtool_ioctl(&nfc) != 0)
+      printf("AfXdp: cannot delete ntuple rule %u on %s: %s\n", location, this->ifname.c_str(), strerror(errno));
+  }
+
+  bool add_switch_ntuple(int vm_id, const uint8_t dst_addr[6], std::optional<uint16_t> etype, uint16_t dst_queue) {
+    if (!this->mediate[vm_id]) {
+      // for emulation we ignore switch rules.
+      // Because we don't send queue hints to the behavioral model, it emulates the switch then.
+      return true;
+    }
+    if (dst_queue >= this->queues_per_vm)
+      return false;
+
+    uint32_t nic_queue = this->get_queue_id(vm_id, dst_queue);
+    NtupleMatch match = { {}, etype };
+    memcpy(match.first.data(), dst_addr, 6);
+    auto &rules = this->ntuple_rules[vm_id];
+    auto it = rules.find(match);
+    if (it != rules.end()) {
+      if (it->second.nic_queue != nic_queue) {
+        printf("AfXdp: rule of vm %d conflicts with existing rule to queue %u\n", vm_id, it->second.nic_queue);
+        return false;
+      }
+      it->second.refs++;
+      return true;
+    }
+    std::optional<uint32_t> location = this->add_ntuple_rule(dst_addr, etype, nic_queue);
+    if (!location)
+      return false;
+    rules.emplace(match, NtupleRule { *location, nic_queue, 1 });
+    return true;
+  }
+
+  bool del_switch_ntuple(int vm_id, const uint8_t dst_addr[6], std::optional<uint16_t> etype, uint16_t dst_queue) {
+    if (!this->mediate[vm_id])
+      return true; // see add_switch_ntuple()
+    NtupleMatch match = { {}, etype };
+    memcpy(match.first.data(), dst_addr, 6);
+    auto &rules = this->ntuple_rules[vm_id];
+    auto it = rules.find(match);
+    if (it == rules.end() || it->second.nic_queue != this->get_queue_id(vm_id, dst_queue))
+      return false;
+    if (--it->second.refs > 0)
+      return true;
+    this->del_ntuple_rule(it->second.location);
+    rules.erase(it);
+    return true;
+  }
+
+public:
+  AfXdp(int num_vms, const uint8_t (*mac_addr)[6], const char *ifname) : ifname(ifname) {
+    this->ctl_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (this->ctl_fd < 0)
+      die("AfXdp: cannot open control socket");
+
+    unsigned nic_queues = this->nic_queue_count();
+    this->queues_per_vm = std::min(MAX_QUEUES_PER_VM, nic_queues / num_vms);
+    if (this->queues_per_vm == 0)
+      die("AfXdp: %s has %u queues, need at least one per VM (%d)", ifname, nic_queues, num_vms);
+    printf("AfXdp: %s, %u queues per VM\n", ifname, this->queues_per_vm);
+
+    this->alloc_rx_lists(this->queues_per_vm * num_vms, RX_BURST, this->queues_per_vm, this->queues_per_vm);
+    this->mediate = std::vector<bool>(num_vms, false);
+    this->ntuple_rules = std::vector<std::map<NtupleMatch, NtupleRule>>(num_vms);
+    this->tx_stages = std::vector<TxStage>(num_vms);
+
+    this->queues = std::vector<XskQueue>(this->queues_per_vm * num_vms);
+    // the UMEMs of all queues share one arena near the NIC
+    this->numa_node = this->nic_numa_node();
+    this->rx_arena = std::make_unique<RxArena>(this->queues.size() * NUM_FRAMES * FRAME_SIZE, this->numa_node);
+    for (uint32_t q = 0; q < this->queues.size(); q++)
+      this->setup_queue(this->queues[q], q);
+
+    // send all VM traffic to the first queue of each VM by default
+    for (int vm = 0; vm < num_vms; vm++) {
+      uint8_t dst_addr[6];
+      memcpy(dst_addr, mac_addr, 6);
+      Util::intcrement_mac(dst_addr, vm);
+      std::optional<uint32_t> location = this->add_ntuple_rule(dst_addr, {}, this->get_queue_id(vm, 0));
+      if (location)
+        this->default_rule_locations.push_back(*location);
+      else if (num_vms > 1)
+        printf("WARNING: AfXdp: without ntuple steering, all packets go to VM 0\n");
+    }
+  }
+
+  virtual ~AfXdp() {
+    for (int vm = 0; vm < (int)this->ntuple_rules.size(); vm++)
+      this->del_switch_rules(vm);
+    for (uint32_t location : this->default_rule_locations)
+      this->del_ntuple_rule(location);
+    for (auto &xq : this->queues) {
+      if (xq.xsk)
+        xsk_socket__delete(xq.xsk);
+      if (xq.umem)
+        xsk_umem__delete(xq.umem);
+    }
+    close(this->ctl_fd);
+  }
+
+  virtual void send(int vm_id, const char *buf, const size_t len) {
+    this->send_stage(vm_id, buf, len);
+    this->tx_flush(vm_id);
+  }
+
+  virtual void send_stage(int vm_id, const char *buf, const size_t len) {
+    auto &stage = this->tx_stages[vm_id];
+    auto &xq = this->queues[this->get_queue_id(vm_id, 0)];
+
+    if (len > FRAME_SIZE) {
+      if_log_level(LOG_DEBUG, printf("WARN: AfXdp::send_stage: packet too large (%zu)\n", len));
+      Driver::count(stage.dropped, 1);
+      return;
+    }
+    if (xq.tx_frames.empty()) {
+      // we may be holding on to too many staged frames: send them and retry
+      this->tx_flush(vm_id);
+      this->reclaim_tx_frames(xq);
+    }
+    uint32_t idx;
+    if (xq.tx_frames.empty() || xsk_ring_prod__reserve(&xq.tx, 1, &idx) != 1) {
+      if_log_level(LOG_DEBUG, printf("WARN: AfXdp::send_stage: tx ring full\n"));
+      Driver::count(stage.dropped, 1);
+      return; // drop packet
+    }
+
+    uint64_t addr = xq.tx_frames.back();
+    xq.tx_frames.pop_back();
+    memcpy(xsk_umem__get_data(xq.umem_area, addr), buf, len);
+    struct xdp_desc *desc = xsk_ring_prod__tx_desc(&xq.tx, idx);
+    desc->addr = addr;
+    desc->len = len;
+    desc->options = 0;
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+
+    uint16_t nb_pkts = stage.nb_pkts.load(std::memory_order_relaxed);
+    if (nb_pkts == 0)
+      stage.first_ns = AfXdp::now_ns();
+    stage.nb_pkts.store(nb_pkts + 1, std::memory_order_relaxed);
+
+    if (nb_pkts + 1 == TX_BURST)
+      this->tx_flush(vm_id);
+  }
+
+  virtual void tx_flush(int vm_id, bool only_expired = false) {
+    auto &stage = this->tx_stages[vm_id];
+    auto &xq = this->queues[this->get_queue_id(vm_id, 0)];
+    uint16_t nb_pkts = stage.nb_pkts.load(std::memory_order_relaxed);
+    if (nb_pkts == 0)
+      return;
+    if (only_expired && AfXdp::now_ns() - stage.first_ns < TX_FLUSH_TIMEOUT_NS)
+      return;
+
+    xsk_ring_prod__submit(&xq.tx, nb_pkts);
+    if (xsk_ring_prod__needs_wakeup(&xq.tx))
+      sendto(xsk_socket__fd(xq.xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    Driver::count(stage.sent, nb_pkts);
+    stage.nb_pkts.store(0, std::memory_order_relaxed);
+
+    this->reclaim_tx_frames(xq);
+  }
+
+  virtual size_t tx_staged(int vm_id) {
+    return this->tx_stages[vm_id].nb_pkts.load(std::memory_order_relaxed);
+  }
+
+  virtual uint64_t tx_sent(int vm_id) {
+    return this->tx_stages[vm_id].sent.load(std::memory_order_relaxed);
+  }
+
+  virtual uint64_t tx_dropped(int vm_id) {
+    return this->tx_stages[vm_id].dropped.load(std::memory_order_relaxed);
+  }
+
+  // AF_XDP has no segmentation offload: send_tso() is not overridden, so
+  // the device segments in software
+
+  // each recv(vm) call must be followed up with a recv_consumed(vm) call. No other VMs may receive in between.
+  virtual void recv(int vm_id) {
+    for (unsigned q_idx = 0; q_idx < this->queues_per_vm; q_idx++) {
+      auto &xq = this->queues[this->get_queue_id(vm_id, q_idx)];
+      auto &rxq = this->get_rx_queue(vm_id, q_idx);
+
+      uint32_t idx;
+      uint32_t nb_rx = xsk_ring_cons__peek(&xq.rx, RX_BURST, &idx);
+      xq.rx_idx = idx;
+      xq.nb_rx = nb_rx;
+      rxq.nb_bufs_used = nb_rx;
+      if (nb_rx == 0) {
+        // in copy/generic mode, the kernel only fills the rx ring when kicked
+        if (xsk_ring_prod__needs_wakeup(&xq.fq))
+          recvfrom(xsk_socket__fd(xq.xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        continue;
+      }
+
+      // pass pointers into the umem to the device
+      for (uint32_t i = 0; i < nb_rx; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&xq.rx, idx + i);
+        auto &rxBuf = rxq.rxBufs[i];
+        rxBuf.data = (char *)xsk_umem__get_data(xq.umem_area, desc->addr);
+        rxBuf.used = desc->len;
+        rxBuf.meta = {};
+        if (this->mediate[vm_id]) {
+          rxBuf.queue = q_idx;
+        } else {
+          // make the behavioral model emulate the switching
+          rxBuf.queue = {};
+        }
+        if_log_level(LOG_DEBUG, printf("recv queue %u: ", this->get_queue_id(vm_id, q_idx)));
+        if_log_level(LOG_DEBUG, Util::dump_pkt(rxBuf.data, rxBuf.used));
+      }
+    }
+  }
+
+  virtual void recv_consumed(int vm_id) {
+    // return the frames to the fill ring
+    for (unsigned q_idx = 0; q_idx < this->queues_per_vm; q_idx++) {
+      auto &xq = this->queues[this->get_queue_id(vm_id, q_idx)];
+      auto &rxq = this->get_rx_queue(vm_id, q_idx);
+      rxq.nb_bufs_used = 0;
+      if (xq.nb_rx == 0)
+        continue;
+
+      // we own exactly the frames that are not in the fill ring, so this can't fail
+      uint32_t fill_idx;
+      while (xsk_ring_prod__reserve(&xq.fq, xq.nb_rx, &fill_idx) != xq.nb_rx)
+        ;
+      for (uint32_t i = 0; i < xq.nb_rx; i++) {
+        uint64_t addr = xsk_ring_cons__rx_desc(&xq.rx, xq.rx_idx + i)->addr;
+        *xsk_ring_prod__fill_addr(&xq.fq, fill_idx + i) = addr & ~((uint64_t)FRAME_SIZE - 1);
+      }
+      xsk_ring_prod__submit(&xq.fq, xq.nb_rx);
+      xsk_ring_cons__release(&xq.rx, xq.nb_rx);
+      xq.nb_rx = 0;
+    }
+  }
+
+  // xsk sockets are readable while their rx ring is not empty. Blocking reads
+  // on them fail right away (EOPNOTSUPP), so pollers may drain them.
+  virtual std::vector<int> rx_notify_fds(int vm_id) {
+    std::vector<int> fds;
+    for (unsigned q_idx = 0; q_idx < this->queues_per_vm; q_idx++)
+      fds.push_back(xsk_socket__fd(this->queues[this->get_queue_id(vm_id, q_idx)].xsk));
+    return fds;
+  }
+
+  virtual bool add_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t dst_queue) {
+    return this->add_switch_ntuple(vm_id, dst_addr, {}, dst_queue);
+  }
+
+  virtual bool add_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t etype, uint16_t dst_queue) {
+    return this->add_switch_ntuple(vm_id, dst_addr, etype, dst_queue);
+  }
+
+  virtual bool del_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t dst_queue) {
+    return this->del_switch_ntuple(vm_id, dst_addr, {}, dst_queue);
+  }
+
+  virtual bool del_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t etype, uint16_t dst_queue) {
+    return this->del_switch_ntuple(vm_id, dst_addr, etype, dst_queue);
+  }
+
+  virtual void del_switch_rules(int vm_id) {
+    for (auto &[match, rule] : this->ntuple_rules[vm_id])
+      this->del_ntuple_rule(rule.location);
+    this->ntuple_rules[vm_id].clear();
+  }
+
+  virtual bool mediation_enable(int vm_id) {
+    this->mediate[vm_id] = true;
+    return true;
+  }
+
+  virtual bool mediation_disable(int vm_id) {
+    // the behavioral model emulates the switch again: its rules no longer need the NIC
+    this->mediate[vm_id] = false;
+    this->del_switch_rules(vm_id);
+    return true;
+  }
+
+  virtual bool is_mediating(int vm_id) {
+    return this->mediate[vm_id];
+  }
+};
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <format>
@@ -18,6 +19,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <rte_eal.h>
+#include <rte_errno.h>
 #include <rte_ethdev.h>
 #include <rte_cycles.h>
 #include <rte_lcore.h>
@@ -26,6 +28,7 @@
 #include "src/util.hpp"
 #include "src/drivers/driver.hpp"
 #include "src/drivers/flow_blocks.hpp"
+#include "src/drivers/flow-manager.hpp"
 #include "src/devices/vdpdk-consts.hpp"
 #include <unistd.h>
 
@@ -33,8 +36,11 @@
 #define TX_RING_SIZE 1024
 
 #define NUM_MBUFS 256 // queue size
-#define MBUF_CACHE_SIZE 250
+#define MBUF_CACHE_SIZE 64 // per lcore and mempool, see Dpdk::thread_init()
+// mbufs that may sit in the caches of the (up to two) lcores using a pool
+#define MBUF_CACHE_RESERVE (2 * MBUF_CACHE_SIZE * 3 / 2)
 #define BURST_SIZE 32
+#define TX_FLUSH_TIMEOUT_US 50 // max time a packet may be staged for tx
 
 // from dpdk/app/test/packet_burst_generator.c
 static void
@@ -76,7 +82,7 @@ copy_buf_to_pkt(void *buf, unsigned len, struct rte_mbuf *pkt, unsigned offset)
 
 /* Port initialization used in flow filtering. 8< */
 static void
-filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte_mempool*> &rx_mbuf_pools, std::vector<struct rte_mempool*> &tx_mbuf_pools, bool &tso_supported)
+filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte_mempool*> &rx_mbuf_pools, std::vector<struct rte_mempool*> &tx_mbuf_pools, bool &tso_supported, bool rx_intr)
 {
 	int ret;
 	uint16_t i;
@@ -110,6 +116,22 @@ filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte
 			port_id, strerror(-ret));
 
 	port_conf.txmode.offloads &= dev_info.tx_offload_capa;
+	// let the NIC validate checksums for the emulated devices (see Dpdk::rx_meta).
+	// RTE_ETH_RX_OFFLOAD_RSS_HASH would require RSS mode, which would spread
+	// packets without a flow rule over all queues. Hashes of rte_flow RSS
+	// actions are passed on nevertheless.
+	port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_CHECKSUM & dev_info.rx_offload_capa;
+	// receive jumbo frames as mbuf chains. Without scatter support, frames are
+	// limited to one mbuf.
+	if (dev_info.rx_offload_capa & RTE_ETH_RX_OFFLOAD_SCATTER) {
+		port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_SCATTER;
+		port_conf.rxmode.mtu = std::min<uint32_t>(dev_info.max_mtu,
+			Driver::MAX_BUF - RTE_ETHER_HDR_LEN - RTE_ETHER_CRC_LEN);
+	} else {
+		printf(":: port %u cannot scatter rx packets, jumbo frames are unsupported\n", port_id);
+	}
+	// lets idle polling threads sleep until packets arrive
+	port_conf.intr_conf.rxq = rx_intr;
 	tso_supported = port_conf.txmode.offloads & RTE_ETH_TX_OFFLOAD_TCP_TSO;
 	printf(":: initializing port: %d\n", port_id);
 	ret = rte_eth_dev_configure(port_id,
@@ -128,10 +150,10 @@ filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte
 	struct rte_mempool *rx_pool;
 	size_t magic = 36; // when we set the PTP capability on the pNIC, bigger rx bursts can cause problems that look like as if the pool was exhausted (leaked mbufs). This magic threashold fixes it. Decrement by one to get the error again.
 	for (i = 0; i < nr_queues; i++) {
-		size_t rx_buffers = NUM_MBUFS + magic;
+		size_t rx_buffers = NUM_MBUFS + magic + MBUF_CACHE_RESERVE;
 		// TODO allocate these elsewhere
 		rx_pool = rte_pktmbuf_pool_create(std::format("RX_MBUF_POOL_{}", i).c_str(), rx_buffers ,
-			64, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id()); // TODO constant for cache
+			MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
 		if (rx_pool == NULL)
 			rte_exit(EXIT_FAILURE, "Cannot create rx mbuf pool %d\n", i);
 		rx_mbuf_pools.push_back(rx_pool);
@@ -156,8 +178,8 @@ filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte
 		size_t buffer_size = tso_supported ? (4096 * 4 + RTE_PKTMBUF_HEADROOM) : RTE_MBUF_DEFAULT_BUF_SIZE;
 		// Private data is used by Vdpdk
 		size_t priv_size = sizeof(struct rte_mbuf_ext_shared_info) + VDPDK_CONSTS::TX_DESC_SIZE;
-		tx_pool = rte_pktmbuf_pool_create(std::format("TX_MBUF_POOL_{}", i).c_str(), NUM_MBUFS * 2,
-			64, priv_size, buffer_size, rte_socket_id()); // TODO constant for cache
+		tx_pool = rte_pktmbuf_pool_create(std::format("TX_MBUF_POOL_{}", i).c_str(), NUM_MBUFS * 2 + MBUF_CACHE_RESERVE,
+			MBUF_CACHE_SIZE, priv_size, buffer_size, rte_socket_id());
 		if (tx_pool == NULL)
 			rte_exit(EXIT_FAILURE, "Cannot create tx mbuf pool %d\n", i);
 		tx_mbuf_pools.push_back(tx_pool);
@@ -362,12 +384,26 @@ private:
 	struct rte_mbuf **bufs; // list of rte_mbuf pointers
 	uint16_t port_id;
 	std::vector<bool> mediate; // per VM
+	std::unique_ptr<FlowManager> flows; // switch rules of mediated VMs
 
 	bool tso_supported = false;
+	bool rx_intr = false; // rx queue interrupts are configured
 	// list of current tso buffers
 	// one per queue
 	struct rte_mbuf **tso_seg = nullptr;
 
+	// per VM staging area for burst transmission
+	struct TxStage {
+		struct rte_mbuf *pkts[BURST_SIZE];
+		std::atomic<uint16_t> nb_pkts = 0;
+		uint64_t first_tsc = 0; // when the oldest staged packet was staged
+		// written by the sending thread only, read by print_stats
+		std::atomic<uint64_t> sent = 0;
+		std::atomic<uint64_t> dropped = 0;
+	};
+	std::vector<TxStage> tx_stages;
+	uint64_t tx_flush_timeout; // in tsc cycles
+
 	friend class VdpdkDevice;
 
 	// get queue id of native queue
@@ -379,11 +415,102 @@ private:
 		return vm * MAX_QUEUES_PER_VM + queue;
 	}
 
+	// translate the offload results of the NIC
+	static void rx_meta(const struct rte_mbuf *buf, RxMeta &meta) {
+		meta = {};
+		uint64_t ol_flags = buf->ol_flags;
+		if (ol_flags & RTE_MBUF_F_RX_RSS_HASH) {
+			meta.flags |= RxMeta::RSS_HASH;
+			meta.rss_hash = buf->hash.rss;
+		}
+		if (ol_flags & RTE_MBUF_F_RX_VLAN_STRIPPED) {
+			meta.flags |= RxMeta::VLAN_STRIPPED;
+			meta.vlan_tci = buf->vlan_tci;
+		}
+		if ((ol_flags & RTE_MBUF_F_RX_IP_CKSUM_MASK) == RTE_MBUF_F_RX_IP_CKSUM_GOOD)
+			meta.flags |= RxMeta::L3_CSUM_GOOD;
+		else if ((ol_flags & RTE_MBUF_F_RX_IP_CKSUM_MASK) == RTE_MBUF_F_RX_IP_CKSUM_BAD)
+			meta.flags |= RxMeta::L3_CSUM_BAD;
+		if ((ol_flags & RTE_MBUF_F_RX_L4_CKSUM_MASK) == RTE_MBUF_F_RX_L4_CKSUM_GOOD)
+			meta.flags |= RxMeta::L4_CSUM_GOOD;
+		else if ((ol_flags & RTE_MBUF_F_RX_L4_CKSUM_MASK) == RTE_MBUF_F_RX_L4_CKSUM_BAD)
+			meta.flags |= RxMeta::L4_CSUM_BAD;
+
+		uint32_t ptype = buf->packet_type;
+		if (RTE_ETH_IS_IPV4_HDR(ptype))
+			meta.l3_type = RxMeta::L3::IPV4;
+		else if (RTE_ETH_IS_IPV6_HDR(ptype))
+			meta.l3_type = RxMeta::L3::IPV6;
+		switch (ptype & RTE_PTYPE_L4_MASK) {
+		case RTE_PTYPE_L4_TCP: meta.l4_type = RxMeta::L4::TCP; break;
+		case RTE_PTYPE_L4_UDP: meta.l4_type = RxMeta::L4::UDP; break;
+		case RTE_PTYPE_L4_SCTP: meta.l4_type = RxMeta::L4::SCTP; break;
+		case RTE_PTYPE_L4_ICMP: meta.l4_type = RxMeta::L4::ICMP; break;
+		case RTE_PTYPE_L4_FRAG: meta.l4_type = RxMeta::L4::FRAG; break;
+		case RTE_PTYPE_L4_NONFRAG: meta.l4_type = RxMeta::L4::NONE; break;
+		}
+	}
+
+	bool add_switch_flow(int vm_id, uint8_t dst_addr[6], uint16_t etype, uint16_t etype_mask, uint16_t dst_queue) {
+		if (!this->mediate[vm_id]) {
+			// for emulation we ignore switch rules.
+			// Because we don't send queue hints to the behavioral model, it emulates the switch then.
+			return true;
+		}
+		if (dst_queue >= MAX_QUEUES_PER_VM)
+			return false;
+
+		FlowManager::Match match = { .etype = etype, .etype_mask = etype_mask };
+		memcpy(match.dst_mac, dst_addr, 6);
+		if (!this->flows->add(vm_id, match, dst_queue))
+			return false;
+
+		char fmt[RTE_ETHER_ADDR_FMT_SIZE];
+		rte_ether_format_addr(fmt, sizeof(fmt), (struct rte_ether_addr *)dst_addr);
+		printf("added rule dst_mac %s etype 0x%x/0x%x -> queue %d\n", fmt, etype, etype_mask,
+			this->get_rx_queue_id(vm_id, dst_queue));
+		return true;
+	}
+
+	bool del_switch_flow(int vm_id, uint8_t dst_addr[6], uint16_t etype, uint16_t etype_mask, uint16_t dst_queue) {
+		if (!this->mediate[vm_id])
+			return true; // see add_switch_flow()
+		FlowManager::Match match = { .etype = etype, .etype_mask = etype_mask };
+		memcpy(match.dst_mac, dst_addr, 6);
+		return this->flows->del(vm_id, match, dst_queue);
+	}
+
+	// Copy buf into the empty mbuf pkt. Chains more mbufs from pool if buf
+	// does not fit into one (jumbo frames). Returns false if allocation fails.
+	static bool copy_to_mbuf_chain(struct rte_mbuf *pkt, struct rte_mempool *pool, const char *buf, size_t len) {
+		struct rte_mbuf *seg = pkt;
+		size_t off = 0;
+		while (true) {
+			uint16_t n = std::min<size_t>(len - off, rte_pktmbuf_tailroom(seg));
+			rte_memcpy(rte_pktmbuf_mtod(seg, char*), buf + off, n);
+			seg->data_len = n;
+			off += n;
+			if (off == len)
+				break;
+			struct rte_mbuf *next = rte_pktmbuf_alloc(pool);
+			if (next == NULL)
+				return false;
+			if (rte_pktmbuf_chain(pkt, next) != 0) {
+				rte_pktmbuf_free(next);
+				return false;
+			}
+			seg = next;
+		}
+		pkt->pkt_len = len;
+		return true;
+	}
+
 public:
-	Dpdk(int num_vms, const uint8_t (*mac_addr)[6], int argc, char *argv[]) {
+	Dpdk(int num_vms, const uint8_t (*mac_addr)[6], int argc, char *argv[], bool rx_intr = false) {
 		this->alloc_rx_lists(MAX_QUEUES_PER_VM * num_vms, BURST_SIZE, MAX_QUEUES_PER_VM, MAX_QUEUES_PER_VM);
     this->bufs = (struct rte_mbuf **) malloc(MAX_QUEUES_PER_VM * BURST_SIZE * num_vms * sizeof(struct rte_mbuf*));
 		this->mediate = std::vector<bool>(num_vms, false);
+		this->tx_stages = std::vector<TxStage>(num_vms);
 
 		/*
  	 	 * The main function, which does initialization and calls the per-lcore
@@ -402,6 +529,8 @@ public:
 		argc -= ret;
 		argv += ret;
 
+		this->tx_flush_timeout = rte_get_tsc_hz() * TX_FLUSH_TIMEOUT_US / 1000000;
+
 		/* Check that there is an even number of ports to send/receive on. */
 		nb_ports = rte_eth_dev_count_avail();
 		if (nb_ports != 1)
@@ -427,7 +556,9 @@ public:
 		this->port_id = port_id;
 
 		/* Initializing all ports. 8< */
-		filtering_init_port(port_id, nr_queues, this->rx_mbuf_pools, this->tx_mbuf_pools, this->tso_supported);
+		filtering_init_port(port_id, nr_queues, this->rx_mbuf_pools, this->tx_mbuf_pools, this->tso_supported, rx_intr);
+		this->rx_intr = rx_intr;
+		this->flows = std::make_unique<FlowManager>(port_id, num_vms, MAX_QUEUES_PER_VM);
 		if (this->tso_supported) {
 			this->tso_seg = (struct rte_mbuf **) calloc(nr_queues, sizeof(struct rte_mbuf *));
 		}
@@ -464,6 +595,7 @@ public:
 		for (int queue_nb = 0; queue_nb < num_vms; queue_nb++) {
 			memcpy(&dest_mac, mac_addr, 6);
 			Util::intcrement_mac((uint8_t*)&dest_mac, queue_nb);
+			this->flows->set_vm_mac(queue_nb, dest_mac.addr_bytes);
 			// send all VM traffic to the first queue of each VM by default
 			flow = generate_eth_flow(port_id, this->get_rx_queue_id(queue_nb, 0),
 						&src_mac, &src_mask,
@@ -491,6 +623,7 @@ public:
 
 		/* closing and releasing resources */
 		rte_flow_flush(this->port_id, &error);
+		this->flows->forget_all();
     	rte_eth_timesync_disable(this->port_id);   
 		
     	ret = rte_eth_dev_stop(this->port_id);
@@ -516,36 +649,82 @@ public:
 	}
 
 	virtual void send(int vm_id, const char *buf, const size_t len) {
+		this->send_stage(vm_id, buf, len);
+		this->tx_flush(vm_id);
+	}
+
+	virtual void send_stage(int vm_id, const char *buf, const size_t len) {
 		// lcore_init_checks(); ignore cpu locality for now
-		uint16_t port;
-		RTE_ETH_FOREACH_DEV(port) {
-			// prepare packet buffer
-			uint16_t queue = this->get_tx_queue_id(vm_id, 0);
-			struct rte_mbuf *pkt;
+		auto &stage = this->tx_stages[vm_id];
+		uint16_t queue = this->get_tx_queue_id(vm_id, 0);
+
+		// prepare packet buffer
+		struct rte_mbuf *pkt;
+		pkt = rte_pktmbuf_alloc(this->tx_mbuf_pools[queue]);
+		if (pkt == NULL) {
+			// we may be holding on to too many staged mbufs: free some up and retry
+			this->tx_flush(vm_id);
 			pkt = rte_pktmbuf_alloc(this->tx_mbuf_pools[queue]);
-			if (pkt == NULL) {
-				printf("WARN: Dpdk::send: alloc failed\n");
-				return; // drop packet
-			}
-			pkt->data_len = len;
-			pkt->pkt_len = len;
-			pkt->nb_segs = 1;
+		}
+		if (pkt == NULL) {
+			if_log_level(LOG_DEBUG, printf("WARN: Dpdk::send_stage: alloc failed\n"));
+			Driver::count(stage.dropped, 1);
+			return; // drop packet
+		}
+		// let the NIC latch a tx timestamp for readTxTimestamp() (PTP)
+		pkt->ol_flags = RTE_MBUF_F_TX_IEEE1588_TMST;
+
+		if (unlikely(!this->copy_to_mbuf_chain(pkt, this->tx_mbuf_pools[queue], buf, len))) {
+			if_log_level(LOG_DEBUG, printf("WARN: Dpdk::send_stage: alloc failed\n"));
+			rte_pktmbuf_free(pkt);
+			Driver::count(stage.dropped, 1);
+			return; // drop packet
+		}
+		if_log_level(LOG_DEBUG, printf("send: "));
+		if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
 
-			// TODO	
-			pkt->ol_flags = RTE_MBUF_F_TX_IEEE1588_TMST;
-		
-			copy_buf_to_pkt((void*)buf, len, pkt, 0);
-			
-			/* Send burst of TX packets. */
-			const uint16_t nb_tx = rte_eth_tx_burst(port, queue,
-					&pkt, 1);
-			if (nb_tx != 1) {
-				printf("\nWARNING: Sending packet failed. \n");
-				rte_pktmbuf_free(pkt);
-			}
-			if_log_level(LOG_DEBUG, printf("send: "));
-			if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+		uint16_t nb_pkts = stage.nb_pkts.load(std::memory_order_relaxed);
+		if (nb_pkts == 0)
+			stage.first_tsc = rte_get_tsc_cycles();
+		stage.pkts[nb_pkts] = pkt;
+		stage.nb_pkts.store(nb_pkts + 1, std::memory_order_relaxed);
+
+		if (nb_pkts + 1 == BURST_SIZE)
+			this->tx_flush(vm_id);
+	}
+
+	virtual void tx_flush(int vm_id, bool only_expired = false) {
+		auto &stage = this->tx_stages[vm_id];
+		uint16_t nb_pkts = stage.nb_pkts.load(std::memory_order_relaxed);
+		if (nb_pkts == 0)
+			return;
+		if (only_expired &&
+		    rte_get_tsc_cycles() - stage.first_tsc < this->tx_flush_timeout)
+			return;
+
+		/* Send burst of TX packets. */
+		uint16_t queue = this->get_tx_queue_id(vm_id, 0);
+		const uint16_t nb_tx = rte_eth_tx_burst(this->port_id, queue,
+				stage.pkts, nb_pkts);
+		if (unlikely(nb_tx < nb_pkts)) {
+			if_log_level(LOG_DEBUG, printf("WARN: Dpdk::tx_flush: dropping %u packets\n", nb_pkts - nb_tx));
+			rte_pktmbuf_free_bulk(&stage.pkts[nb_tx], nb_pkts - nb_tx);
+			Driver::count(stage.dropped, nb_pkts - nb_tx);
 		}
+		Driver::count(stage.sent, nb_tx);
+		stage.nb_pkts.store(0, std::memory_order_relaxed);
+	}
+
+	virtual size_t tx_staged(int vm_id) {
+		return this->tx_stages[vm_id].nb_pkts.load(std::memory_order_relaxed);
+	}
+
+	virtual uint64_t tx_sent(int vm_id) {
+		return this->tx_stages[vm_id].sent.load(std::memory_order_relaxed);
+	}
+
+	virtual uint64_t tx_dropped(int vm_id) {
+		return this->tx_stages[vm_id].dropped.load(std::memory_order_relaxed);
 	}
 
 	virtual bool send_tso(int vm_id, const char *buf, const size_t len,
@@ -624,6 +803,9 @@ public:
 		ipv4_hdr->hdr_checksum = 0;
 		tcp_hdr->cksum = rte_ipv4_phdr_cksum(ipv4_hdr, tso_first->ol_flags);
 
+		// keep packet order: staged packets go first
+		this->tx_flush(vm_id);
+
 		uint16_t port;
 		RTE_ETH_FOREACH_DEV(port) {
 			const uint16_t nb_tx = rte_eth_tx_burst(port, queue,
@@ -648,6 +830,7 @@ public:
   virtual void recv(int vm_id) {
 		// lcore_init_checks(); ignore cpu locality for now
 		uint16_t port = 0;
+		auto sw_rules = this->mediate[vm_id] ? this->flows->sw_rules(vm_id) : nullptr;
 
 		/*
 	 	 * Receive packets on a port and forward them on the same
@@ -666,27 +849,68 @@ public:
 
 			// pass pointers to packet buffers via rxBufs to behavioral model
 			auto &rxq = get_rx_queue(vm_id, q_idx);
+			uint16_t nb_used = 0;
 			for (uint16_t i = 0; i < nb_rx; i++) {
 				struct rte_mbuf* buf = this->bufs[queue_id * BURST_SIZE + i]; // we checked before that there is at least one packet
-				char* pkt = rte_pktmbuf_mtod(buf, char*);
-				if (buf->nb_segs != 1)
-					die("This rx buffer has multiple segments. Unimplemented.");
-				if (buf->pkt_len >= this->MAX_BUF)
-					die("Cant handle packets of size %d", buf->pkt_len);
-				// rte_memcpy(this->rxBufs[i], pkt, buf->pkt_len);
-				auto &rxBuf = rxq.rxBufs[i];
-				rxBuf.data = pkt;
+				if (unlikely(buf->pkt_len > this->MAX_BUF)) {
+					if_log_level(LOG_DEBUG, printf("WARN: Dpdk::recv: dropping packet of size %u\n", buf->pkt_len));
+					rte_pktmbuf_free(buf);
+					continue;
+				}
+				// keep the mbufs to free in recv_consumed() at the front
+				this->bufs[queue_id * BURST_SIZE + nb_used] = buf;
+				auto &rxBuf = rxq.rxBufs[nb_used++];
+				rxBuf.data = rte_pktmbuf_mtod(buf, char*);
 				rxBuf.used = buf->pkt_len;
+				Dpdk::rx_meta(buf, rxBuf.meta);
+				rxBuf.segs.clear();
+				if (unlikely(buf->nb_segs > 1)) {
+					for (struct rte_mbuf *seg = buf; seg != NULL; seg = seg->next)
+						rxBuf.segs.push_back({ rte_pktmbuf_mtod(seg, void*), seg->data_len });
+				}
 				if (this->mediate[vm_id]) {
 					rxBuf.queue = q_idx;
+					// rules that did not fit into the NIC: their packets arrive on the
+					// default queue, or the queue of a less specific hardware rule
+					if (unlikely(sw_rules)) {
+						size_t head_len = rxBuf.segmented() ? rxBuf.segs[0].iov_len : rxBuf.used;
+						rxBuf.queue = FlowManager::classify(*sw_rules, rxBuf.data, head_len).value_or(q_idx);
+					}
 				} else {
 					// make the behavioral model emulate the switching
 					rxBuf.queue = {};
 				}
 				if_log_level(LOG_DEBUG, printf("recv queue %d: ", queue_id));
-				if_log_level(LOG_DEBUG, Util::dump_pkt(rxBuf.data, rxBuf.used));
+				if_log_level(LOG_DEBUG, Util::dump_pkt(rxBuf.data, rxBuf.segmented() ? rxBuf.segs[0].iov_len : rxBuf.used));
 			}
-			rxq.nb_bufs_used = nb_rx;
+			rxq.nb_bufs_used = nb_used;
+		}
+  }
+
+  virtual std::vector<int> rx_notify_fds(int vm_id) {
+		std::vector<int> fds;
+		if (!this->rx_intr)
+			return fds;
+		for (int q_idx = 0; q_idx < MAX_QUEUES_PER_VM; q_idx++) {
+			int fd = rte_eth_dev_rx_intr_ctl_q_get_fd(this->port_id, this->get_rx_queue_id(vm_id, q_idx));
+			if (fd < 0) {
+				printf("Rx interrupts unavailable for vm %d queue %d\n", vm_id, q_idx);
+				continue;
+			}
+			fds.push_back(fd);
+		}
+		return fds;
+  }
+
+  virtual void rx_notify_enable(int vm_id, bool enable) {
+		if (!this->rx_intr)
+			return;
+		for (int q_idx = 0; q_idx < MAX_QUEUES_PER_VM; q_idx++) {
+			uint16_t queue_id = this->get_rx_queue_id(vm_id, q_idx);
+			if (enable)
+				rte_eth_dev_rx_intr_enable(this->port_id, queue_id);
+			else
+				rte_eth_dev_rx_intr_disable(this->port_id, queue_id);
 		}
   }
 
@@ -747,84 +971,23 @@ public:
   };
 
   virtual bool add_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t dst_queue) {
-  	if (!this->mediate[vm_id]) {
-  		// for emulation we ignore switch rules.
-  		// Because we don't send queue hints to the behavioral model, it emulates the switch then.
-  		return true;
-  	}
-
-  	printf("dpdk add switch rule\n");
-
-		struct rte_flow_error error;
-  	struct rte_flow* flow;
-		struct rte_ether_addr src_mac;
-		struct rte_ether_addr src_mask;
-		struct rte_ether_addr dest_mac;
-		struct rte_ether_addr dest_mask;
-		char fmt[20];
-		uint16_t queue_id = this->get_rx_queue_id(vm_id, dst_queue);
-
-		rte_ether_unformat_addr("00:00:00:00:00:00", &src_mac);
-		rte_ether_unformat_addr("00:00:00:00:00:00", &src_mask);
-		// rte_ether_unformat_addr("52:54:00:fa:00:60", &dest_mac);
-		rte_ether_unformat_addr("FF:FF:FF:FF:FF:FF", &dest_mask);
-
-		memcpy(dest_mac.addr_bytes, dst_addr, 6);
-		flow = generate_eth_flow(port_id, queue_id,
-					&src_mac, &src_mask,
-					&dest_mac, &dest_mask,
-					0, 0, &error);
-		if (!flow) {
-			printf("Flow can't be created %d message: %s\n",
-				error.type,
-				error.message ? error.message : "(no stated reason)");
-			return false;
-		}
-		rte_ether_format_addr(fmt, sizeof(fmt), &dest_mac);
-  	printf("added rule dst_mac %s -> queue %d\n", fmt, queue_id);
-
-  	return true;
+		return this->add_switch_flow(vm_id, dst_addr, 0, 0, dst_queue);
   }
 
-	// TODO deduplicate code with above
   virtual bool add_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t etype, uint16_t dst_queue) {
-  	if (!this->mediate[vm_id]) {
-  		// for emulation we ignore switch rules.
-  		// Because we don't send queue hints to the behavioral model, it emulates the switch then.
-  		return true;
-  	}
-
-  	printf("dpdk add switch etype rule\n");
-
-		struct rte_flow_error error;
-  	struct rte_flow* flow;
-		struct rte_ether_addr src_mac;
-		struct rte_ether_addr src_mask;
-		struct rte_ether_addr dest_mac;
-		struct rte_ether_addr dest_mask;
-		char fmt[20];
-		uint16_t queue_id = this->get_rx_queue_id(vm_id, dst_queue);
+		return this->add_switch_flow(vm_id, dst_addr, etype, 0xFFFF, dst_queue);
+  }
 
-		rte_ether_unformat_addr("00:00:00:00:00:00", &src_mac);
-		rte_ether_unformat_addr("00:00:00:00:00:00", &src_mask);
-		// rte_ether_unformat_addr("52:54:00:fa:00:60", &dest_mac);
-		rte_ether_unformat_addr("FF:FF:FF:FF:FF:FF", &dest_mask);
+  virtual bool del_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t dst_queue) {
+		return this->del_switch_flow(vm_id, dst_addr, 0, 0, dst_queue);
+  }
 
-		memcpy(dest_mac.addr_bytes, dst_addr, 6);
-		flow = generate_eth_flow(port_id, queue_id,
-					&src_mac, &src_mask,
-					&dest_mac, &dest_mask,
-					etype, 0xFFFF, &error);
-		if (!flow) {
-			printf("Flow can't be created %d message: %s\n",
-				error.type,
-				error.message ? error.message : "(no stated reason)");
-			return false;
-		}
-		rte_ether_format_addr(fmt, sizeof(fmt), &dest_mac);
-  	printf("added rule dst_mac %s etype 0x%x -> queue %d\n", fmt, etype, queue_id);
+  virtual bool del_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t etype, uint16_t dst_queue) {
+		return this->del_switch_flow(vm_id, dst_addr, etype, 0xFFFF, dst_queue);
+  }
 
-  	return true;
+  virtual void del_switch_rules(int vm_id) {
+		this->flows->del_all(vm_id);
   }
 
   virtual bool mediation_enable(int vm_id) {
@@ -833,11 +996,40 @@ public:
   }
 
   virtual bool mediation_disable(int vm_id) {
-		// die("unimplemented: you need to flush switch rules from the emulator to the device");
-		return false;
+		// the behavioral model emulates the switch again: its rules no longer need hardware
+		this->mediate[vm_id] = false;
+		this->flows->del_all(vm_id);
+		return true;
   }
 
   virtual bool is_mediating(int vm_id) {
 	return this->mediate[vm_id];
   }
+
+  // Make the calling thread a (non-EAL) lcore. Without an lcore id, every mbuf
+  // alloc and free bypasses the per-lcore mempool caches and contends on the
+  // shared pool ring.
+  virtual void thread_init() {
+	if (this->thread_users++ > 0 || rte_lcore_id() != LCORE_ID_ANY)
+		return; // already an lcore
+	if (rte_thread_register() != 0) {
+		printf("WARN: Dpdk: cannot register thread as lcore (%s), mempool caches are bypassed\n",
+			rte_strerror(rte_errno));
+		return;
+	}
+	this->thread_registered = true;
+	if_log_level(LOG_INFO, printf("Dpdk: registered thread as lcore %u\n", rte_lcore_id()));
+  }
+
+  virtual void thread_exit() {
+	if (--this->thread_users > 0 || !this->thread_registered)
+		return;
+	rte_thread_unregister();
+	this->thread_registered = false;
+  }
+
+private:
+	// per thread state of thread_init()
+	static inline thread_local unsigned thread_users = 0;
+	static inline thread_local bool thread_registered = false;
 };
@@ -1,10 +1,17 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <optional>
+#include <memory>
 #include <vector>
+#include <sys/uio.h>
+#include <boost/lockfree/stack.hpp>
 #include "util.hpp"
+#include "rx-arena.hpp"
 
 struct vmux_descriptor {
   char *buf;
@@ -12,29 +19,127 @@ struct vmux_descriptor {
   std::optional<uint16_t> dst_queue;
 };
 
+// Preallocated vmux_descriptors with fixed-size buffers, shared by all threads
+class VmuxDescriptorPool {
+public:
+  static constexpr size_t NB_DESCRIPTORS = 256;
+  static constexpr size_t BUF_SIZE = 9728; // Driver::MAX_BUF
+
+  static VmuxDescriptorPool &instance() {
+    static VmuxDescriptorPool pool;
+    return pool;
+  }
+
+  // nullptr if the pool is exhausted
+  vmux_descriptor *get() {
+    vmux_descriptor *desc;
+    if (!this->free_list.pop(desc))
+      return nullptr;
+    return desc;
+  }
+
+  void put(vmux_descriptor *desc) {
+    // can't fail: the free list has room for all descriptors
+    this->free_list.bounded_push(desc);
+  }
+
+private:
+  std::vector<vmux_descriptor> descriptors;
+  std::unique_ptr<char[]> bufs;
+  boost::lockfree::stack<vmux_descriptor*, boost::lockfree::capacity<NB_DESCRIPTORS>> free_list;
+
+  VmuxDescriptorPool() : descriptors(NB_DESCRIPTORS), bufs(new char[NB_DESCRIPTORS * BUF_SIZE]) {
+    for (size_t i = 0; i < NB_DESCRIPTORS; i++) {
+      this->descriptors[i].buf = &this->bufs[i * BUF_SIZE];
+      this->free_list.bounded_push(&this->descriptors[i]);
+    }
+  }
+};
+
+// Returns nullptr if no descriptor is available or buf_len is too large
 inline vmux_descriptor *vmux_descriptor_alloc(size_t buf_len) {
-  auto descriptor = new vmux_descriptor;
-  descriptor->buf = (char*) malloc(buf_len);
+  if (buf_len > VmuxDescriptorPool::BUF_SIZE)
+    return nullptr;
+  auto descriptor = VmuxDescriptorPool::instance().get();
+  if (!descriptor)
+    return nullptr;
   descriptor->len = buf_len;
+  descriptor->dst_queue = {};
   return descriptor;
 }
 
 inline void vmux_descriptor_free(vmux_descriptor *desc) {
-  free(desc->buf);
-  delete desc;
+  VmuxDescriptorPool::instance().put(desc);
 }
 
 // Abstract class for Driver backends
 class Driver {
 public:
-  static constexpr int MAX_BUF = 9000; // should be enough even for most jumboframes
+  static constexpr int MAX_BUF = 9728; // largest frame of an E810, enough for 9000 byte MTUs
+  static_assert(MAX_BUF == VmuxDescriptorPool::BUF_SIZE);
 
   int fd = 0; // may be a non-null fd to poll on
+  int numa_node = -1; // where rx buffers are placed (-1: anywhere)
+
+  // What the NIC already found out about a received packet
+  struct RxMeta {
+    static constexpr uint8_t RSS_HASH = 1 << 0; // rss_hash is valid
+    static constexpr uint8_t VLAN_STRIPPED = 1 << 1; // vlan_tci was removed from the packet
+    static constexpr uint8_t L3_CSUM_GOOD = 1 << 2;
+    static constexpr uint8_t L3_CSUM_BAD = 1 << 3;
+    static constexpr uint8_t L4_CSUM_GOOD = 1 << 4;
+    static constexpr uint8_t L4_CSUM_BAD = 1 << 5;
+
+    enum class L3 : uint8_t { UNKNOWN, IPV4, IPV6 };
+    enum class L4 : uint8_t { UNKNOWN, NONE, FRAG, TCP, UDP, SCTP, ICMP };
+
+    uint8_t flags = 0;
+    L3 l3_type = L3::UNKNOWN;
+    L4 l4_type = L4::UNKNOWN;
+    uint16_t vlan_tci = 0;
+    uint32_t rss_hash = 0;
+  };
 
   struct RxBuf {
-    char *data = nullptr;
-    size_t used = 0; // how much the rxBuf is actually filled with data
+    char *data = nullptr; // the packet, or its first segment if segmented
+    size_t used = 0; // how much the rxBuf is actually filled with data (all segments)
     std::optional<uint16_t> queue; // optional hint to destination queue
+    RxMeta meta; // filled in by every recv()
+    // All segments of a packet spread over several buffers (e.g. an mbuf
+    // chain), starting with data. Empty for contiguous packets.
+    std::vector<struct iovec> segs;
+
+    bool segmented() const { return !segs.empty(); }
+
+    // copy len bytes starting at offset of the packet to dst
+    void copy_out(size_t offset, char *dst, size_t len) const {
+      if (!this->segmented()) {
+        memcpy(dst, this->data + offset, len);
+        return;
+      }
+      for (auto &seg : this->segs) {
+        if (len == 0)
+          break;
+        if (offset >= seg.iov_len) {
+          offset -= seg.iov_len;
+          continue;
+        }
+        size_t n = std::min(len, seg.iov_len - offset);
+        memcpy(dst, (char *)seg.iov_base + offset, n);
+        dst += n;
+        len -= n;
+        offset = 0;
+      }
+    }
+
+    // The whole packet in one buffer: data itself, or a copy in scratch
+    // (at least MAX_BUF bytes) if the packet is segmented.
+    const char *linear(char *scratch) const {
+      if (!this->segmented())
+        return this->data;
+      this->copy_out(0, scratch, this->used);
+      return scratch;
+    }
   };
 
   struct RxQueue {
@@ -66,28 +171,30 @@ public:
     this->vm_queue_stride = vm_queue_stride;
   }
 
-  void alloc_rx_bufs() {
+  // Carve the rxBufs of all queues from one arena. A queue's buffers are
+  // consecutive and each is reused by its slot after recv_consumed().
+  void alloc_rx_bufs(size_t buf_size = Driver::MAX_BUF) {
     if (rxQueues.empty())
       die("rxBuf lists uninitialized. Call alloc_rx_lists first.")
 
+    size_t stride = RxArena::align_up(buf_size, RxArena::CACHE_LINE);
+    size_t nb_bufs = 0;
+    for (auto &rxq : rxQueues)
+      nb_bufs += rxq.rxBufs.size();
+    this->rx_arena = std::make_unique<RxArena>(nb_bufs * stride, this->numa_node);
+
     for (auto &rxq : rxQueues) {
-      for (auto &rxbuf : rxq.rxBufs) {
-        rxbuf.data = (char *)malloc(Driver::MAX_BUF);
-        if (!rxbuf.data)
-          die("Cannot allocate rxBuf");
-      }
+      for (auto &rxbuf : rxq.rxBufs)
+        rxbuf.data = this->rx_arena->alloc(buf_size);
     }
   }
 
   void free_rx_bufs() {
     for (auto &rxq : rxQueues) {
-      for (auto &rxbuf : rxq.rxBufs) {
-        if (!rxbuf.data)
-          continue;
-        free(rxbuf.data);
+      for (auto &rxbuf : rxq.rxBufs)
         rxbuf.data = nullptr;
-      }
     }
+    this->rx_arena.reset();
   }
 
   // vm_id can be used to serve multiple VMs with one single driver
@@ -103,8 +210,48 @@ public:
     // by default, TSO is not supported
     return false;
   }
+
+  // Burst transmit: queue a packet for sending without necessarily sending it
+  // right away. Staged packets are sent once the staging batch is full, on
+  // tx_flush() or once they exceeded the flush timeout.
+  // Backends without batching send immediately.
+  virtual void send_stage(int vm_id, const char *buf, const size_t len) {
+    send(vm_id, buf, len);
+  }
+  // send all staged packets of vm_id.
+  // If only_expired is set, only flush if the oldest staged packet is older
+  // than the flush timeout.
+  virtual void tx_flush(int vm_id, bool only_expired = false) {}
+  // number of packets currently staged for vm_id. May be called without
+  // holding the lock protecting send_stage/tx_flush.
+  virtual size_t tx_staged(int vm_id) { return 0; }
+  // send a list of packets in one go
+  virtual void send_burst(int vm_id, const char *const bufs[],
+                          const size_t lens[], const size_t nb) {
+    for (size_t i = 0; i < nb; i++)
+      send_stage(vm_id, bufs[i], lens[i]);
+    tx_flush(vm_id);
+  }
+  // packets handed to the NIC (or kernel) for transmission
+  virtual uint64_t tx_sent(int vm_id) { return 0; }
+  // packets dropped on transmission (ring full or out of buffers)
+  virtual uint64_t tx_dropped(int vm_id) { return 0; }
+  // print the counters of vm_id since startup. Called periodically by a
+  // thread other than the polling ones.
+  virtual void print_stats(const char *name, int vm_id) {
+    printf("%s: %lu tx sent, %lu tx dropped (total)\n", name,
+           this->tx_sent(vm_id), this->tx_dropped(vm_id));
+  }
+
   virtual void recv(int vm_id) = 0;
   virtual void recv_consumed(int vm_id) = 0;
+
+  // Rx notifications for idle polling threads: fds (e.g. eventfds) that become
+  // readable when packets for vm_id arrive while notifications are enabled.
+  // Pollers read() them to reset eventfds, which must be harmless for other
+  // kinds of fds. Drivers that can't notify return none.
+  virtual std::vector<int> rx_notify_fds(int vm_id) { return {}; }
+  virtual void rx_notify_enable(int vm_id, bool enable) {}
   
   // PTP
   virtual void enableTimesync(uint16_t port) {};
@@ -122,6 +269,18 @@ public:
     return false;
   }
 
+  // Undo one add_switch_rule() with the same arguments. Return false if there is no such rule.
+  virtual bool del_switch_rule(int vm_id, uint8_t mac_addr[6], uint16_t dst_queue) {
+    return false;
+  }
+
+  virtual bool del_switch_rule(int vm_id, uint8_t mac_addr[6], uint16_t etype, uint16_t dst_queue) {
+    return false;
+  }
+
+  // Remove all switch rules of the VM (e.g. when it goes away)
+  virtual void del_switch_rules(int vm_id) {}
+
   virtual bool mediation_enable(int vm_id) {
     return false;
   }
@@ -133,4 +292,36 @@ public:
   virtual bool is_mediating(int vm_id) {
     return false;
   }
+
+  // Called by every thread that uses this driver, before its first and after
+  // its last call into the driver. May be called repeatedly by one thread.
+  virtual void thread_init() {}
+  virtual void thread_exit() {}
+
+protected:
+  // backs the rxBufs, or other packet buffers of the backend
+  std::unique_ptr<RxArena> rx_arena;
+
+  // add to a statistics counter that only the calling thread writes
+  static inline void count(std::atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+};
+
+// Driver::thread_init() and thread_exit() for the lifetime of the scope.
+// driver may be null.
+class DriverThreadScope {
+public:
+  DriverThreadScope(std::shared_ptr<Driver> driver) : driver(driver) {
+    if (this->driver)
+      this->driver->thread_init();
+  }
+
+  ~DriverThreadScope() {
+    if (this->driver)
+      this->driver->thread_exit();
+  }
+
+private:
+  std::shared_ptr<Driver> driver;
 };
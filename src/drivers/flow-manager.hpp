@@ -0,0 +1,316 @@
+#pragma once
+
+#include "src/drivers/flow_blocks.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <compare>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <rte_errno.h>
+#include <rte_flow.h>
+#include <vector>
+
+/**
+ * Owns the rte_flow switch rules that steer packets to the queues of VMs.
+ *
+ * Rules are deduplicated by their match and refcounted: a rule added twice
+ * stays installed until it is deleted twice. When the NIC runs out of flow
+ * entries, rules are kept in software instead. Their packets then arrive on
+ * the default queue of the VM (the one its MAC address is steered to) and the
+ * receiver finds their queue with classify(). Packets to other MAC addresses
+ * (e.g. PTP multicast) are steered to the default queue by one "funnel" flow
+ * per address. Software rules move to hardware as soon as hardware rules are
+ * deleted.
+ */
+class FlowManager {
+public:
+	struct Match {
+		uint8_t dst_mac[6];
+		uint16_t etype; // host byte order
+		uint16_t etype_mask; // 0: any ethertype
+
+		auto operator<=>(const Match &) const = default;
+	};
+
+	struct SwRule {
+		Match match;
+		uint16_t queue; // queue index within the VM
+	};
+	using SwRules = std::vector<SwRule>;
+	using Mac = std::array<uint8_t, 6>;
+
+	FlowManager(uint16_t port_id, int num_vms, uint16_t queues_per_vm)
+		: port_id(port_id), queues_per_vm(queues_per_vm), vms(num_vms) {}
+
+	/// The MAC address the default flow steers to the first queue of the VM
+	void set_vm_mac(int vm_id, const uint8_t mac[6]) {
+		std::lock_guard guard(this->mutex);
+		memcpy(this->vms[vm_id].mac.data(), mac, 6);
+	}
+
+	/// Install a rule steering match to queue of the VM. Returns false if the
+	/// rule is invalid or conflicts with an existing rule to another queue.
+	bool add(int vm_id, const Match &match, uint16_t queue) {
+		std::lock_guard guard(this->mutex);
+		auto &vm = this->vms[vm_id];
+		auto it = vm.rules.find(match);
+		if (it != vm.rules.end()) {
+			if (it->second.queue != queue) {
+				printf("Flow rule of vm %d conflicts with existing rule to queue %u\n", vm_id, it->second.queue);
+				return false;
+			}
+			it->second.refs++;
+			return true;
+		}
+
+		this->drop_funnel(vm_id, match);
+		struct rte_flow *flow = this->create(vm_id, match, queue);
+		if (!flow && !this->table_full()) {
+			this->publish_sw_rules(vm_id);
+			return false;
+		}
+		vm.rules.emplace(match, Rule { flow, queue, 1 });
+		this->publish_sw_rules(vm_id);
+		if (!flow) {
+			if (!this->reaches_vm(vm_id, match)) {
+				printf("Flow table full: no room to steer packets of the rule to vm %d\n", vm_id);
+				vm.rules.erase(match);
+				this->publish_sw_rules(vm_id);
+				return false;
+			}
+			if_log_level(LOG_INFO, printf("Flow table full: classifying rule of vm %d in software\n", vm_id));
+		}
+		return true;
+	}
+
+	/// Drop one reference to the rule. Returns false if there is no such rule.
+	bool del(int vm_id, const Match &match, uint16_t queue) {
+		std::lock_guard guard(this->mutex);
+		auto &vm = this->vms[vm_id];
+		auto it = vm.rules.find(match);
+		if (it == vm.rules.end() || it->second.queue != queue)
+			return false;
+		if (--it->second.refs > 0)
+			return true;
+
+		bool hw = it->second.flow != nullptr;
+		this->destroy(it->second.flow);
+		vm.rules.erase(it);
+		this->publish_sw_rules(vm_id);
+		if (hw)
+			this->promote();
+		return true;
+	}
+
+	/// Delete all rules of a VM, regardless of their references
+	void del_all(int vm_id) {
+		std::lock_guard guard(this->mutex);
+		auto &vm = this->vms[vm_id];
+		if (vm.rules.empty())
+			return;
+		for (auto &[match, rule] : vm.rules)
+			this->destroy(rule.flow);
+		vm.rules.clear();
+		this->publish_sw_rules(vm_id); // destroys the funnels
+		this->promote();
+	}
+
+	/// Forget all rules without destroying them, e.g. after rte_flow_flush()
+	void forget_all() {
+		std::lock_guard guard(this->mutex);
+		for (size_t vm_id = 0; vm_id < this->vms.size(); vm_id++) {
+			this->vms[vm_id].rules.clear();
+			this->vms[vm_id].funnels.clear();
+			this->publish_sw_rules(vm_id);
+		}
+	}
+
+	/// Snapshot of all rules of a VM if any of them is classified in software
+	/// (null otherwise). Cheap enough to fetch once per received burst.
+	std::shared_ptr<const SwRules> sw_rules(int vm_id) {
+		return this->vms[vm_id].sw_rules.load(std::memory_order_acquire);
+	}
+
+	/// Order rules so that classify() picks the most specific match, like the
+	/// NIC does: rules on an ethertype before ones on any ethertype.
+	static void sort_rules(SwRules &rules) {
+		std::stable_sort(rules.begin(), rules.end(), [](const SwRule &a, const SwRule &b) {
+			return std::popcount(a.match.etype_mask) > std::popcount(b.match.etype_mask);
+		});
+	}
+
+	/// Find the queue of a packet according to rules ordered by sort_rules()
+	static std::optional<uint16_t> classify(const SwRules &rules, const char *pkt, size_t len) {
+		if (len < 14)
+			return {};
+		uint16_t etype = ((uint8_t)pkt[12] << 8) | (uint8_t)pkt[13];
+		for (auto &rule : rules) {
+			if (memcmp(pkt, rule.match.dst_mac, 6) == 0 &&
+			    (etype & rule.match.etype_mask) == (rule.match.etype & rule.match.etype_mask))
+				return rule.queue;
+		}
+		return {};
+	}
+
+private:
+	struct Rule {
+		struct rte_flow *flow; // null: classified in software
+		uint16_t queue;
+		unsigned refs;
+	};
+
+	struct VmFlows {
+		Mac mac = {};
+		std::map<Match, Rule> rules;
+		// steer other dst MACs of software rules to the first queue of the VM
+		std::map<Mac, struct rte_flow *> funnels;
+		std::atomic<std::shared_ptr<const SwRules>> sw_rules;
+	};
+
+	uint16_t port_id;
+	uint16_t queues_per_vm;
+	std::mutex mutex; // serializes all changes to the rules
+	std::vector<VmFlows> vms;
+
+	struct rte_flow *create(int vm_id, const Match &match, uint16_t queue) {
+		struct rte_flow_error error;
+		struct rte_ether_addr src_mac = {};
+		struct rte_ether_addr src_mask = {};
+		struct rte_ether_addr dest_mac;
+		struct rte_ether_addr dest_mask;
+		memcpy(dest_mac.addr_bytes, match.dst_mac, 6);
+		memset(dest_mask.addr_bytes, 0xFF, 6);
+
+		rte_errno = 0;
+		struct rte_flow *flow = generate_eth_flow(this->port_id, vm_id * this->queues_per_vm + queue,
+					&src_mac, &src_mask,
+					&dest_mac, &dest_mask,
+					match.etype, match.etype_mask, &error);
+		if (!flow && !this->table_full()) {
+			printf("Flow can't be created %d message: %s\n",
+				error.type,
+				error.message ? error.message : "(no stated reason)");
+		}
+		return flow;
+	}
+
+	void destroy(struct rte_flow *flow) {
+		if (!flow)
+			return;
+		struct rte_flow_error error;
+		if (rte_flow_destroy(this->port_id, flow, &error) != 0) {
+			printf("Flow can't be destroyed %d message: %s\n",
+				error.type,
+				error.message ? error.message : "(no stated reason)");
+		}
+	}
+
+	// whether the last failed create() ran out of flow entries
+	bool table_full() {
+		return rte_errno == ENOSPC || rte_errno == ENOMEM || rte_errno == E2BIG;
+	}
+
+	// move software rules to hardware while there is room
+	void promote() {
+		for (size_t vm_id = 0; vm_id < this->vms.size(); vm_id++) {
+			bool promoted = false;
+			for (auto &[match, rule] : this->vms[vm_id].rules) {
+				if (rule.flow)
+					continue;
+				this->drop_funnel(vm_id, match);
+				rule.flow = this->create(vm_id, match, rule.queue);
+				if (!rule.flow) {
+					if (promoted)
+						this->publish_sw_rules(vm_id);
+					return;
+				}
+				promoted = true;
+			}
+			if (promoted)
+				this->publish_sw_rules(vm_id);
+		}
+	}
+
+	static Mac mac_of(const Match &match) {
+		Mac mac;
+		memcpy(mac.data(), match.dst_mac, 6);
+		return mac;
+	}
+
+	// a hardware rule steering all packets to mac to the VM
+	bool hw_wildcard(int vm_id, const Mac &mac) {
+		auto &vm = this->vms[vm_id];
+		Match wildcard = {};
+		memcpy(wildcard.dst_mac, mac.data(), 6);
+		auto it = vm.rules.find(wildcard);
+		return it != vm.rules.end() && it->second.flow;
+	}
+
+	// whether packets of a software rule arrive at the VM at all
+	bool reaches_vm(int vm_id, const Match &match) {
+		auto &vm = this->vms[vm_id];
+		Mac mac = mac_of(match);
+		return mac == vm.mac || this->hw_wildcard(vm_id, mac) || vm.funnels.count(mac);
+	}
+
+	// a funnel matches the same packets as a wildcard rule on its MAC: remove
+	// it before installing the rule
+	void drop_funnel(int vm_id, const Match &match) {
+		auto &vm = this->vms[vm_id];
+		if (match.etype_mask)
+			return;
+		auto it = vm.funnels.find(mac_of(match));
+		if (it == vm.funnels.end())
+			return;
+		this->destroy(it->second);
+		vm.funnels.erase(it);
+	}
+
+	// create the funnels software rules need and destroy the rest
+	void update_funnels(int vm_id) {
+		auto &vm = this->vms[vm_id];
+		std::map<Mac, struct rte_flow *> funnels;
+		for (auto &[match, rule] : vm.rules) {
+			Mac mac = mac_of(match);
+			if (rule.flow || mac == vm.mac || this->hw_wildcard(vm_id, mac) || funnels.count(mac))
+				continue;
+			if (auto it = vm.funnels.find(mac); it != vm.funnels.end()) {
+				funnels.emplace(mac, it->second);
+				vm.funnels.erase(it);
+				continue;
+			}
+			Match any = {};
+			memcpy(any.dst_mac, mac.data(), 6);
+			struct rte_flow *flow = this->create(vm_id, any, 0);
+			if (flow)
+				funnels.emplace(mac, flow);
+		}
+		for (auto &[mac, flow] : vm.funnels)
+			this->destroy(flow);
+		vm.funnels = std::move(funnels);
+	}
+
+	void publish_sw_rules(int vm_id) {
+		auto &vm = this->vms[vm_id];
+		this->update_funnels(vm_id);
+		bool any_sw = false;
+		auto rules = std::make_shared<SwRules>();
+		for (auto &[match, rule] : vm.rules) {
+			any_sw |= !rule.flow;
+			// hardware rules as well: their packets also arrive on queues
+			// the receiver classifies
+			rules->push_back({ match, rule.queue });
+		}
+		sort_rules(*rules);
+		if (!any_sw)
+			rules = nullptr;
+		vm.sw_rules.store(rules, std::memory_order_release);
+	}
+};
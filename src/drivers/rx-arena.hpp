@@ -0,0 +1,84 @@
+#pragma once
+
+#include "util.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * One contiguous memory region from which a driver carves its packet buffers.
+ *
+ * The region is backed by hugepages if the system has some reserved
+ * (MAP_HUGETLB) and by transparent hugepages otherwise. If numa_node is given,
+ * its pages are preferably placed on that node, which should be the node of
+ * the thread touching the buffers. All pages are faulted in up front, so the
+ * datapath never takes page faults, and backends can register the region for
+ * DMA once (e.g. io_uring fixed buffers, AF_XDP UMEM).
+ */
+class RxArena {
+public:
+  static constexpr size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+  static constexpr size_t CACHE_LINE = 64;
+
+  static size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+  }
+
+  RxArena(size_t size, int numa_node = -1) {
+    this->len = align_up(size, HUGEPAGE_SIZE);
+    void *area = mmap(NULL, this->len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    this->hugetlb = area != MAP_FAILED;
+    if (!this->hugetlb) {
+      area = mmap(NULL, this->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (area == MAP_FAILED)
+        die("RxArena: cannot allocate %zu bytes", this->len);
+      madvise(area, this->len, MADV_HUGEPAGE); // best effort
+    }
+    this->area = (char *)area;
+
+    // raw syscall: no need to depend on libnuma for a single call
+    if (numa_node >= 0 && numa_node < 64) {
+      unsigned long nodemask = 1UL << numa_node;
+      if (syscall(SYS_mbind, this->area, this->len, MPOL_PREFERRED, &nodemask, 64, 0) != 0)
+        printf("WARN: RxArena: cannot bind buffers to NUMA node %d: %s\n", numa_node, strerror(errno));
+    }
+
+    // fault in all pages now (according to the policy above)
+    memset(this->area, 0, this->len);
+
+    if_log_level(LOG_INFO, printf("RxArena: %zu KiB on node %d (%s)\n", this->len / 1024, numa_node,
+                                  this->hugetlb ? "hugetlb" : "thp"));
+  }
+
+  RxArena(const RxArena &) = delete;
+  RxArena &operator=(const RxArena &) = delete;
+
+  ~RxArena() {
+    munmap(this->area, this->len);
+  }
+
+  /// Carve size bytes from the arena. Buffers are at least cache line aligned,
+  /// so that buffers of different queues never share a cache line.
+  char *alloc(size_t size, size_t align = CACHE_LINE) {
+    size_t offset = align_up(this->used, align);
+    if (offset + size > this->len)
+      die("RxArena: out of memory (%zu + %zu > %zu)", offset, size, this->len);
+    this->used = offset + size;
+    return this->area + offset;
+  }
+
+  char *base() { return this->area; }
+  size_t size() { return this->len; }
+
+private:
+  char *area;
+  size_t len;
+  size_t used = 0;
+  bool hugetlb;
+};
@@ -0,0 +1,331 @@
+#pragma once
+
+#include "src/drivers/tap.hpp"
+#include "util.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <vector>
+
+/**
+ * Tap backend using io_uring instead of one read()/write() syscall per packet.
+ *
+ * RX keeps RX_SLOTS reads of registered buffers per queue in flight. Completions are
+ * signalled on an eventfd, which is the fd that the device epolls on. recv()
+ * reaps all completions at once and recv_consumed() resubmits the reads with
+ * a single syscall.
+ *
+ * TX copies packets into registered buffers (the model reuses its packet
+ * buffer once send returns) and stages them as linked writes, so the tap sees
+ * them in order. tx_flush() submits the whole batch with one syscall.
+ *
+ * RX and TX are called from different threads, so each has its own ring.
+ *
+ * send_tso() is Tap's: it flushes the staged writes, waits for all writes in
+ * flight to complete (io_uring may punt them to a worker, e.g. when the tap
+ * queue is full) and then writes the TSO frame directly.
+ */
+class UringTap : public Tap {
+private:
+  static constexpr unsigned RX_SLOTS = 64; // per queue
+  static constexpr unsigned TX_SLOTS = 64;
+  static constexpr unsigned TX_BURST = 32;
+  static constexpr uint64_t TX_FLUSH_TIMEOUT_NS = 50000; // max time a packet may be staged for tx
+  // tx buffers hold the largest packet and its vnet header
+  static constexpr size_t TX_SLOT_SIZE = (Tap::VNET_HDR_LEN + Tap::MAX_BUF + 4095) & ~4095;
+
+  unsigned nb_rx_slots; // slot s reads from queue s / RX_SLOTS
+  size_t rx_slot_size; // large enough for the largest frame and its vnet_hdr
+  size_t hdr_len; // length of the vnet header before every packet (or 0)
+  char *buf_area = nullptr; // nb_rx_slots rx buffers, followed by TX_SLOTS tx buffers
+
+  struct io_uring rx_ring;
+  std::vector<unsigned> rx_done; // slots handed out by recv()
+  std::vector<unsigned> rx_retry; // slots whose read failed
+
+  struct io_uring tx_ring;
+  std::vector<unsigned> tx_free;
+  struct io_uring_sqe *tx_last = nullptr; // last staged write
+  std::atomic<uint16_t> tx_nb_staged = 0;
+  uint64_t tx_first_ns = 0; // when the oldest staged packet was staged
+  std::atomic<uint64_t> sent = 0; // written by tx_reap() only
+  std::atomic<uint64_t> dropped = 0;
+  std::atomic<uint64_t> rx_eagain = 0; // reads that completed without data
+
+  char *rx_buf(unsigned slot) {
+    return this->buf_area + (size_t)slot * this->rx_slot_size;
+  }
+
+  char *tx_buf(unsigned slot) {
+    return this->buf_area + this->nb_rx_slots * this->rx_slot_size + (size_t)slot * TX_SLOT_SIZE;
+  }
+
+  size_t buf_area_size() {
+    return this->nb_rx_slots * this->rx_slot_size + TX_SLOTS * TX_SLOT_SIZE;
+  }
+
+  static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  void setup_ring(struct io_uring *ring, unsigned entries, char *bufs, unsigned nb_bufs, size_t buf_size) {
+    int ret = io_uring_queue_init(entries, ring, 0);
+    if (ret) {
+      errno = -ret;
+      die("UringTap: cannot create io_uring");
+    }
+    // fixed file i is queue i
+    ret = io_uring_register_files(ring, this->queue_fds.data(), this->queue_fds.size());
+    if (ret) {
+      errno = -ret;
+      die("UringTap: cannot register tap fds");
+    }
+    std::vector<struct iovec> iovecs(nb_bufs);
+    for (unsigned i = 0; i < nb_bufs; i++) {
+      iovecs[i].iov_base = bufs + (size_t)i * buf_size;
+      iovecs[i].iov_len = buf_size;
+    }
+    ret = io_uring_register_buffers(ring, iovecs.data(), nb_bufs);
+    if (ret) {
+      errno = -ret;
+      die("UringTap: cannot register buffers (RLIMIT_MEMLOCK too low?)");
+    }
+  }
+
+  // queue a read into slot. Submitted by the next io_uring_submit().
+  void rx_prep(unsigned slot) {
+    // the ring has room for all slots, so this can't fail
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&this->rx_ring);
+    io_uring_prep_read_fixed(sqe, slot / RX_SLOTS, this->rx_buf(slot), this->rx_slot_size, 0, slot);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data64(sqe, slot);
+  }
+
+  // wait for at least one write to complete, then reap
+  void tx_wait() {
+    struct io_uring_cqe *cqe;
+    int ret = io_uring_wait_cqe(&this->tx_ring, &cqe);
+    if (ret < 0 && ret != -EINTR) {
+      errno = -ret;
+      die("UringTap: cannot wait for tx completions");
+    }
+    this->tx_reap();
+  }
+
+  // return the buffers of completed writes to tx_free
+  void tx_reap() {
+    struct io_uring_cqe *cqes[TX_SLOTS];
+    unsigned n = io_uring_peek_batch_cqe(&this->tx_ring, cqes, TX_SLOTS);
+    for (unsigned i = 0; i < n; i++) {
+      if (cqes[i]->res < 0) {
+        // -ECANCELED for the writes linked after a failed one
+        if_log_level(LOG_DEBUG, printf("UringTap: write failed: %s\n", strerror(-cqes[i]->res)));
+        this->dropped.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        Driver::count(this->sent, 1);
+      }
+      this->tx_free.push_back(io_uring_cqe_get_data64(cqes[i]));
+    }
+    io_uring_cq_advance(&this->tx_ring, n);
+  }
+
+public:
+  UringTap(unsigned nb_queues = 1, bool vnet_hdr = false, int numa_node = -1) : Tap(nb_queues, vnet_hdr, numa_node), nb_rx_slots(nb_queues * RX_SLOTS) {
+    this->hdr_len = vnet_hdr ? Tap::VNET_HDR_LEN : 0;
+    this->rx_slot_size = (this->hdr_len + this->max_frame() + 4095) & ~4095;
+    // rx buffers live in the registered buffer area instead
+    this->free_rx_bufs();
+    this->alloc_rx_lists(nb_queues, RX_SLOTS, nb_queues, 0);
+  }
+
+  virtual ~UringTap() {
+    // Tap closes the tap fds and this->fd, our eventfd
+    // Tap frees the buffer area (rx_arena)
+    if (this->buf_area) {
+      io_uring_queue_exit(&this->rx_ring);
+      io_uring_queue_exit(&this->tx_ring);
+    }
+  }
+
+  virtual int open_tap(const char *dev) {
+    int err = Tap::open_tap(dev);
+    if (err)
+      return err;
+    // Reads stay in flight until a packet arrives. On O_NONBLOCK files they
+    // would complete with -EAGAIN right away and we would spin resubmitting.
+    for (int queue_fd : this->queue_fds)
+      fcntl(queue_fd, F_SETFL, fcntl(queue_fd, F_GETFL) & ~O_NONBLOCK);
+
+    // registered as fixed buffers with both rings below
+    this->rx_arena = std::make_unique<RxArena>(this->buf_area_size(), this->numa_node);
+    this->buf_area = this->rx_arena->alloc(this->buf_area_size(), 4096);
+
+    this->setup_ring(&this->rx_ring, this->nb_rx_slots, this->rx_buf(0), this->nb_rx_slots, this->rx_slot_size);
+    this->setup_ring(&this->tx_ring, TX_SLOTS, this->tx_buf(0), TX_SLOTS, TX_SLOT_SIZE);
+
+    // devices epoll on this->fd: make it signal rx completions instead
+    if (this->fd != this->queue_fds[0])
+      close(this->fd); // Tap's epoll fd over all queues
+    this->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->fd < 0)
+      die("UringTap: cannot create eventfd");
+    int ret = io_uring_register_eventfd(&this->rx_ring, this->fd);
+    if (ret) {
+      errno = -ret;
+      die("UringTap: cannot register eventfd");
+    }
+
+    for (unsigned slot = 0; slot < this->nb_rx_slots; slot++)
+      this->rx_prep(slot);
+    io_uring_submit(&this->rx_ring);
+
+    for (unsigned slot = 0; slot < TX_SLOTS; slot++)
+      this->tx_free.push_back(slot);
+    return 0;
+  }
+
+  virtual void send(int vm_id, const char *buf, const size_t len) {
+    this->send_stage(vm_id, buf, len);
+    this->tx_flush(vm_id);
+  }
+
+  virtual void send_stage(int vm_id, const char *buf, const size_t len) {
+    if (len > Tap::MAX_BUF)
+      die("Attempting to send a packet too large for vmux (%zu)", len);
+
+    this->tx_reap();
+    while (this->tx_free.empty()) {
+      // all buffers are staged or in flight: wait for the oldest write
+      this->tx_flush(vm_id);
+      this->tx_wait();
+    }
+    unsigned slot = this->tx_free.back();
+    this->tx_free.pop_back();
+    memset(this->tx_buf(slot), 0, this->hdr_len); // no offloads
+    memcpy(this->tx_buf(slot) + this->hdr_len, buf, len);
+
+    // the ring has room for all slots, so this can't fail
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&this->tx_ring);
+    io_uring_prep_write_fixed(sqe, 0, this->tx_buf(slot), this->hdr_len + len, 0, slot);
+    sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    io_uring_sqe_set_data64(sqe, slot);
+    this->tx_last = sqe;
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+
+    uint16_t nb_staged = this->tx_nb_staged.load(std::memory_order_relaxed);
+    if (nb_staged == 0)
+      this->tx_first_ns = UringTap::now_ns();
+    this->tx_nb_staged.store(nb_staged + 1, std::memory_order_relaxed);
+
+    if (nb_staged + 1 == TX_BURST)
+      this->tx_flush(vm_id);
+  }
+
+  virtual void tx_flush(int vm_id, bool only_expired = false) {
+    if (this->tx_nb_staged.load(std::memory_order_relaxed) == 0)
+      return;
+    if (only_expired && UringTap::now_ns() - this->tx_first_ns < TX_FLUSH_TIMEOUT_NS)
+      return;
+
+    // the chain ends with the last staged write
+    this->tx_last->flags &= ~IOSQE_IO_LINK;
+    io_uring_submit(&this->tx_ring);
+    this->tx_nb_staged.store(0, std::memory_order_relaxed);
+  }
+
+  virtual void tx_flush_wait(int vm_id) {
+    this->tx_flush(vm_id);
+    while (this->tx_free.size() < TX_SLOTS)
+      this->tx_wait();
+  }
+
+  virtual size_t tx_staged(int vm_id) {
+    return this->tx_nb_staged.load(std::memory_order_relaxed);
+  }
+
+  virtual uint64_t tx_sent(int vm_id) {
+    return this->sent.load(std::memory_order_relaxed);
+  }
+
+  virtual uint64_t tx_dropped(int vm_id) {
+    return this->dropped.load(std::memory_order_relaxed);
+  }
+
+  virtual void print_stats(const char *name, int vm_id) {
+    printf("%s: %lu tx sent, %lu tx dropped, %lu rx EAGAIN (total)\n", name,
+           this->tx_sent(vm_id), this->tx_dropped(vm_id),
+           this->rx_eagain.load(std::memory_order_relaxed));
+  }
+
+  // hand out all completed reads
+  virtual void recv(int _vm_number) {
+    uint64_t count;
+    if (read(this->fd, &count, sizeof(count)) < 0) {
+      // not signalled (e.g. polled): there may be completions anyway
+    }
+
+    for (auto &rxq : this->rxQueues)
+      rxq.nb_bufs_used = 0;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned n = 0;
+    io_uring_for_each_cqe(&this->rx_ring, head, cqe) {
+      n++;
+      unsigned slot = io_uring_cqe_get_data64(cqe);
+      unsigned q = slot / RX_SLOTS;
+      int res = cqe->res;
+      if (res <= (int)this->hdr_len) {
+        if (res == -EAGAIN)
+          Driver::count(this->rx_eagain, 1);
+        else if (res != -EINTR)
+          if_log_level(LOG_DEBUG, printf("UringTap: read failed: %s\n", strerror(-res)));
+        this->rx_retry.push_back(slot);
+        continue;
+      }
+      VnetHdr hdr = {};
+      if (this->vnet_hdr)
+        memcpy(&hdr, this->rx_buf(slot), sizeof(hdr));
+      // GSO frames only come with TUN_F_TSO*, which we don't enable
+      if (hdr.gso_type != VnetHdr::GSO_NONE) {
+        this->rx_retry.push_back(slot);
+        continue;
+      }
+      // at most RX_SLOTS reads per queue are in flight, so this fits
+      auto &rxq = this->rxQueues[q];
+      auto &rxBuf = rxq.rxBufs[rxq.nb_bufs_used++];
+      rxBuf.data = this->rx_buf(slot) + this->hdr_len;
+      rxBuf.used = res - this->hdr_len;
+      rxBuf.meta = {};
+      if (this->vnet_hdr)
+        Tap::vnet_rx_complete(hdr, rxBuf.data, rxBuf.used, rxBuf.meta);
+      rxBuf.queue = this->queue_hint(q);
+      this->rx_done.push_back(slot);
+      if (LOG_LEVEL >= LOG_DEBUG) {
+        printf("recv %zu bytes (queue %u)\n", rxBuf.used, q);
+        Util::dump_pkt(rxBuf.data, rxBuf.used);
+      }
+    }
+    io_uring_cq_advance(&this->rx_ring, n);
+  }
+
+  virtual void recv_consumed(int _vm_number) {
+    for (auto &rxq : this->rxQueues)
+      rxq.nb_bufs_used = 0;
+    if (this->rx_done.empty() && this->rx_retry.empty())
+      return;
+    for (unsigned slot : this->rx_done)
+      this->rx_prep(slot);
+    for (unsigned slot : this->rx_retry)
+      this->rx_prep(slot);
+    this->rx_done.clear();
+    this->rx_retry.clear();
+    io_uring_submit(&this->rx_ring);
+  }
+};
@@ -4,93 +4,393 @@
 #include <cstring>
 #include <fcntl.h>
 #include <linux/if.h>
+#include <linux/if_ether.h>
 #include <linux/if_tun.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <vector>
 #include "src/drivers/driver.hpp"
 
+// struct virtio_net_hdr. linux/virtio_net.h can't be included from C++.
+struct VnetHdr {
+  static constexpr uint8_t F_NEEDS_CSUM = 1;
+  static constexpr uint8_t F_DATA_VALID = 2;
+  static constexpr uint8_t GSO_NONE = 0;
+  static constexpr uint8_t GSO_TCPV4 = 1;
+  static constexpr uint8_t GSO_TCPV6 = 4;
+
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len; // ethernet + IP + TCP headers
+  uint16_t gso_size; // payload per segment
+  uint16_t csum_start;
+  uint16_t csum_offset; // from csum_start
+};
+
+/**
+ * Linux tap backend for a single VM.
+ *
+ * With more than one queue, the tap is opened with IFF_MULTI_QUEUE and one fd
+ * per emulated queue pair. Packets read from the fd of queue q are delivered
+ * to the guest's queue q. The kernel spreads host flows over the fds. this->fd
+ * is then an epoll fd that becomes readable when any queue has packets.
+ *
+ * With vnet_hdr, every packet is prefixed with a struct virtio_net_hdr
+ * (IFF_VNET_HDR). This lets send_tso() hand whole TSO packets to the kernel,
+ * which segments and checksums them lazily. In the other direction, the
+ * kernel passes packets with partial checksums (TUNSETOFFLOAD) and recv()
+ * completes the checksum. No emulated device does LRO, so the kernel
+ * segments TCP super-frames before they reach us.
+ */
 class Tap : public Driver {
-  char txFrame[MAX_BUF];
 public:
+  // max packets read per queue and recv() call
+  static constexpr size_t RX_BURST = 32;
+  // largest frame with vnet_hdr: an IP packet of 64K and its ethernet header
+  static constexpr size_t MAX_GSO_FRAME = 65536 + ETH_HLEN;
+  static constexpr size_t VNET_HDR_LEN = sizeof(VnetHdr);
 
   char ifName[IFNAMSIZ];
+  unsigned nb_queues;
+  bool vnet_hdr;
+  std::vector<int> queue_fds;
 
-  Tap() {
-    this->alloc_rx_lists(1, 1, 1, 0);
-    this->alloc_rx_bufs();
+  // numa_node: node of the thread polling this tap
+  Tap(unsigned nb_queues = 1, bool vnet_hdr = false, int numa_node = -1) : nb_queues(nb_queues), vnet_hdr(vnet_hdr) {
+    this->numa_node = numa_node;
+    this->alloc_rx_lists(nb_queues, RX_BURST, nb_queues, 0);
+    this->alloc_rx_bufs(this->max_frame());
+    if (vnet_hdr) {
+      this->tso_buf = (char *)malloc(MAX_GSO_FRAME);
+      if (!this->tso_buf)
+        die("Cannot allocate TSO buffer");
+    }
   }
 
   virtual ~Tap() {
+    for (int queue_fd : this->queue_fds)
+      close(queue_fd);
     // does nothing if uninitialized (== 0)
-    if (this->fd != 0) {
+    if (this->fd != 0 && (this->queue_fds.empty() || this->fd != this->queue_fds[0])) {
       close(this->fd);
     }
 
     this->free_rx_bufs();
+    free(this->tso_buf);
   }
 
-  int open_tap(const char *dev) {
+  virtual int open_tap(const char *dev) {
     struct ifreq ifr;
     int fd, err;
 
-    if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
-      die("Cannot open /dev/net/tun");
-
     memset(&ifr, 0, sizeof(ifr));
 
     /* Flags: IFF_TUN   - TUN device (no Ethernet headers)
      *        IFF_TAP   - TAP device
      *
      *        IFF_NO_PI - Do not provide packet information
+     *        IFF_MULTI_QUEUE - Every open() + TUNSETIFF adds a queue
+     *        IFF_VNET_HDR - Prefix packets with a struct virtio_net_hdr
      */
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (this->nb_queues > 1)
+      ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    if (this->vnet_hdr)
+      ifr.ifr_flags |= IFF_VNET_HDR;
     if (*dev)
-      strncpy(ifr.ifr_name, dev, IFNAMSIZ);
+      strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
 
-    if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
-      close(fd);
-      return err;
+    for (unsigned q = 0; q < this->nb_queues; q++) {
+      if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
+        die("Cannot open /dev/net/tun");
+      // the name the kernel picked for the first queue is used by the others
+      if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
+        close(fd);
+        return err;
+      }
+      // recv() reads until the tap is drained
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      this->queue_fds.push_back(fd);
     }
     strcpy(this->ifName, ifr.ifr_name);
-    this->fd = fd;
+
+    if (this->vnet_hdr) {
+      // let the kernel pass us packets with partial checksums. No TSO4/TSO6:
+      // the guest programmed a max frame size and expects no larger frames.
+      unsigned offloads = TUN_F_CSUM;
+      if (ioctl(this->queue_fds[0], TUNSETOFFLOAD, offloads) < 0)
+        warn("Tap: cannot enable offloads on %s", this->ifName);
+    }
+
+    if (this->nb_queues == 1) {
+      this->fd = this->queue_fds[0];
+      return 0;
+    }
+    this->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->fd < 0)
+      die("Tap: cannot create epoll fd");
+    for (int queue_fd : this->queue_fds) {
+      struct epoll_event e = {};
+      e.events = EPOLLIN;
+      e.data.fd = queue_fd;
+      if (epoll_ctl(this->fd, EPOLL_CTL_ADD, queue_fd, &e) != 0)
+        die("Tap: cannot add queue fd to epoll");
+    }
     return 0;
   }
 
-  void send(int vm_id, const char *buf, const size_t len) {
+  // send() has no queue: packets always go through the first queue
+  virtual void send(int vm_id, const char *buf, const size_t len) {
     if (len > Tap::MAX_BUF)
       die("Attempting to send a packet too large for vmux (%zu)", len);
-    memcpy(&(this->txFrame), (void *)buf, len);
-    size_t n = write(this->fd, &(this->txFrame), len);
-    if (n != len) {
-      die("Could not send full packet (sent %zu of %zu b). Is the tap "
-          "interface down?",
-          n, len);
+    VnetHdr hdr = {}; // no offloads
+    this->write_frame(this->vnet_hdr ? &hdr : nullptr, buf, len);
+  }
+
+  virtual bool send_tso(int vm_id, const char *buf, const size_t len,
+                        const bool end_of_packet, uint64_t l2_len,
+                        uint64_t l3_len, uint64_t l4_len, uint64_t tso_segsz) {
+    if (!this->vnet_hdr)
+      return false;
+
+    // collect the packet
+    if (this->tso_len + len > MAX_GSO_FRAME) {
+      printf("WARN: Tap::send_tso: packet too large\n");
+      this->tso_len = 0;
+      return false;
     }
+    memcpy(this->tso_buf + this->tso_len, buf, len);
+    this->tso_len += len;
+    if (!end_of_packet)
+      return true;
+
+    size_t frame_len = this->tso_len;
+    this->tso_len = 0;
+    VnetHdr hdr;
+    if (!Tap::tso_prepare(this->tso_buf, frame_len, l2_len, l3_len, l4_len, tso_segsz, hdr))
+      return false;
+
+    // keep packet order: staged packets go first
+    this->tx_flush_wait(vm_id);
+    this->write_frame(&hdr, this->tso_buf, frame_len);
+    return true;
   }
 
-  void recv(int _vm_number) {
-    auto &rxBuf = this->rxQueues[0].rxBufs[0];
-    size_t n = read(this->fd, rxBuf.data, Tap::MAX_BUF);
-    rxBuf.used = n;
-    this->rxQueues[0].nb_bufs_used = 1;
-    if (LOG_LEVEL >= LOG_DEBUG) {
-      printf("recv %zu bytes\n", n);
-      Util::dump_pkt(rxBuf.data, rxBuf.used);
+  // read all pending packets, up to RX_BURST per queue
+  virtual void recv(int _vm_number) {
+    for (unsigned q = 0; q < this->nb_queues; q++) {
+      auto &rxq = this->rxQueues[q];
+      rxq.nb_bufs_used = 0;
+      while (rxq.nb_bufs_used < rxq.rxBufs.size()) {
+        auto &rxBuf = rxq.rxBufs[rxq.nb_bufs_used];
+        VnetHdr hdr;
+        struct iovec iov[2] = {
+          { .iov_base = &hdr, .iov_len = VNET_HDR_LEN },
+          { .iov_base = rxBuf.data, .iov_len = this->max_frame() },
+        };
+        ssize_t n = this->vnet_hdr ? readv(this->queue_fds[q], iov, 2)
+                                   : readv(this->queue_fds[q], &iov[1], 1);
+        if (n < 0) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            break;
+          die("could not read from tap");
+        }
+        if (this->vnet_hdr) {
+          // GSO frames only come with TUN_F_TSO*, which we don't enable
+          if ((size_t)n < VNET_HDR_LEN || hdr.gso_type != VnetHdr::GSO_NONE)
+            continue;
+          n -= VNET_HDR_LEN;
+        }
+        rxBuf.meta = {};
+        if (this->vnet_hdr)
+          Tap::vnet_rx_complete(hdr, rxBuf.data, n, rxBuf.meta);
+        rxBuf.used = n;
+        rxBuf.queue = this->queue_hint(q);
+        rxq.nb_bufs_used++;
+        if (LOG_LEVEL >= LOG_DEBUG) {
+          printf("recv %zd bytes (queue %u)\n", n, q);
+          Util::dump_pkt(rxBuf.data, rxBuf.used);
+        }
+      }
     }
-    if (n < 0)
-      die("could not read from tap");
   }
 
   virtual void recv_consumed(int _vm_number) {
-    this->rxQueues[0].nb_bufs_used = 1;
+    for (auto &rxq : this->rxQueues)
+      rxq.nb_bufs_used = 0;
   }
 
   void dumpRx() {
-    auto &rxBuf = this->rxQueues[0].rxBufs[0];
     while (true) {
       this->recv(0);
-      Util::dump_pkt(rxBuf.data, rxBuf.used);
+      for (auto &rxq : this->rxQueues) {
+        for (size_t i = 0; i < rxq.nb_bufs_used; i++)
+          Util::dump_pkt(rxq.rxBufs[i].data, rxq.rxBufs[i].used);
+      }
       this->recv_consumed(0);
     }
   }
+
+protected:
+  char *tso_buf = nullptr; // send_tso() collects packets here
+  size_t tso_len = 0;
+
+  // Submit the staged packets and return once the tap has them all, so that
+  // a direct write_frame() goes after them. Our writes are synchronous.
+  virtual void tx_flush_wait(int vm_id) {
+    this->tx_flush(vm_id);
+  }
+
+  // largest frame that recv() may return
+  size_t max_frame() {
+    return Driver::MAX_BUF;
+  }
+
+  // with a single queue, the device's switch/RSS emulation picks the queue
+  std::optional<uint16_t> queue_hint(unsigned q) {
+    if (this->nb_queues == 1)
+      return {};
+    return q;
+  }
+
+  // hdr must be set iff vnet_hdr is enabled
+  void write_frame(const VnetHdr *hdr, const char *buf, size_t len) {
+    struct iovec iov[2] = {
+      { .iov_base = (void *)hdr, .iov_len = VNET_HDR_LEN },
+      { .iov_base = (void *)buf, .iov_len = len },
+    };
+    ssize_t n = hdr ? writev(this->queue_fds[0], iov, 2)
+                    : writev(this->queue_fds[0], &iov[1], 1);
+    size_t expected = hdr ? len + VNET_HDR_LEN : len;
+    if (n < 0 || (size_t)n != expected) {
+      die("Could not send full packet (sent %zd of %zu b). Is the tap "
+          "interface down?",
+          n, expected);
+    }
+  }
+
+  // one's complement sum of 16 bit words in network byte order, not folded
+  static uint64_t csum_partial(const void *data, size_t len, uint64_t sum = 0) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (; len >= 4; p += 4, len -= 4) {
+      uint32_t w;
+      memcpy(&w, p, 4);
+      sum += w;
+    }
+    if (len >= 2) {
+      uint16_t w;
+      memcpy(&w, p, 2);
+      sum += w;
+      p += 2;
+      len -= 2;
+    }
+    if (len) {
+      uint16_t w = 0;
+      memcpy(&w, p, 1);
+      sum += w;
+    }
+    return sum;
+  }
+
+  static uint16_t csum_fold(uint64_t sum) {
+    while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+  }
+
+  // Fill in checksums the kernel left to us. Packets with valid checksums are
+  // reported as such in meta, so the guest doesn't have to verify them again.
+  static void vnet_rx_complete(const VnetHdr &hdr, char *data, size_t len, RxMeta &meta) {
+    if (hdr.flags & VnetHdr::F_NEEDS_CSUM) {
+      size_t start = hdr.csum_start;
+      size_t off = start + hdr.csum_offset;
+      if (off + 2 > len)
+        return;
+      // the checksum field holds the pseudo header sum already
+      uint16_t csum = ~Tap::csum_fold(Tap::csum_partial(data + start, len - start));
+      memcpy(data + off, &csum, 2);
+    } else if (!(hdr.flags & VnetHdr::F_DATA_VALID)) {
+      return;
+    }
+
+    // the kernel vouches for the checksums of the (untunneled) TCP/UDP packet
+    if (len < ETH_HLEN + 40)
+      return;
+    uint16_t ethertype = ntohs(*(uint16_t *)(data + 12));
+    const uint8_t *ip = (const uint8_t *)data + ETH_HLEN;
+    uint8_t proto;
+    if (ethertype == ETH_P_IP && (ip[0] >> 4) == 4) {
+      meta.l3_type = RxMeta::L3::IPV4;
+      meta.flags |= RxMeta::L3_CSUM_GOOD;
+      proto = ip[9];
+    } else if (ethertype == ETH_P_IPV6 && (ip[0] >> 4) == 6) {
+      meta.l3_type = RxMeta::L3::IPV6;
+      proto = ip[6];
+    } else {
+      return;
+    }
+    if (proto == IPPROTO_TCP)
+      meta.l4_type = RxMeta::L4::TCP;
+    else if (proto == IPPROTO_UDP)
+      meta.l4_type = RxMeta::L4::UDP;
+    else
+      return;
+    meta.flags |= RxMeta::L4_CSUM_GOOD;
+  }
+
+  /**
+   * Turn the TSO packet collected in buf into a GSO super-frame: fix the IP
+   * length fields the guest left for the NIC to fill in and describe the
+   * segmentation in hdr. Returns false if the packet can't be offloaded.
+   */
+  static bool tso_prepare(char *buf, size_t len, size_t l2_len, size_t l3_len,
+                          size_t l4_len, size_t tso_segsz, VnetHdr &hdr) {
+    size_t hdr_len = l2_len + l3_len + l4_len;
+    if (hdr_len > len || l3_len < 20 || l4_len < 20) {
+      printf("WARN: Tap::send_tso: bad header lengths\n");
+      return false;
+    }
+    char *ip = buf + l2_len;
+    uint16_t l4_total = htons(len - l2_len - l3_len);
+    uint64_t pseudo;
+    uint8_t version = (uint8_t)ip[0] >> 4;
+    if (version == 4) {
+      uint16_t tot_len = htons(len - l2_len);
+      memcpy(ip + 2, &tot_len, 2);
+      memset(ip + 10, 0, 2);
+      uint16_t ip_csum = ~Tap::csum_fold(Tap::csum_partial(ip, l3_len));
+      memcpy(ip + 10, &ip_csum, 2);
+      uint16_t proto = htons(IPPROTO_TCP);
+      pseudo = Tap::csum_partial(ip + 12, 8); // src, dst
+      pseudo = Tap::csum_partial(&proto, 2, pseudo);
+      pseudo = Tap::csum_partial(&l4_total, 2, pseudo);
+      hdr.gso_type = VnetHdr::GSO_TCPV4;
+    } else if (version == 6 && l3_len >= 40) {
+      uint16_t payload_len = htons(len - l2_len - 40);
+      memcpy(ip + 4, &payload_len, 2);
+      uint16_t proto = htons(IPPROTO_TCP);
+      pseudo = Tap::csum_partial(ip + 8, 32); // src, dst
+      pseudo = Tap::csum_partial(&proto, 2, pseudo);
+      pseudo = Tap::csum_partial(&l4_total, 2, pseudo);
+      hdr.gso_type = VnetHdr::GSO_TCPV6;
+    } else {
+      printf("WARN: Tap::send_tso: not an IP packet\n");
+      return false;
+    }
+
+    // partial checksum: the kernel expects the (not inverted) pseudo header sum
+    uint16_t tcp_csum = Tap::csum_fold(pseudo);
+    memcpy(buf + l2_len + l3_len + 16, &tcp_csum, 2);
+
+    if (len - hdr_len <= tso_segsz)
+      hdr.gso_type = VnetHdr::GSO_NONE; // fits a single segment
+    hdr.flags = VnetHdr::F_NEEDS_CSUM;
+    hdr.hdr_len = hdr_len;
+    hdr.gso_size = tso_segsz;
+    hdr.csum_start = l2_len + l3_len;
+    hdr.csum_offset = 16; // offsetof(struct tcphdr, check)
+    return true;
+  }
 };
@@ -0,0 +1,313 @@
+#pragma once
+/*
+ * Runs the e810 behavioral model in-process, without qemu, a guest or a NIC.
+ *
+ * Guest memory is anonymous memory registered with a VfioUserServer as if the
+ * guest had mapped it, and E810Guest plays the guest driver by setting up the
+ * rings through RegWrite and the admin queue. Packets sent by the model go to
+ * a driver that only counts them.
+ *
+ * Used by bench-e810 and test-e810.
+ */
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "drivers/driver.hpp"
+#include "interrupts/global.hpp"
+#include "interrupts/simbricks.hpp"
+#include "libsimbricks/simbricks/nicbm/nicbm.h"
+#include "policies/policies.hpp"
+#include "sims/nic/e810_bm/base/ice_hw_autogen.h"
+#include "sims/nic/e810_bm/e810_base_wrapper.h"
+#include "sims/nic/e810_bm/e810_bm.h"
+#include "sims/nic/e810_bm/headers.h"
+#include "src/devices/vmux-device.hpp"
+#include "util.hpp"
+#include "vfio-server.hpp"
+
+namespace e810_guest {
+
+static const unsigned BAR_REGS = 0;
+static const size_t NUM_MSIX_IRQS = 16;
+
+// guest memory layout (offsets into guest memory)
+static const uintptr_t GUEST_IOVA = 0x100000000;
+static const size_t GUEST_MEM_SIZE = 16 * 1024 * 1024;
+static const uintptr_t ATQ_RING = 0x0;
+static const uintptr_t ATQ_BUF = 0x1000;
+static const uintptr_t TX_RING = 0x10000;
+static const uintptr_t RX_RINGS = 0x20000; // one per rx queue
+static const uintptr_t TX_BUFS = 0x100000;
+static const uintptr_t RX_BUFS = 0x900000; // RING_LEN per rx queue
+
+static const uint32_t ATQ_LEN = 32;
+static const uint32_t RING_LEN = 1024;
+static const uint32_t BUF_SIZE = 2048;
+static const uint16_t MAX_RX_QUEUES = 2;
+
+// sinks all packets sent by the model
+class SinkDriver : public Driver {
+public:
+  uint64_t sent = 0;
+  uint64_t sent_bytes = 0;
+
+  void send(int vm_id, const char *buf, const size_t len) {
+    this->sent++;
+    this->sent_bytes += len;
+  }
+  void recv(int vm_id) {}
+  void recv_consumed(int vm_id) {}
+};
+
+class GuestDevice : public VmuxDevice {
+public:
+  GuestDevice(std::shared_ptr<Driver> driver) : VmuxDevice(0, driver, std::make_shared<GlobalPolicies>()) {}
+
+  void setup_vfu(std::shared_ptr<VfioUserServer> vfu) {
+    this->vfuServer = vfu;
+  }
+};
+
+/* Plays the guest driver: owns guest memory and programs the model through
+ * its registers, the way the ice driver would. */
+class E810Guest {
+public:
+  std::shared_ptr<e810::e810_bm> model;
+  uint8_t *mem;
+  uint32_t atq_tail = 0;
+
+  E810Guest(std::shared_ptr<e810::e810_bm> model, uint8_t *mem) : model(model), mem(mem) {}
+
+  template <typename T> T *at(uintptr_t off) {
+    return reinterpret_cast<T *>(this->mem + off);
+  }
+
+  void reg_write(uint64_t addr, uint32_t val) {
+    this->model->RegWrite(BAR_REGS, addr, &val, sizeof(val));
+  }
+
+  uint32_t reg_read(uint64_t addr) {
+    uint32_t val;
+    this->model->RegRead(BAR_REGS, addr, &val, sizeof(val));
+    return val;
+  }
+
+  // set a field of a packed queue context
+  static void ctx_set(uint8_t *ctx, unsigned lsb, unsigned width, uint64_t val) {
+    for (unsigned i = 0; i < width; i++) {
+      unsigned bit = lsb + i;
+      if (val & (1ULL << i))
+        ctx[bit / 8] |= 1 << (bit % 8);
+      else
+        ctx[bit / 8] &= ~(1 << (bit % 8));
+    }
+  }
+
+  void adminq_init() {
+    memset(this->at<uint8_t>(ATQ_RING), 0, ATQ_LEN * sizeof(struct ice_aq_desc));
+    this->reg_write(PF_FW_ATQBAL, (GUEST_IOVA + ATQ_RING) & 0xffffffff);
+    this->reg_write(PF_FW_ATQBAH, (GUEST_IOVA + ATQ_RING) >> 32);
+    this->reg_write(PF_FW_ATQH, 0);
+    this->reg_write(PF_FW_ATQT, 0);
+    this->reg_write(PF_FW_ATQLEN, ATQ_LEN | PF_FW_ATQLEN_ATQENABLE_M);
+  }
+
+  // issue an indirect admin queue command. The model completes it before
+  // RegWrite returns. The response data is at ATQ_BUF. params are the
+  // command specific parameters, if any; the buffer address overrides theirs.
+  struct ice_aq_desc *adminq_submit(uint16_t opcode, const void *buf, uint16_t len,
+                                    const void *params = nullptr) {
+    struct ice_aq_desc *desc = this->at<struct ice_aq_desc>(ATQ_RING) + this->atq_tail;
+    memset(desc, 0, sizeof(*desc));
+    desc->opcode = opcode;
+    desc->flags = ICE_AQ_FLAG_BUF | ICE_AQ_FLAG_RD;
+    desc->datalen = len;
+    if (params)
+      memcpy(desc->params.raw, params, sizeof(desc->params.raw));
+    desc->params.generic.addr_high = (GUEST_IOVA + ATQ_BUF) >> 32;
+    desc->params.generic.addr_low = (GUEST_IOVA + ATQ_BUF) & 0xffffffff;
+    memcpy(this->at<uint8_t>(ATQ_BUF), buf, len);
+
+    this->atq_tail = (this->atq_tail + 1) % ATQ_LEN;
+    this->reg_write(PF_FW_ATQT, this->atq_tail);
+
+    if (!(desc->flags & ICE_AQ_FLAG_DD))
+      die("admin queue command %x not completed (flags %x)", opcode, desc->flags);
+    return desc;
+  }
+
+  void adminq_command(uint16_t opcode, const void *buf, uint16_t len, const void *params = nullptr) {
+    struct ice_aq_desc *desc = this->adminq_submit(opcode, buf, len, params);
+    if (desc->flags & ICE_AQ_FLAG_ERR)
+      die("admin queue command %x failed (flags %x, retval %d)", opcode, desc->flags, desc->retval);
+  }
+
+  void txq_setup(uint16_t txq) {
+    uint8_t buf[sizeof(struct ice_aqc_add_tx_qgrp) + sizeof(struct ice_aqc_add_txqs_perq)] = {};
+    struct ice_aqc_add_tx_qgrp *grp = reinterpret_cast<struct ice_aqc_add_tx_qgrp *>(buf);
+    grp->num_txqs = 1;
+    grp->txqs[0].txq_id = txq;
+
+    // Table 10-29. LAN Tx-Queue Context: base (128B units), qlen
+    uint8_t *ctx = grp->txqs[0].txq_ctx;
+    ctx_set(ctx, 0, 57, (GUEST_IOVA + TX_RING) / 128);
+    ctx_set(ctx, 135, 13, RING_LEN);
+
+    this->adminq_command(ice_aqc_opc_add_txqs, buf, sizeof(buf));
+  }
+
+  static uintptr_t rx_ring(uint16_t rxq) {
+    return RX_RINGS + (uintptr_t)rxq * RING_LEN * sizeof(union ice_32byte_rx_desc);
+  }
+
+  static uintptr_t rx_buf(uint16_t rxq, uint32_t idx) {
+    return RX_BUFS + ((uintptr_t)rxq * RING_LEN + idx) * BUF_SIZE;
+  }
+
+  // rx queues use legacy descriptors unless the guest selects a flex profile
+  void rxq_setup(uint16_t rxq, uint16_t rxmax = Driver::MAX_BUF) {
+    if (rxq >= MAX_RX_QUEUES)
+      die("guest memory only has room for %u rx queues", MAX_RX_QUEUES);
+    // LAN Rx-Queue Context: base (128B units), qlen, data buffer size
+    // (128B units), 32B descriptors, max frame size (bytes)
+    uint32_t packed_ctx[8] = {};
+    uint8_t *ctx = reinterpret_cast<uint8_t *>(packed_ctx);
+    ctx_set(ctx, 32, 57, (GUEST_IOVA + rx_ring(rxq)) / 128);
+    ctx_set(ctx, 89, 13, RING_LEN);
+    ctx_set(ctx, 102, 7, BUF_SIZE / 128);
+    ctx_set(ctx, 116, 1, 1);
+    ctx_set(ctx, 117, 1, 1);
+    ctx_set(ctx, 174, 14, rxmax);
+    for (int i = 0; i < 8; i++)
+      this->reg_write(QRX_CONTEXT(i, rxq), packed_ctx[i]);
+
+    for (uint32_t i = 0; i < RING_LEN; i++)
+      this->rx_refill(rxq, i);
+    this->reg_write(QRX_CTRL(rxq), QRX_CTRL_QENA_REQ_M);
+    // keep one descriptor back, like drivers do to tell a full ring from an
+    // empty one
+    this->reg_write(QRX_TAIL(rxq), RING_LEN - 1);
+  }
+
+  void tx_fill(uint32_t idx, size_t pkt_len) {
+    struct ice_tx_desc *desc = this->at<struct ice_tx_desc>(TX_RING) + idx;
+    desc->buf_addr = GUEST_IOVA + TX_BUFS + idx * BUF_SIZE;
+    desc->cmd_type_offset_bsz = ICE_TX_DESC_DTYPE_DATA |
+        ((uint64_t)(ICE_TX_DESC_CMD_EOP | ICE_TX_DESC_CMD_RS) << ICE_TXD_QW1_CMD_S) |
+        ((uint64_t)pkt_len << ICE_TXD_QW1_TX_BUF_SZ_S);
+  }
+
+  union ice_32byte_rx_desc *rx_desc(uint16_t rxq, uint32_t idx) {
+    return this->at<union ice_32byte_rx_desc>(rx_ring(rxq)) + idx;
+  }
+
+  void rx_refill(uint16_t rxq, uint32_t idx) {
+    union ice_32b_rx_flex_desc *desc = this->at<union ice_32b_rx_flex_desc>(rx_ring(rxq)) + idx;
+    memset(desc, 0, sizeof(*desc));
+    desc->read.pkt_addr = GUEST_IOVA + rx_buf(rxq, idx);
+  }
+
+  bool rx_done(uint16_t rxq, uint32_t idx) {
+    return this->rx_desc(rxq, idx)->wb.qword1.status_error_len & (1 << ICE_RX_FLEX_DESC_STATUS0_DD_S);
+  }
+};
+
+// UDP/IPv4 packet of pkt_len bytes to the model's MAC address. Flows differ
+// in their source port.
+static void build_packet(uint8_t *buf, size_t pkt_len, uint16_t flow) {
+  memset(buf, 0, pkt_len);
+  headers::pkt_udp *pkt = reinterpret_cast<headers::pkt_udp *>(buf);
+  const uint8_t dst_mac[ETH_ADDR_LEN] = { 0x52, 0x54, 0x00, 0x00, 0x00, 0x01 };
+  const uint8_t src_mac[ETH_ADDR_LEN] = { 0x52, 0x54, 0x00, 0x00, 0x00, 0x02 };
+  memcpy(pkt->eth.dest.addr, dst_mac, ETH_ADDR_LEN);
+  memcpy(pkt->eth.src.addr, src_mac, ETH_ADDR_LEN);
+  pkt->eth.type = htons(ETH_TYPE_IP);
+  IPH_VHL_SET(&pkt->ip, 4, 5);
+  pkt->ip.len = htons(pkt_len - sizeof(headers::eth_hdr));
+  pkt->ip.ttl = 64;
+  pkt->ip.proto = IP_PROTO_UDP;
+  pkt->ip.src = htonl(0x0a000001);
+  pkt->ip.dest = htonl(0x0a000002);
+  pkt->udp.src = htons(1024 + flow);
+  pkt->udp.dest = htons(9);
+  pkt->udp.len = htons(pkt_len - sizeof(headers::eth_hdr) - IP_HLEN);
+}
+
+/* The model, its guest and everything the model calls into. */
+class E810Harness {
+public:
+  std::shared_ptr<Driver> driver;
+  std::shared_ptr<VmuxDevice> device;
+  std::shared_ptr<e810::e810_bm> model;
+  std::shared_ptr<VfioUserServer> vfu;
+  std::unique_ptr<E810Guest> guest;
+
+  // device must be a GuestDevice (or derived from one) using driver
+  E810Harness(std::shared_ptr<Driver> driver, std::shared_ptr<GuestDevice> device)
+      : driver(driver), device(device) {
+    this->efd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->efd < 0)
+      die("could not create epoll fd");
+
+    this->model = std::make_shared<e810::e810_bm>();
+
+    // interrupts stay masked by the guest: the throttlers drop them
+    auto irq_glob = std::make_shared<GlobalInterrupts>(1);
+    for (size_t idx = 0; idx < NUM_MSIX_IRQS; idx++) {
+      this->irq_throttle.push_back(std::make_shared<InterruptThrottlerSimbricks>(this->efd, idx, irq_glob));
+    }
+
+    this->sock = "/tmp/e810-guest-" + std::to_string(getpid());
+    this->vfu = std::make_shared<VfioUserServer>(this->sock, this->efd, device);
+    device->setup_vfu(this->vfu);
+
+    // what the map_dma callback would do when the guest maps its memory
+    void *mem = mmap(NULL, GUEST_MEM_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED)
+      die("could not allocate guest memory");
+    this->segment = { .iov_base = mem, .iov_len = GUEST_MEM_SIZE };
+    this->vfu->mappings[(void *)GUEST_IOVA] = &this->segment;
+    this->vfu->rebuild_dma_index();
+
+    const uint8_t mac_addr[6] = { 0x52, 0x54, 0x00, 0x00, 0x00, 0x01 };
+    auto callbacks = std::make_shared<nicbm::Runner::CallbackAdaptor>(device, &mac_addr, this->irq_throttle);
+    callbacks->model = this->model;
+    callbacks->vfu = this->vfu;
+    this->model->vmux = callbacks;
+
+    this->guest = std::make_unique<E810Guest>(this->model, (uint8_t *)mem);
+    this->guest->adminq_init();
+  }
+
+  ~E810Harness() {
+    this->model->vmux = nullptr;
+    this->vfu->mappings.clear();
+    munmap(this->segment.iov_base, GUEST_MEM_SIZE);
+    std::remove(this->sock.c_str());
+    close(this->efd);
+  }
+
+  E810Harness(const E810Harness &) = delete;
+  E810Harness &operator=(const E810Harness &) = delete;
+
+private:
+  int efd;
+  std::string sock;
+  struct iovec segment;
+  std::vector<std::shared_ptr<InterruptThrottlerSimbricks>> irq_throttle;
+};
+
+} // namespace e810_guest
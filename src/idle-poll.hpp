@@ -0,0 +1,248 @@
+#pragma once
+
+#include "util.hpp"
+#include <rte_branch_prediction.h>
+#include <atomic>
+#include <cpuid.h>
+#include <functional>
+#include <immintrin.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Adaptive back-off for busy polling threads.
+ *
+ * A polling loop reports the outcome of every poll with poll_done(). While
+ * polls keep coming back empty, the thread backs off in stages:
+ *  1. spin with pause
+ *  2. umwait on a cache line the caller expects new work to be written to, or
+ *     tpause if there is none (only on CPUs with WAITPKG, spins otherwise)
+ *  3. short sleeps
+ *  4. park: block until wake() is called or one of the wake fds fires. The
+ *     park is bounded by PARK_TIMEOUT_US, so that work sources without any
+ *     notification are still picked up eventually.
+ * A poll that finds work goes back to spinning right away.
+ *
+ * With adaptive=false, the poller only keeps statistics (busy polling).
+ */
+class IdlePoller {
+public:
+  // how long the thread has been idle before a stage starts (us)
+  static constexpr uint64_t WAITPKG_AFTER_US = 20;
+  static constexpr uint64_t SLEEP_AFTER_US = 200;
+  static constexpr uint64_t PARK_AFTER_US = 2000;
+  static constexpr uint64_t WAITPKG_SLICE_CYCLES = 10000;
+  static constexpr uint64_t SLEEP_US = 50;
+  static constexpr uint64_t PARK_TIMEOUT_US = 1000;
+
+  // Written by the polling thread only. Other threads may read them at any
+  // time (see print_stats()).
+  struct Stats {
+    std::atomic<uint64_t> busy_polls = 0;
+    std::atomic<uint64_t> empty_polls = 0;
+    std::atomic<uint64_t> sleeps = 0;
+    std::atomic<uint64_t> parks = 0;
+    std::atomic<uint64_t> wakeups = 0; // parks ended by wake() or a wake fd
+  };
+  Stats stats;
+
+  // Called with true right before the poller parks (e.g. to arm rx
+  // interrupts) and with false when it is done parking.
+  std::function<void(bool)> park_hook;
+
+  IdlePoller(bool adaptive) : adaptive(adaptive) {
+    this->waitpkg = IdlePoller::cpu_has_waitpkg();
+    if (!adaptive)
+      return;
+
+    this->efd = epoll_create1(EPOLL_CLOEXEC);
+    this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->efd < 0 || this->wake_fd < 0)
+      die("IdlePoller: cannot create epoll/eventfd");
+    this->add_wake_fd(this->wake_fd, true);
+  }
+
+  ~IdlePoller() {
+    if (this->wake_fd >= 0)
+      close(this->wake_fd);
+    if (this->efd >= 0)
+      close(this->efd);
+  }
+
+  IdlePoller(const IdlePoller &) = delete;
+  IdlePoller &operator=(const IdlePoller &) = delete;
+
+  /**
+   * Also end parking when fd becomes readable. If drain is set, fd is an
+   * eventfd and the poller reads it to reset it.
+   */
+  void add_wake_fd(int fd, bool drain) {
+    if (!this->adaptive)
+      return;
+    struct epoll_event e = {};
+    e.events = EPOLLIN;
+    e.data.u64 = ((uint64_t)drain << 32) | (uint32_t)fd;
+    if (epoll_ctl(this->efd, EPOLL_CTL_ADD, fd, &e) != 0)
+      die("IdlePoller: cannot add wake fd %d", fd);
+  }
+
+  /**
+   * Signal that there is new work. May be called from any thread. Cheap
+   * unless the poller is (about to be) parked.
+   */
+  void wake() {
+    // pairs with the fence in poll_done(): either the poller's last poll sees
+    // the new work, or we see that it parks
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (this->parking.load(std::memory_order_relaxed)) {
+      uint64_t one = 1;
+      if (write(this->wake_fd, &one, sizeof(one)) < 0) {
+        // counter overflow: the poller will wake up anyway
+      }
+    }
+  }
+
+  /**
+   * Report the outcome of a poll and back off if it found no work.
+   * monitor: optional address where new work shows up first (e.g. the
+   * flags of the next descriptor). Used for umwait.
+   */
+  void poll_done(bool found_work, const volatile void *monitor = nullptr) {
+    if (likely(found_work)) {
+      inc(this->stats.busy_polls);
+      if (unlikely(this->idle_since_ns != 0)) {
+        this->idle_since_ns = 0;
+        this->unpark();
+      }
+      return;
+    }
+
+    inc(this->stats.empty_polls);
+    if (!this->adaptive)
+      return;
+
+    uint64_t now = IdlePoller::now_ns();
+    if (this->idle_since_ns == 0) {
+      this->idle_since_ns = now;
+      return;
+    }
+    uint64_t idle_us = (now - this->idle_since_ns) / 1000;
+
+    if (idle_us < WAITPKG_AFTER_US) {
+      rte_pause();
+    } else if (idle_us < SLEEP_AFTER_US) {
+      this->waitpkg_wait(monitor);
+    } else if (idle_us < PARK_AFTER_US) {
+      inc(this->stats.sleeps);
+      struct timespec ts = { .tv_sec = 0, .tv_nsec = SLEEP_US * 1000 };
+      nanosleep(&ts, nullptr);
+    } else if (!this->parking.load(std::memory_order_relaxed)) {
+      // announce parking, then let the caller poll once more before we block
+      this->parking.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (this->park_hook)
+        this->park_hook(true);
+    } else {
+      this->park();
+    }
+  }
+
+  /**
+   * Print the statistics since the last call. Called periodically by a
+   * single thread other than the polling one.
+   */
+  void print_stats(const char *name) {
+    uint64_t busy = this->stats.busy_polls.load(std::memory_order_relaxed);
+    uint64_t empty = this->stats.empty_polls.load(std::memory_order_relaxed);
+    uint64_t sleeps = this->stats.sleeps.load(std::memory_order_relaxed);
+    uint64_t parks = this->stats.parks.load(std::memory_order_relaxed);
+    uint64_t wakeups = this->stats.wakeups.load(std::memory_order_relaxed);
+
+    uint64_t d_busy = busy - this->last.busy_polls;
+    uint64_t d_empty = empty - this->last.empty_polls;
+    uint64_t polls = d_busy + d_empty;
+    printf("%s: %lu polls, %.1f%% busy, %lu sleeps, %lu parks (%lu woken)\n",
+           name, polls, polls ? 100.0 * d_busy / polls : 0.0,
+           sleeps - this->last.sleeps, parks - this->last.parks,
+           wakeups - this->last.wakeups);
+
+    this->last = { busy, empty, sleeps, parks, wakeups };
+  }
+
+private:
+  struct StatsSnapshot {
+    uint64_t busy_polls, empty_polls, sleeps, parks, wakeups;
+  };
+
+  bool adaptive;
+  bool waitpkg;
+  int efd = -1;
+  int wake_fd = -1;
+  std::atomic<bool> parking = false;
+  uint64_t idle_since_ns = 0; // 0: the last poll found work
+  StatsSnapshot last = {};
+
+  // single writer: no need for an atomic read-modify-write
+  static inline void inc(std::atomic<uint64_t> &counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  static bool cpu_has_waitpkg() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+      return false;
+    return ecx & bit_WAITPKG;
+  }
+
+  __attribute__((target("waitpkg")))
+  void waitpkg_wait(const volatile void *monitor) {
+    if (!this->waitpkg) {
+      rte_pause();
+      return;
+    }
+    // C0.2: deeper sleep, slower wake-up. We are idle for a while already.
+    uint64_t deadline = rte_rdtsc() + WAITPKG_SLICE_CYCLES;
+    if (monitor) {
+      _umonitor((void *)monitor);
+      _umwait(0, deadline);
+    } else {
+      _tpause(0, deadline);
+    }
+  }
+
+  void park() {
+    inc(this->stats.parks);
+    struct epoll_event events[8];
+    int n = epoll_wait(this->efd, events, 8, PARK_TIMEOUT_US / 1000);
+    for (int i = 0; i < n; i++) {
+      int fd = (int)(uint32_t)events[i].data.u64;
+      bool drain = events[i].data.u64 >> 32;
+      uint64_t count;
+      if (drain && read(fd, &count, sizeof(count)) < 0) {
+        // already drained
+      }
+    }
+    if (n > 0)
+      inc(this->stats.wakeups);
+    // stay parked until a poll finds work
+  }
+
+  void unpark() {
+    if (!this->parking.load(std::memory_order_relaxed))
+      return;
+    this->parking.store(false, std::memory_order_relaxed);
+    if (this->park_hook)
+      this->park_hook(false);
+  }
+};
@@ -10,6 +10,7 @@
 #include <time.h>
 #include <cstdlib>
 #include <algorithm>
+#include <mutex>
 #include "interrupts/interface.hpp"
 
 /*
@@ -31,6 +32,9 @@ class InterruptThrottlerSimbricks: public InterruptThrottler {
   std::shared_ptr<VfioUserServer> vfuServer;
   ulong factor = 1;
   struct timespec poll_timer = {};
+  // protects time_ and poll_timer: interrupts are requested by the threads
+  // processing queues, while the poll timer fires on the rx polling thread
+  std::mutex mutex;
 
   InterruptThrottlerSimbricks(int efd, int irq_idx, std::shared_ptr<GlobalInterrupts> irq_glob): irq_idx(irq_idx) {
     this->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0); // foo error
@@ -52,8 +56,15 @@ class InterruptThrottlerSimbricks: public InterruptThrottler {
     this->efd = efd;
   }
 
+  bool pollTimerArmed() {
+    return this->armed.load();
+  }
+
   ulong processPollTimer() {
     ulong ret = 0;
+    if (!this->armed.load())
+      return ret; // fast path: nothing can be due
+    std::lock_guard guard(this->mutex);
     if (this->poll_timer.tv_sec == 0 && this->poll_timer.tv_nsec == 0) {
       return ret; // timer is deactivated
     }
@@ -113,6 +124,7 @@ class InterruptThrottlerSimbricks: public InterruptThrottler {
       return 0;
     }
 
+    std::lock_guard guard(this->mutex);
     this->spacing = mindelay;
     // this->globalIrq->update(); // disable for now due to high overhead
     // struct itimerspec its = {};
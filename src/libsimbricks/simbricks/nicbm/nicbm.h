@@ -29,12 +29,14 @@
 #include <cstring>
 #include <deque>
 #include <set>
+#include <vector>
 #include "interrupts/none.hpp"
 #include "interrupts/simbricks.hpp"
 #include "vfio-server.hpp"
 #include "devices/vmux-device.hpp"
 #include "util.hpp"
 #include <memory>
+#include <mutex>
 
 #include <src/libsimbricks/simbricks/base/cxxatomicfix.h>
 extern "C" {
@@ -102,8 +104,9 @@ class Runner {
 
       // when calling this, the  device will do all pending DMAs.
       void DmaComplete(DMAOp &op);
-      // send a packet from the network fabric to the NIC device. Optional destination queue hint.
-      void EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len);
+      // send a packet from the network fabric to the NIC device. Optional destination queue hint and offload results.
+      void EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len,
+                 const Driver::RxMeta *meta = nullptr);
 
       // Functions to be called by the Device
       // IssueDma, MsiXIssue, EthSend, EventSchedule, ...
@@ -169,9 +172,28 @@ class Runner {
 
     /**
      * A packet has arrived on the wire, of length `len` with
-     * payload `data`. Optional destination queue hint.
+     * payload `data`. Optional destination queue hint and offload results
+     * of the physical NIC.
      */
-    virtual void EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len) = 0;
+    virtual void EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len,
+                       const Driver::RxMeta *meta = nullptr) = 0;
+
+    struct EthFrame {
+      std::optional<uint16_t> queue;
+      const void *data;
+      size_t len;
+      const Driver::RxMeta *meta;
+    };
+
+    /**
+     * Several packets have arrived on the wire (arguments as for EthRx).
+     * Models override this to pay per-packet costs like descriptor
+     * writebacks and interrupts only once per burst.
+     */
+    virtual void EthRxBurst(uint8_t port, const std::vector<EthFrame> &frames) {
+      for (auto &frame : frames)
+        EthRx(port, frame.queue, frame.data, frame.len, frame.meta);
+    }
 
     /**
      * A timed event is due.
@@ -191,6 +213,27 @@ class Runner {
 class CallbackAdaptor {
   private:
     const uint8_t (*mac_addr)[6];
+
+    void dma_copy(uint64_t dma_addr, void *buf, size_t len, bool write) {
+      // a DMA may span multiple guest memory regions
+      struct iovec iov[4];
+      size_t nb_iov = this->vfu->dma_local_sgl(dma_addr, len, iov, 4);
+      if (!nb_iov) {
+        die("Could not translate DMA address");
+      }
+      char *data = (char *)buf;
+      for (size_t i = 0; i < nb_iov; i++) {
+        if (write) {
+          memcpy(iov[i].iov_base, data, iov[i].iov_len);
+        } else {
+          memcpy(data, iov[i].iov_base, iov[i].iov_len);
+        }
+        data += iov[i].iov_len;
+      }
+    }
+    // protects the driver's tx staging of this device: the model sends from
+    // several threads, and the rx thread flushes expired packets
+    std::mutex tx_mutex;
   public:
     std::shared_ptr<VfioUserServer> vfu; // must be lazily set during VmuxDevice.setup_vfu()
     std::shared_ptr<Device> model; 
@@ -205,17 +248,18 @@ class CallbackAdaptor {
         printf("CallbackAdaptor::IssueDma: read %d, addr %lx, len %zu\n", !op.write_, op.dma_addr_, op.len_)
       );
       // __builtin_dump_struct(&op, &printf); // dump_struct doesnt work on classes
-      void *local_addr = this->vfu->dma_local_addr(op.dma_addr_, op.len_);
-      if (!local_addr) {
-        die("Could not translate DMA address");
-      }
-      if (op.write_) {
-        memcpy(local_addr, op.data_, op.len_);
-      } else {
-        memcpy(op.data_, local_addr, op.len_);
-      }
+      if (op.write_)
+        this->DmaWrite(op.dma_addr_, op.data_, op.len_);
+      else
+        this->dma_copy(op.dma_addr_, op.data_, op.len_, false);
       model->DmaComplete(op);
     }
+    // Copy len bytes from src to guest memory right away. Unlike a write
+    // through IssueDma, src needs no DMA buffer of its own, so data already in
+    // memory (e.g. a received packet) is copied only once.
+    void DmaWrite(uint64_t dma_addr, const void *src, size_t len) {
+      this->dma_copy(dma_addr, (void *)src, len, true);
+    }
     void MsiIssue(uint8_t vec) {
       printf("CallbackAdaptor::MsiIssue(%d)\n", vec);
       die("not implemented");
@@ -241,7 +285,15 @@ class CallbackAdaptor {
       if_log_level(LOG_DEBUG, 
         printf("CallbackAdaptor::EthSend(len=%zu)\n", len)
       );
-      this->device->driver->send(this->device->device_id, (char*)data, len);
+      // staged packets are sent in bursts once EthFlush() is called
+      std::lock_guard guard(this->tx_mutex);
+      this->device->driver->send_stage(this->device->device_id, (char*)data, len);
+    }
+    // Send all packets staged by EthSend. Call whenever the model is done
+    // producing packets for now (e.g. after processing a tx doorbell).
+    void EthFlush(bool only_expired = false) {
+      std::lock_guard guard(this->tx_mutex);
+      this->device->driver->tx_flush(this->device->device_id, only_expired);
     }
 
     bool EthSendTso(const void *data, size_t len, bool end_of_packet,
@@ -250,6 +302,7 @@ class CallbackAdaptor {
       if_log_level(LOG_DEBUG,
         printf("CallbackAdaptor::EthSendTso(len=%zu, eop=%d)\n", len, end_of_packet)
       );
+      std::lock_guard guard(this->tx_mutex);
       return this->device->driver->send_tso(
         this->device->device_id, (const char *)data, len, end_of_packet,
         l2_len, l3_len, l4_len, tso_segsz);
@@ -1,6 +1,7 @@
 #include <atomic>
 #include <cstdlib>
 #include <dirent.h>
+#include <format>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -43,6 +44,12 @@
 #include "src/devices/vmux-device.hpp"
 #include "src/drivers/dpdk.hpp"
 #include "src/drivers/tap.hpp"
+#ifdef BUILD_AF_XDP
+  #include "src/drivers/af-xdp.hpp"
+#endif
+#ifdef BUILD_IO_URING
+  #include "src/drivers/tap-uring.hpp"
+#endif
 #include "src/rx-thread.hpp"
 
 extern "C" {
@@ -53,6 +60,8 @@ namespace outcome = BOOST_OUTCOME_V2_NAMESPACE;
 
 // set true by signals, should be respected by runtime loops
 std::atomic<bool> quit(false);
+// how often to print statistics of adaptive polling threads
+static const time_t POLL_STATS_INTERVAL_S = 10;
 
 typedef struct {
   uint64_t value[2];
@@ -119,10 +128,16 @@ Result<void> _main(int argc, char **argv) {
   cpu_set_t default_cpuset;
   Util::parse_cpuset("0-6", default_cpuset);
   bool useDpdk = false;
+  std::string afXdpIfname; // use AF_XDP backend on this interface if set
+  bool useIoUring = false;
+  unsigned tapQueues = 1;
+  bool tapOffloads = false;
   bool pollInMainThread = false;
+  bool adaptivePolling = false;
+  size_t zeroCopyMinLen = 0;
   uint8_t mac_addr[6];
   cpu_set_t cpuset;
-  while ((ch = getopt(argc, argv, "hd:t:s:m:a:e:f:b:qu")) != -1) {
+  while ((ch = getopt(argc, argv, "hd:t:s:m:a:e:f:b:quiz:x:rn:v")) != -1) {
     switch (ch) {
     case 'q':
       LOG_LEVEL = LOG_ERR;
@@ -133,6 +148,28 @@ Result<void> _main(int argc, char **argv) {
     case 'u':
       useDpdk = true;
       break;
+    case 'x':
+      afXdpIfname = optarg;
+      break;
+    case 'r':
+      useIoUring = true;
+      break;
+    case 'v':
+      tapOffloads = true;
+      break;
+    case 'n':
+      tapQueues = strtoul(optarg, NULL, 0);
+      if (tapQueues == 0) {
+        errno = EINVAL;
+        die("Taps need at least one queue");
+      }
+      break;
+    case 'i':
+      adaptivePolling = true;
+      break;
+    case 'z':
+      zeroCopyMinLen = strtoul(optarg, NULL, 0);
+      break;
     case 'd':
       pciAddresses.push_back(optarg);
       break;
@@ -167,6 +204,15 @@ Result<void> _main(int argc, char **argv) {
              "address to emulated devices starting from this base\n"
           << "-u                                     Use dpdk backend instead "
              "of linux taps\n"
+          << "-x eth0                                Use AF_XDP sockets on this "
+             "interface as backend instead of linux taps\n"
+          << "-i                                     Adaptive polling: let idle "
+             "polling threads back off and sleep (uses dpdk rx interrupts)\n"
+          << "-r                                     Use io_uring for tap backends\n"
+          << "-n 1                                   Queues per tap. Packets from "
+             "tap queue i are received on guest queue i\n"
+          << "-v                                     Offload TSO and checksums "
+             "of taps to the kernel (virtio-net headers)\n"
           << "-d 0000:18:00.0                        PCI-Device (or "
              "\"none\" if not applicable)\n"
           << "-t tap-username0                       Tap device to use "
@@ -175,7 +221,9 @@ Result<void> _main(int argc, char **argv) {
           << "-m passthrough                         vMux mode: "
              "passthrough, emulation, mediation, e1000-emu\n"
           << "-e cpuset                              pin Rx thread to cpus. Takes arguements similar to cpuset. Default: 0-6\n"
-          << "-f cpuset                              pin Runner thread to cpus.\n";
+          << "-f cpuset                              pin Runner thread to cpus.\n"
+          << "-z 1024                                vDPDK: send packets of at least "
+             "this many bytes from guest memory without copying. Default: 0 (always copy)\n";
       return outcome::success();
     default:
       break;
@@ -196,7 +244,13 @@ Result<void> _main(int argc, char **argv) {
     die("Command line arguments need to specify the same number of devices, "
         "sockets and modes");
   }
-  if (!useDpdk && pciAddresses.size() != tapNames.size()) {
+  if (useDpdk && !afXdpIfname.empty()) {
+    errno = EINVAL;
+    die("Only one of the dpdk and AF_XDP backends can be used");
+  }
+  // backends that are polled by rx threads instead of the main epoll loop
+  bool pollDriver = useDpdk || !afXdpIfname.empty();
+  if (!pollDriver && pciAddresses.size() != tapNames.size()) {
     errno = EINVAL;
     die("Command line arguments need to specify the same number of devices, "
         "taps, sockets and modes");
@@ -224,14 +278,32 @@ Result<void> _main(int argc, char **argv) {
 
   int efd = epoll_create1(0);
 
-  if (!useDpdk) {
+  if (!afXdpIfname.empty()) {
+#ifdef BUILD_AF_XDP
+    auto af_xdp = std::make_shared<AfXdp>(sockets.size(), &base_mac, afXdpIfname.c_str());
+    for (size_t i = 0; i < sockets.size(); i++) {
+      drivers.push_back(af_xdp); // everyone shares a single AF_XDP backend
+    }
+#else
+    die("AF_XDP support was disabled for this build.");
+#endif
+  } else if (!useDpdk) {
     // create taps
     for (size_t i = 0; i < tapNames.size(); i++) {
       if (tapNames[i] == "none") {
         drivers.push_back(NULL);
         continue;
       }
-      auto tap = std::make_shared<Tap>();
+      std::shared_ptr<Tap> tap;
+      if (useIoUring) {
+#ifdef BUILD_IO_URING
+        tap = std::make_shared<UringTap>(tapQueues, tapOffloads, Util::cpuset_numa_node(rxThreadCpus[i]));
+#else
+        die("io_uring support was disabled for this build.");
+#endif
+      } else {
+        tap = std::make_shared<Tap>(tapQueues, tapOffloads, Util::cpuset_numa_node(rxThreadCpus[i]));
+      }
       tap->open_tap(tapNames[i].c_str());
       drivers.push_back(tap);
     }
@@ -249,7 +321,7 @@ Result<void> _main(int argc, char **argv) {
     }
 
     auto dpdk =
-        std::make_shared<Dpdk>(sockets.size(), &base_mac, dpdk_argc, dpdk_argv);
+        std::make_shared<Dpdk>(sockets.size(), &base_mac, dpdk_argc, dpdk_argv, adaptivePolling);
     for (size_t i = 0; i < sockets.size(); i++) {
       drivers.push_back(dpdk); // everyone shares a single dpdk backend
     }
@@ -302,12 +374,12 @@ Result<void> _main(int argc, char **argv) {
       device->driver->mediation_enable(i);
     }
     if (modes[i] == "vdpdk") {
-      auto vdpdk_device = std::make_shared<VdpdkDevice>(i, drivers[i], &mac_addr);
+      auto vdpdk_device = std::make_shared<VdpdkDevice>(i, drivers[i], &mac_addr, zeroCopyMinLen);
       device = vdpdk_device;
       device->driver->mediation_enable(i);
       if (!vdpdkThreads) {
         // Parameter is threshold of number of VMs above which two VMs will share one polling thread
-        vdpdkThreads = std::make_unique<VdpdkThreads>(2);
+        vdpdkThreads = std::make_unique<VdpdkThreads>(2, adaptivePolling);
       }
       // We pin the TX thread to the runnerThreadCpus, as the runner thread is rarely used in vDPDK
       vdpdkThreads->add_device(vdpdk_device, rxThreadCpus[i], runnerThreadCpus[i]);
@@ -324,13 +396,13 @@ Result<void> _main(int argc, char **argv) {
     if (device == NULL)
       die("Unknown mode specified: %s\n", modes[i].c_str());
     devices.push_back(device);
-    if (!noRxThread && useDpdk && pollInMainThread)
+    if (!noRxThread && pollDriver && pollInMainThread)
       mainThreadPolling.push_back(device);
-    if (useDpdk && !pollInMainThread) {
+    if (pollDriver && !pollInMainThread) {
       if (noRxThread) {
         pollingThreads.push_back(nullptr);
       } else {
-        pollingThreads.push_back(std::make_unique<RxThread>(device, rxThreadCpus[i]));
+        pollingThreads.push_back(std::make_unique<RxThread>(device, rxThreadCpus[i], adaptivePolling));
       }
       broadcast_destinations->push_back(device);
     }
@@ -379,13 +451,31 @@ Result<void> _main(int argc, char **argv) {
 
   // runtime loop
   int poll_timeout;
-  if (useDpdk && pollInMainThread) {
+  if (pollDriver && pollInMainThread) {
     poll_timeout = 0; // dpdk: busy polling
   } else {
     poll_timeout = 500; // default: event based
   }
   bool foobar = false;
+  time_t next_stats = time(NULL) + POLL_STATS_INTERVAL_S;
   while (!quit.load()) {
+    if (time(NULL) >= next_stats) {
+      next_stats += POLL_STATS_INTERVAL_S;
+      if_log_level(LOG_INFO, {
+        if (adaptivePolling) {
+          for (auto &pollingThread : pollingThreads) {
+            if (pollingThread)
+              pollingThread->poller->print_stats(std::format("vmuxRx{}", pollingThread->device->device_id).c_str());
+          }
+          if (vdpdkThreads)
+            vdpdkThreads->print_stats();
+        }
+        for (size_t i = 0; i < drivers.size(); i++) {
+          if (drivers[i])
+            drivers[i]->print_stats(std::format("vmux{}", i).c_str(), i);
+        }
+      });
+    }
     for (size_t i = 0; i < runner.size(); i++) {
       struct epoll_event events[1024];
 
@@ -85,6 +85,8 @@ private:
   }
 
   void run() {
+    // MMIO handlers may transmit through the driver
+    DriverThreadScope driver_thread(device->driver);
     this->initilize();
     state.store(INITILIZED);
     printf("%s: Waiting for qemu to attach...\n", this->socket.c_str());
@@ -102,13 +104,19 @@ private:
     }
     state.store(CONNECTED);
 
-    struct pollfd pfd =
-        (struct pollfd){.fd = vfu_get_poll_fd(vfu->vfu_ctx), .events = POLLIN};
+    struct pollfd pfds[2] = {
+        {.fd = vfu_get_poll_fd(vfu->vfu_ctx), .events = POLLIN},
+        {.fd = this->device->doorbell_fd(), .events = POLLIN}, // ignored by poll if -1
+    };
+    struct pollfd &pfd = pfds[0];
 
     while (running.load()) {
-      int ret = poll(&pfd, 1, 500);
+      int ret = poll(pfds, 2, 500);
       // printf("poll runner\n");
 
+      if (pfds[1].revents & POLLIN)
+        this->device->process_doorbells();
+
       if (pfd.revents & POLLIN) {
         this->device->vfu_ctx_mutex.lock();
         ret = vfu_run_ctx(vfu->vfu_ctx);
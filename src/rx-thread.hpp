@@ -1,12 +1,14 @@
 #pragma once
 
 #include "devices/vmux-device.hpp"
+#include "idle-poll.hpp"
 #include "util.hpp"
 #include <atomic>
 #include <thread>
 
 /**
  * Does busy polling on the VmuxDevices rx_callback (should probably only be used with DPDK drivers).
+ * With adaptive polling, the thread backs off while the device has no work (see IdlePoller).
  */
 class RxThread {
   public:
@@ -15,8 +17,19 @@ class RxThread {
     std::string termination_error; // non-null if Runner terminated with error
     std::shared_ptr<VmuxDevice> device;
     cpu_set_t cpupin;
+    std::shared_ptr<IdlePoller> poller;
 
-    RxThread(std::shared_ptr<VmuxDevice> device, cpu_set_t cpupin): device(device), cpupin(cpupin) { }
+    RxThread(std::shared_ptr<VmuxDevice> device, cpu_set_t cpupin, bool adaptive = false): device(device), cpupin(cpupin) {
+      this->poller = std::make_shared<IdlePoller>(adaptive);
+      auto driver = device->driver;
+      int vm_id = device->device_id;
+      for (int fd : driver->rx_notify_fds(vm_id))
+        this->poller->add_wake_fd(fd, true);
+      this->poller->park_hook = [driver, vm_id](bool parking) {
+        driver->rx_notify_enable(vm_id, parking);
+      };
+      device->rx_poller = this->poller;
+    }
 
     void start() {
       running.store(1);
@@ -49,9 +62,10 @@ class RxThread {
 
   private:
     void run() {
+      DriverThreadScope driver_thread(device->driver);
       while (running.load()) {
         // dpdk: do busy polling
-        device->rx_callback(device->device_id, device.get());
+        poller->poll_done(device->poll_rx() > 0);
       }
     }
 };
@@ -0,0 +1,114 @@
+/*
+ * Microbenchmark for the BAR0 register dispatch of e810_bm.
+ *
+ * Compares the page-indexed reg_table lookup against a linear walk over the
+ * same register ranges, which is what the former if/else chain in
+ * reg_mem_read32/reg_mem_write32 did.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <bit>
+#include <vector>
+
+#include "sims/nic/e810_bm/e810_reg_ranges.h"
+#include "sims/nic/e810_bm/reg_table.h"
+
+using e810::reg_range;
+using e810::reg_table;
+
+#define BENCH_STRIDE_SHIFT(reg) \
+  ((uint8_t)std::countr_zero((uint64_t)(reg(1) - reg(0))))
+#define BENCH_REG_RANGE(op, reg, field, n) \
+  reg_range{reg(0), n, BENCH_STRIDE_SHIFT(reg), e810::REG_OP_##op, 0},
+#define BENCH_REG_CONST_RANGE(op, reg, n) \
+  reg_range{reg(0), n, BENCH_STRIDE_SHIFT(reg), e810::REG_OP_##op, 0},
+
+static const reg_range read_ranges[] = {
+  E810_READ_REGS(BENCH_REG_RANGE, BENCH_REG_CONST_RANGE)
+};
+static const reg_range write_ranges[] = {
+  E810_WRITE_REGS(BENCH_REG_RANGE, BENCH_REG_CONST_RANGE)
+};
+
+static const uint64_t BAR_REGS_LEN = 64 * 1024 * 1024;
+static const size_t ITERATIONS = 20000000;
+
+// what the if/else chain did: first range containing addr wins
+static const reg_range *linear_lookup(const reg_range *ranges, size_t nb,
+                                      uint64_t addr, uint32_t &idx) {
+  for (size_t i = 0; i < nb; i++) {
+    const reg_range &r = ranges[i];
+    uint64_t last = r.first + ((uint64_t)(r.count - 1) << r.stride_shift);
+    if (addr >= r.first && addr <= last) {
+      idx = (addr - r.first) >> r.stride_shift;
+      return &r;
+    }
+  }
+  return nullptr;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct workload {
+  const char *name;
+  std::vector<uint64_t> addrs;
+};
+
+template <typename F>
+static double bench(const std::vector<uint64_t> &addrs, F lookup) {
+  uint64_t sum = 0;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < ITERATIONS; i++) {
+    uint32_t idx = 0;
+    const reg_range *r = lookup(addrs[i % addrs.size()], idx);
+    sum += (uintptr_t)r + idx;
+  }
+  uint64_t end = now_ns();
+  // keep the compiler from optimizing the loop away
+  __asm__ volatile("" : : "r"(sum));
+  return (double)(end - start) / ITERATIONS;
+}
+
+static void run(const char *table_name, const reg_range *ranges, size_t nb,
+                const std::vector<workload> &workloads) {
+  reg_table table(ranges, nb, BAR_REGS_LEN);
+  for (const auto &w : workloads) {
+    double linear = bench(w.addrs, [&](uint64_t addr, uint32_t &idx) {
+      return linear_lookup(ranges, nb, addr, idx);
+    });
+    double paged = bench(w.addrs, [&](uint64_t addr, uint32_t &idx) {
+      return table.lookup(addr, idx);
+    });
+    printf("%-6s %-24s linear %7.2f ns/access   reg_table %7.2f ns/access\n",
+           table_name, w.name, linear, paged);
+  }
+}
+
+int main() {
+  std::vector<workload> write_workloads = {
+    { "tx doorbell", { QTX_COMM_DBELL(0), QTX_COMM_DBELL(1), QTX_COMM_DBELL(5) } },
+    { "rx tail", { QRX_TAIL(0), QRX_TAIL(1), QRX_TAIL(5) } },
+    { "dyn ctl", { GLINT_DYN_CTL(0), GLINT_DYN_CTL(1), GLINT_DYN_CTL(5) } },
+    { "stats counter", { GLV_UPTCL(0), GLPRT_UPTCL(0) } },
+    { "unmatched (switch)", { PF_FW_ATQT, PFINT_OICR } },
+  };
+  std::vector<workload> read_workloads = {
+    { "dyn ctl", { GLINT_DYN_CTL(0), GLINT_DYN_CTL(1), GLINT_DYN_CTL(5) } },
+    { "tx head", { QTX_COMM_HEAD(0), QTX_COMM_HEAD(1), QTX_COMM_HEAD(5) } },
+    { "stats counter", { GLV_UPTCL(0), GLPRT_UPTCL(0) } },
+    { "unmatched (switch)", { PF_FW_ATQT, PFINT_OICR } },
+  };
+
+  run("write", write_ranges, sizeof(write_ranges) / sizeof(write_ranges[0]),
+      write_workloads);
+  run("read", read_ranges, sizeof(read_ranges) / sizeof(read_ranges[0]),
+      read_workloads);
+  return 0;
+}
@@ -369,7 +369,8 @@ void queue_admin_tx::admin_desc_ctx::process() {
     struct ice_aqc_get_set_rss_key *v =
         reinterpret_cast<struct ice_aqc_get_set_rss_key *>(
                 d->params.raw);
-
+    // the model has a single VSI, so v->vsi_id does not matter
+    dev.lanmgr.set_rss_key(data, d->datalen);
     desc_complete_indir(0, data, d->datalen);
   } else if (d->opcode == ice_aqc_opc_set_rss_lut) {
     struct ice_aqc_get_set_rss_lut *v =
@@ -380,6 +381,7 @@ void queue_admin_tx::admin_desc_ctx::process() {
       // We use this RSS setting to detect DPDK based Fastclick to fix its unexplainable reg_idx queue offset.
       dev.vsi0_first_queue = 1;
     }
+    dev.lanmgr.set_rss_lut(v->flags, data, d->datalen);
     desc_complete_indir(0, data, d->datalen);
   // }
 //   else if (d->opcode == i40e_aqc_opc_set_switch_config) {
@@ -447,6 +449,8 @@ void queue_admin_tx::admin_desc_ctx::process() {
         reinterpret_cast<struct ice_aqc_add_update_free_vsi_resp *>(
                 d->params.raw);
     __builtin_dump_struct(v, &printf);
+    if (d->datalen >= sizeof(struct ice_aqc_vsi_props))
+      dev.lanmgr.vsi_updated(*reinterpret_cast<struct ice_aqc_vsi_props *>(data));
     v->vsi_num = 1;
     struct ice_aqc_vsi_props pd;
     // memset(&pd, 0, sizeof(pd));
@@ -458,6 +462,8 @@ void queue_admin_tx::admin_desc_ctx::process() {
 #ifdef DEBUG_ADMINQ
     cout <<  "  update vsi parameters" << logger::endl;
 #endif
+    if (d->datalen >= sizeof(struct ice_aqc_vsi_props))
+      dev.lanmgr.vsi_updated(*reinterpret_cast<struct ice_aqc_vsi_props *>(data));
     /* TODO */
     desc_complete(0);
 //   } else if (d->opcode == i40e_aqc_opc_set_dcb_parameters) {
@@ -481,15 +487,16 @@ void queue_admin_tx::admin_desc_ctx::process() {
     cout <<  "AQ remove sw rule" << logger::endl;
 
     
+    int retval = 0;
     if (rules_elem->type == ICE_AQC_SW_RULES_T_LKUP_RX || rules_elem->type == ICE_AQC_SW_RULES_T_LKUP_TX) {
+      // the driver only passes the index add_sw_rules returned
+      if (!dev.bcam.del_rule(rules_elem->pdata.lkup_tx_rx.index))
+        retval = ICE_AQ_RC_ENOENT;
       rules_elem->pdata.lkup_tx_rx.index = 0; // null, since now deleted
     } else {
       // we should also zero the index for other types
     }
 
-    // TODO peter: actually delete the rule
-
-    int retval = 0; // or ENOSPC on error
     desc_complete_indir(retval, rules_elem, std::min(sizeof(*rules_elem), (size_t)d->datalen));
   } else if (d->opcode == ice_aqc_opc_get_dflt_topo) {
 #ifdef DEBUG_ADMINQ
@@ -705,7 +712,6 @@ void queue_admin_tx::admin_desc_ctx::process() {
 
     add_sw_rules->type = ICE_AQC_SW_RULES_T_LKUP_TX;
     add_sw_rules->pdata.lkup_tx_rx.src = 1;
-    add_sw_rules->pdata.lkup_tx_rx.index = 0;
     desc_complete_indir(0, data, d->datalen);
   } else if (d->opcode == ice_aqc_opc_nvm_read){
     struct ice_aqc_nvm *nvm_read_cmd = reinterpret_cast<ice_aqc_nvm *> (d->params.raw);
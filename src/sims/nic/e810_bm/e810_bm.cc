@@ -24,16 +24,21 @@
 
 #include "src/sims/nic/e810_bm/e810_bm.h"
 
+#include <cstddef>
 #include <cstdint>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <iostream>
+#include <utility>
 
 #include "devices/e810.hpp"
 #include "sims/nic/e810_bm/base/ice_hw_autogen.h"
 #include "sims/nic/e810_bm/e810_ptp.h"
+#include "sims/nic/e810_bm/e810_reg_ranges.h"
 #include "src/libsimbricks/simbricks/nicbm/multinic.h"
 #include "sims/nic/e810_bm/e810_base_wrapper.h"
 #include "sims/nic/e810_bm/util.h"
@@ -61,7 +66,7 @@ e810_bm::~e810_bm() {
 }
 
 void e810_bm::SetupIntro(struct SimbricksProtoPcieDevIntro &di) {
-  di.bars[BAR_REGS].len = 64 * 1024 * 1024;
+  di.bars[BAR_REGS].len = BAR_REGS_LEN;
   di.bars[BAR_REGS].flags = SIMBRICKS_PROTO_PCIE_BAR_64;
   di.bars[BAR_IO].len = 32;
   di.bars[BAR_IO].flags = SIMBRICKS_PROTO_PCIE_BAR_IO;
@@ -92,11 +97,21 @@ void e810_bm::DmaComplete(nicbm::DMAOp &op) {
   dma.done();
 }
 
-void e810_bm::EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len) {
+void e810_bm::EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len,
+                    const Driver::RxMeta *meta) {
 #ifdef DEBUG_DEV
   std::cout << "e810: received packet len=" << len << logger::endl;
 #endif
-  lanmgr.packet_received(data, len, queue);
+  std::shared_lock ctrl(ctrl_mutex);
+  lanmgr.packet_received(data, len, queue, meta);
+}
+
+void e810_bm::EthRxBurst(uint8_t port, const std::vector<EthFrame> &frames) {
+#ifdef DEBUG_DEV
+  std::cout << "e810: received burst of " << frames.size() << " packets" << logger::endl;
+#endif
+  std::shared_lock ctrl(ctrl_mutex);
+  lanmgr.packets_received(frames);
 }
 
 void e810_bm::RegRead(uint8_t bar, uint64_t addr, void *dest, size_t len) {
@@ -116,6 +131,7 @@ void e810_bm::RegRead(uint8_t bar, uint64_t addr, void *dest, size_t len) {
 
 uint32_t e810_bm::RegRead32(uint8_t bar, uint64_t addr) {
   if (bar == BAR_REGS) {
+    std::unique_lock ctrl(ctrl_mutex);
     return reg_mem_read32(addr);
   } else if (bar == BAR_IO) {
     return reg_io_read(addr);
@@ -162,230 +178,59 @@ void e810_bm::reg_io_write(uint64_t addr, uint32_t val) {
 }
 
 
+// number of 32-bit registers in a member of e810_regs
+#define E810_REG_FIELD_LEN(field) \
+  (sizeof(std::declval<e810_regs &>().field) / sizeof(uint32_t))
+#define E810_REG_STRIDE_SHIFT(reg) \
+  ((uint8_t)std::countr_zero((uint64_t)(reg(1) - reg(0))))
+#define E810_REG_RANGE(op, reg, field, n) \
+  reg_range{reg(0), std::min<uint32_t>(n, E810_REG_FIELD_LEN(field)), \
+            E810_REG_STRIDE_SHIFT(reg), REG_OP_##op, \
+            (uint32_t)offsetof(e810_regs, field)},
+#define E810_REG_CONST_RANGE(op, reg, n) \
+  reg_range{reg(0), n, E810_REG_STRIDE_SHIFT(reg), REG_OP_##op, 0},
+
+const reg_table &e810_bm::reg_read_table() {
+  static const reg_range ranges[] = {
+    E810_READ_REGS(E810_REG_RANGE, E810_REG_CONST_RANGE)
+  };
+  static const reg_table table(ranges, sizeof(ranges) / sizeof(ranges[0]),
+                               BAR_REGS_LEN);
+  return table;
+}
+
+const reg_table &e810_bm::reg_write_table() {
+  static const reg_range ranges[] = {
+    E810_WRITE_REGS(E810_REG_RANGE, E810_REG_CONST_RANGE)
+  };
+  static const reg_table table(ranges, sizeof(ranges) / sizeof(ranges[0]),
+                               BAR_REGS_LEN);
+  return table;
+}
+
 uint32_t e810_bm::reg_mem_read32(uint64_t addr) {
   uint32_t val = 0;
+  uint32_t idx;
 
-  if (addr >= GLINT_DYN_CTL(0) &&
-      addr < GLINT_DYN_CTL(NUM_PFINTS - 1)) {
-    val = regs.pfint_dyn_ctln[(addr - GLINT_DYN_CTL(0)) / 4];
-  } else if (addr >= QTX_COMM_HEAD(0) &&
-             addr <= QTX_COMM_HEAD(16383)) {
-    val = regs.qtx_comm_head[(addr - QTX_COMM_HEAD(0)) / 4];
-  } else if (addr >= PF0INT_ITR_0(0) &&
-             addr <= PF0INT_ITR_0(2047)) {
-    val = regs.pfint_itrn[0][(addr - PF0INT_ITR_0(0)) / 4096];
-  } else if (addr >= PF0INT_ITR_1(0) &&
-             addr <= PF0INT_ITR_1(2047)) {
-    val = regs.pfint_itrn[1][(addr - PF0INT_ITR_1(0)) / 4096];
-  }else if (addr >= PF0INT_ITR_2(0) &&
-             addr <= PF0INT_ITR_2(2047)) {
-    val = regs.pfint_itrn[2][(addr - PF0INT_ITR_2(0)) / 4096];
-  }else if (addr >= QINT_TQCTL(0) &&
-             addr <= QINT_TQCTL(2048 - 1)) {
-    val = regs.qint_tqctl[(addr - QINT_TQCTL(0)) / 4];
-  } else if (addr >= QINT_RQCTL(0) &&
-             addr <= QINT_RQCTL(2047)) {
-    val = regs.qint_rqctl[(addr - QINT_RQCTL(0)) / 4];
-  } else if (addr >= GLINT_CEQCTL(0) && addr <= GLINT_CEQCTL(2048)) {
-    val = regs.glint_ceqctl[(addr - GLINT_CEQCTL(0))];
-  } else if (addr >= QRX_CTRL(0) && addr <= QRX_CTRL(2047)) {
-    val = regs.QRX_CTRL[(addr - QRX_CTRL(0)) / 4];
-  } else if (addr >= QRX_TAIL(0) &&
-             addr <= QRX_TAIL(2048 - 1)) {
-    val = regs.qrx_tail[(addr - QRX_TAIL(0)) / 4];
-  } else if (addr >= GLINT_ITR(0, 0) && addr <= GLINT_ITR(0, 2047)) {
-    val = regs.GLINT_ITR0[(addr - GLINT_ITR(0,0)) / 4];
-  } else if (addr >= GLINT_ITR(1, 0) && addr <= GLINT_ITR(1, 2047)) {
-    val = regs.GLINT_ITR1[(addr - GLINT_ITR(1,0)) / 4];
-  } else if (addr >= GLINT_ITR(2, 0) && addr <= GLINT_ITR(2, 2047)) {
-    val = regs.GLINT_ITR2[(addr - GLINT_ITR(2,0)) / 4];
-  } else if (addr >= QRX_CONTEXT(0, 0) && addr <= QRX_CONTEXT(0, 0)) {
-    int index = (addr - QRX_CONTEXT(0,0)) / 4; // byte offset / 4 = uint32_t* offset
-    val = regs.QRX_CONTEXT[index];
-
-  // Original QRX_CONTEXT implementation:
-  //
-  // } else if (addr >= QRX_CONTEXT(0, 0) && addr <= QRX_CONTEXT(0, 0)) {
-  //   std::cout << "reading qrx context..." << logger::endl;
-  //   std::cout<< "reading QRX_CONTEXT(0,0)" << logger::endl;
-  //   val = regs.QRX_CONTEXT[(addr - QRX_CONTEXT(0,0))/8192];
-  // } else if (addr >= QRX_CONTEXT(1, 0) && addr <= QRX_CONTEXT(1, 0)) {
-  //   std::cout<< "reading QRX_CONTEXT(1,0)" << logger::endl;
-  //   val = regs.QRX_CONTEXT[(addr - QRX_CONTEXT(1,0))/8192];
-  //   } else if (addr >= QRX_CONTEXT(2, 0) && addr <= QRX_CONTEXT(2, 0)) {
-  //   std::cout<< "reading QRX_CONTEXT(2,0)" << logger::endl;
-  //   val = regs.QRX_CONTEXT[(addr - QRX_CONTEXT(2,0))/8192];
-  //   } else if (addr >= QRX_CONTEXT(3, 0) && addr <= QRX_CONTEXT(3, 0)) {
-  //   std::cout<< "reading QRX_CONTEXT(3,0)" << logger::endl;
-  //   val = regs.QRX_CONTEXT[(addr - QRX_CONTEXT(3,0))/8192];
-  //   } else if (addr >= QRX_CONTEXT(4, 0) && addr <= QRX_CONTEXT(4, 0)) {
-  //   val = regs.QRX_CONTEXT[(addr - QRX_CONTEXT(4,0))/8192];
-  //   } else if (addr >= QRX_CONTEXT(5, 0) && addr <= QRX_CONTEXT(5, 0)) {
-  //   val = regs.QRX_CONTEXT[(addr - QRX_CONTEXT(5,0))/8192];
-  //   } else if (addr >= QRX_CONTEXT(6, 0) && addr <= QRX_CONTEXT(6, 0)) {
-  //   val = regs.QRX_CONTEXT[(addr - QRX_CONTEXT(6,0))/8192];
-  //   } else if (addr >= QRX_CONTEXT(7, 0) && addr <= QRX_CONTEXT(7, 0)) {
-  //   // QRX_CONTEXT[(addr - QRX_CONTEXT(7,0))/8192] = val;
-  //   val = regs.QRX_CONTEXT[(addr - QRX_CONTEXT(7,0))/8192];
-  } else if (addr >= QRXFLXP_CNTXT(0) && addr <= QRXFLXP_CNTXT(2047)) {
-    val = regs.QRXFLXP_CNTXT[(addr - QRXFLXP_CNTXT(0)) / 4];
-  } else if (addr >= GLFLXP_RXDID_FLX_WRD_0(0) &&
-             addr <= GLFLXP_RXDID_FLX_WRD_0(63)){
-    size_t idx = (addr - GLFLXP_RXDID_FLX_WRD_0(0)) / 4;
-    regs.flex_rxdid_0[idx] = val;
-  } else if (addr >= GLFLXP_RXDID_FLX_WRD_1(0) &&
-             addr <= GLFLXP_RXDID_FLX_WRD_1(63)){
-    size_t idx = (addr - GLFLXP_RXDID_FLX_WRD_1(0)) / 4;
-    val = regs.flex_rxdid_1[idx];
-  } else if (addr >= GLFLXP_RXDID_FLX_WRD_2(0) &&
-             addr <= GLFLXP_RXDID_FLX_WRD_2(63)){
-    size_t idx = (addr - GLFLXP_RXDID_FLX_WRD_2(0)) / 4;
-    val = regs.flex_rxdid_2[idx];
-  } else if (addr >= GLFLXP_RXDID_FLX_WRD_3(0) &&
-             addr <= GLFLXP_RXDID_FLX_WRD_3(63)){
-    size_t idx = (addr - GLFLXP_RXDID_FLX_WRD_3(0)) / 4;
-    val = regs.flex_rxdid_3[idx];
-  } else if (addr >= GLFLXP_RXDID_FLAGS(0, 0) &&
-             addr <= GLFLXP_RXDID_FLAGS(63, 4)){
-    val = 0x16; // supported queue descriptor layout (used by dpdk ice_get_supported_rxdid())
-  } else if (addr >= GLPRT_BPRCL(0) && addr <= GLPRT_BPRCL(7)){
-    size_t idx = (addr - GLPRT_BPRCL(0))/8;
-    val = regs.GLPRT_BPRCL[idx];
-  } else if (addr >= GLPRT_BPTCL(0) && addr <= GLPRT_BPTCL(7)){
-    size_t idx = (addr - GLPRT_BPTCL(0))/8;
-    val = regs.GLPRT_BPTCL[idx];
-    } else if (addr >= GLPRT_CRCERRS(0) && addr <= GLPRT_CRCERRS(7)){
-    size_t idx = (addr - GLPRT_CRCERRS(0))/8;
-    val = regs.GLPRT_CRCERRS[idx];
-    } else if (addr >= GLPRT_GORCL(0) && addr <= GLPRT_GORCL(7)){
-    size_t idx = (addr - GLPRT_GORCL(0))/8;
-    val = regs.GLPRT_GORCL[idx];
-    } else if (addr >= GLPRT_GOTCL(0) && addr <= GLPRT_GOTCL(7)){
-    size_t idx = (addr - GLPRT_GOTCL(0))/8;
-    val = regs.GLPRT_GOTCL[idx];
-    } else if (addr >= GLPRT_ILLERRC(0) && addr <= GLPRT_ILLERRC(7)){
-    size_t idx = (addr - GLPRT_ILLERRC(0))/8;
-    val = regs.GLPRT_ILLERRC[idx];
-    } else if (addr >= GLPRT_LXOFFRXC(0) && addr <= GLPRT_LXOFFRXC(7)){
-    size_t idx = (addr - GLPRT_LXOFFRXC(0))/8;
-    val = regs.GLPRT_LXOFFRXC[idx];
-    } else if (addr >= GLPRT_LXOFFTXC(0) && addr <= GLPRT_LXOFFTXC(7)){
-    size_t idx = (addr - GLPRT_LXOFFTXC(0))/8;
-    val = regs.GLPRT_LXOFFTXC[idx];
-    } else if (addr >= GLPRT_LXONRXC(0) && addr <= GLPRT_LXONRXC(7)){
-    size_t idx = (addr - GLPRT_LXONRXC(0))/8;
-    val = regs.GLPRT_LXONRXC[idx];
-    } else if (addr >= GLPRT_LXONTXC(0) && addr <= GLPRT_LXONTXC(7)){
-    size_t idx = (addr - GLPRT_LXONTXC(0))/8;
-    val = regs.GLPRT_LXONTXC[idx];
-    } else if (addr >= GLPRT_MLFC(0) && addr <= GLPRT_MLFC(7)){
-    size_t idx = (addr - GLPRT_MLFC(0))/8;
-    val = regs.GLPRT_MLFC[idx];
-    } else if (addr >= GLPRT_MPRCL(0) && addr <= GLPRT_MPRCL(7)){
-    size_t idx = (addr - GLPRT_MPRCL(0))/8;
-    val = regs.GLPRT_MPRCL[idx];
-    } else if (addr >= GLPRT_MPTCL(0) && addr <= GLPRT_MPTCL(7)){
-    size_t idx = (addr - GLPRT_MPTCL(0))/8;
-    val = regs.GLPRT_MPTCL[idx];
-    } else if (addr >= GLPRT_MRFC(0) && addr <= GLPRT_MRFC(7)){
-    size_t idx = (addr - GLPRT_MRFC(0))/8;
-    val = regs.GLPRT_MRFC[idx];
-    } else if (addr >= GLPRT_PRC1023L(0) && addr <= GLPRT_PRC1023L(7)){
-    size_t idx = (addr - GLPRT_PRC1023L(0))/8;
-    val = regs.GLPRT_PRC1023L[idx];
-    } else if (addr >= GLPRT_PRC127L(0) && addr <= GLPRT_PRC127L(7)){
-    size_t idx = (addr - GLPRT_PRC127L(0))/8;
-    val = regs.GLPRT_PRC127L[idx];
-    } else if (addr >= GLPRT_PRC1522L(0) && addr <= GLPRT_PRC1522L(7)){
-    size_t idx = (addr - GLPRT_PRC1522L(0))/8;
-    val = regs.GLPRT_PRC1522L[idx];
-    } else if (addr >= GLPRT_PRC255L(0) && addr <= GLPRT_PRC255L(7)){
-    size_t idx = (addr - GLPRT_PRC255L(0))/8;
-    val = regs.GLPRT_PRC255L[idx];
-    } else if (addr >= GLPRT_PRC511L(0) && addr <= GLPRT_PRC511L(7)){
-    size_t idx = (addr - GLPRT_PRC511L(0))/8;
-    val = regs.GLPRT_PRC511L[idx];
-    } else if (addr >= GLPRT_PRC64L(0) && addr <= GLPRT_PRC64L(7)){
-    size_t idx = (addr - GLPRT_PRC64L(0))/8;
-    val = regs.GLPRT_PRC64L[idx];
-    } else if (addr >= GLPRT_PRC9522L(0) && addr <= GLPRT_PRC9522L(7)){
-    size_t idx = (addr - GLPRT_PRC9522L(0))/8;
-    val = regs.GLPRT_PRC9522L[idx];
-    } else if (addr >= GLPRT_PTC1023L(0) && addr <= GLPRT_PTC1023L(7)){
-    size_t idx = (addr - GLPRT_PTC1023L(0))/8;
-    val = regs.GLPRT_PTC1023L[idx];
-    } else if (addr >= GLPRT_PTC127L(0) && addr <= GLPRT_PTC127L(7)){
-    size_t idx = (addr - GLPRT_PTC127L(0))/8;
-    val = regs.GLPRT_PTC127L[idx];
-    } else if (addr >= GLPRT_PTC1522L(0) && addr <= GLPRT_PTC1522L(7)){
-    size_t idx = (addr - GLPRT_PTC1522L(0))/8;
-    val = regs.GLPRT_PTC1522L[idx];
-    } else if (addr >= GLPRT_PTC255L(0) && addr <= GLPRT_PTC255L(7)){
-    size_t idx = (addr - GLPRT_PTC255L(0))/8;
-    val = regs.GLPRT_PTC255L[idx];
-    } else if (addr >= GLPRT_PTC511L(0) && addr <= GLPRT_PTC511L(7)){
-    size_t idx = (addr - GLPRT_PTC511L(0))/8;
-    val = regs.GLPRT_PTC511L[idx];
-    } else if (addr >= GLPRT_PTC64L(0) && addr <= GLPRT_PTC64L(7)){
-    size_t idx = (addr - GLPRT_PTC64L(0))/8;
-    val = regs.GLPRT_PTC64L[idx];
-    } else if (addr >= GLPRT_PTC9522L(0) && addr <= GLPRT_PTC9522L(7)){
-    size_t idx = (addr - GLPRT_PTC9522L(0))/8;
-    val = regs.GLPRT_PTC9522L[idx];
-    } else if (addr >= GLPRT_RFC(0) && addr <= GLPRT_RFC(7)){
-    size_t idx = (addr - GLPRT_RFC(0))/8;
-    val = regs.GLPRT_RFC[idx];
-    } else if (addr >= GLPRT_RJC(0) && addr <= GLPRT_RJC(7)){
-    size_t idx = (addr - GLPRT_RJC(0))/8;
-    val = regs.GLPRT_RJC[idx];
-    } else if (addr >= GLPRT_RLEC(0) && addr <= GLPRT_RLEC(7)){
-    size_t idx = (addr - GLPRT_RLEC(0))/8;
-    val = regs.GLPRT_RLEC[idx];
-    } else if (addr >= GLPRT_ROC(0) && addr <= GLPRT_ROC(7)){
-    size_t idx = (addr - GLPRT_ROC(0))/8;
-    val = regs.GLPRT_ROC[idx];
-    } else if (addr >= GLPRT_RUC(0) && addr <= GLPRT_RUC(7)){
-    size_t idx = (addr - GLPRT_RUC(0))/8;
-    val = regs.GLPRT_RUC[idx];
-    } else if (addr >= GLPRT_TDOLD(0) && addr <= GLPRT_TDOLD(7)){
-    size_t idx = (addr - GLPRT_TDOLD(0))/8;
-    val = regs.GLPRT_TDOLD[idx];
-    } else if (addr >= GLPRT_UPRCL(0) && addr <= GLPRT_UPRCL(7)){
-    size_t idx = (addr - GLPRT_UPRCL(0))/8;
-    val = regs.GLPRT_UPRCL[idx];
-    } else if (addr >= GLPRT_UPRCL(0) && addr <= GLPRT_UPRCL(7)){
-    size_t idx = (addr - GLPRT_UPRCL(0))/8;
-    val = regs.GLPRT_UPRCL[idx];
-    } else if (addr >= GLV_BPRCL(0) && addr <= GLV_BPRCL(768)){
-    size_t idx = (addr - GLV_BPRCL(0))/8;
-    val = regs.GLV_BPRCL[idx];
-    } else if (addr >= GLV_BPTCL(0) && addr <= GLV_BPTCL(768)){
-    size_t idx = (addr - GLV_BPTCL(0))/8;
-    val = regs.GLV_BPTCL[idx];
-    } else if (addr >= GLV_GORCL(0) && addr <= GLV_GORCL(768)){
-    size_t idx = (addr - GLV_GORCL(0))/8;
-    val = regs.GLV_GORCL[idx];
-    } else if (addr >= GLV_GOTCL(0) && addr <= GLV_GOTCL(768)){
-    size_t idx = (addr - GLV_GOTCL(0))/8;
-    val = regs.GLV_GOTCL[idx];
-    } else if (addr >= GLV_MPRCL(0) && addr <= GLV_MPRCL(768)){
-    size_t idx = (addr - GLV_MPRCL(0))/8;
-    val = regs.GLV_MPRCL[idx];
-    } else if (addr >= GLV_MPTCL(0) && addr <= GLV_MPTCL(768)){
-    size_t idx = (addr - GLV_MPTCL(0))/8;
-    val = regs.GLV_MPTCL[idx];
-    } else if (addr >= GLV_RDPC(0) && addr <= GLV_RDPC(768)){
-    size_t idx = (addr - GLV_RDPC(0))/4;
-    val = regs.GLV_RDPC[idx];
-    } else if (addr >= GLV_TEPC(0) && addr <= GLV_TEPC(768)){
-    size_t idx = (addr - GLV_TEPC(0))/4;
-    val = regs.GLV_TEPC[idx];
-    } else if (addr >= GLV_UPRCL(0) && addr <= GLV_UPRCL(768)){
-    size_t idx = (addr - GLV_UPRCL(0))/8;
-    val = regs.GLV_UPRCL[idx];
-    } else if (addr >= GLV_UPTCL(0) && addr <= GLV_UPTCL(768)){
-    size_t idx = (addr - GLV_UPTCL(0))/8;
-    val = regs.GLV_UPTCL[idx];
+  const reg_range *range = reg_read_table().lookup(addr, idx);
+  if (range) {
+    switch (range->op) {
+      case REG_OP_RXDID_FLAGS:
+        val = 0x16; // supported queue descriptor layout (used by dpdk ice_get_supported_rxdid())
+        break;
+      case REG_OP_RSS_KEY:
+        val = regs.pfqf_hkey[idx / 1024];
+        break;
+      case REG_OP_RSS_LUT:
+        val = regs.vsiqf_hlut[idx / 1024];
+        break;
+      case REG_OP_RSS_HASH_CTL:
+        val = regs.vsiqf_hash_ctl;
+        break;
+      default:
+        val = reg_array(*range)[idx];
+        break;
+    }
   }
   else {
     switch (addr) {
@@ -402,6 +247,9 @@ uint32_t e810_bm::reg_mem_read32(uint64_t addr) {
       case PFGEN_CTRL:
         val = 0; /* we always simulate immediate reset */
         break;
+      case PFQF_HLUT_SIZE:
+        val = regs.pfqf_hlut_size;
+        break;
 
       // case I40E_GL_FWSTS:
       //   val = 0;
@@ -653,222 +501,77 @@ uint32_t e810_bm::reg_mem_read32(uint64_t addr) {
   return val;
 }
 
-void e810_bm::reg_mem_write32(uint64_t addr, uint32_t val) {
-  if (addr >= GLINT_DYN_CTL(0) &&
-    addr <= GLINT_DYN_CTL(NUM_PFINTS - 1)) {
-    regs.pfint_dyn_ctln[(addr - GLINT_DYN_CTL(0)) / 4] = val;
-  } else if (addr >= QTX_COMM_DBELL(0) && addr <= QTX_COMM_DBELL(2047)){
-      size_t idx = (addr - QTX_COMM_DBELL(0))/4;
+bool e810_bm::reg_write_datapath(const reg_range &range, uint32_t idx, uint32_t val) {
+  switch (range.op) {
+    case REG_OP_TX_DOORBELL: {
+      std::shared_lock ctrl(ctrl_mutex);
+      std::lock_guard queue(lanmgr.queue_mutex(idx, false));
       regs.QTX_COMM_DBELL[idx] = val;
       regs.qtx_tail[idx] = val;
       lanmgr.tail_updated(idx, false);
-  } else if (addr >= QRX_TAIL(0) &&
-             addr <= QRX_TAIL(256 - 1)) {
-      size_t idx = (addr - QRX_TAIL(0)) / 4;
+      return true;
+    }
+    case REG_OP_RX_TAIL: {
+      std::shared_lock ctrl(ctrl_mutex);
+      std::lock_guard queue(lanmgr.queue_mutex(idx, true));
       regs.qrx_tail[idx] = val & QRX_TAIL_TAIL_M;
       lanmgr.tail_updated(idx, true);
-  } else if (addr >= QRX_CTRL(0) && addr <= QRX_CTRL(2047)){
-    size_t idx = (addr - QRX_CTRL(0)) / 4;
-    regs.QRX_CTRL[idx] = val+4; // set queue enable status bit (given it was 0 before)
-    regs.qrx_ena[idx] = val;
-    lanmgr.qena_updated(idx, true);
-    printf("QRX_CTRL[%zu] write %d\n", idx, val);
-  } else if (addr >= PF0INT_ITR_0(0) &&
-             addr <= PF0INT_ITR_0(2047)) {
-    regs.pfint_itrn[0][(addr - PF0INT_ITR_0(0)) / 4096] = val;
-  } else if (addr >= PF0INT_ITR_1(0) &&
-             addr <= PF0INT_ITR_1(2047)) {
-    regs.pfint_itrn[1][(addr - PF0INT_ITR_1(0)) / 4096] = val;
-  } else if (addr >= PF0INT_ITR_2(0) &&
-             addr <= PF0INT_ITR_2(2047)) {
-    regs.pfint_itrn[2][(addr - PF0INT_ITR_2(0)) / 4096] = val;
-  } else if (addr >= QINT_TQCTL(0) &&
-             addr <= QINT_TQCTL(16383)) {
-    size_t idx = (addr - QINT_TQCTL(0)) / 4;
-    regs.qint_tqctl[idx] = val;
-    lanmgr.qena_updated(idx, false);
-  } else if (addr >= QINT_RQCTL(0) &&
-             addr <= QINT_RQCTL(2048 - 1)) {
-    size_t idx = (addr - QINT_RQCTL(0)) / 4;
-    regs.qint_rqctl[idx] = val;
-  } else if (addr >= GLINT_CEQCTL(0) && addr <= GLINT_CEQCTL(2018-1)) {
-    uint16_t idx = (addr - GLINT_CEQCTL(0)) / 4;
-    regs.glint_ceqctl[idx] = val;
-    cem.qena_updated(idx);
-  } else if (addr >= GLINT_ITR(0, 0) && addr <= GLINT_ITR(0, 2047)) {
-    regs.GLINT_ITR0[(addr - GLINT_ITR(0,0)) / 4] = val;
-  } else if (addr >= GLINT_ITR(1, 0) && addr <= GLINT_ITR(1, 2047)) {
-    regs.GLINT_ITR1[(addr - GLINT_ITR(1,0)) / 4] = val;
-  } else if (addr >= GLINT_ITR(2, 0) && addr <= GLINT_ITR(2, 2047)) {
-    regs.GLINT_ITR2[(addr - GLINT_ITR(2,0)) / 4] = val;
-  } else if (addr >= QRX_CONTEXT(0, 0) && addr < QRX_CONTEXT(8, 2048)) {
-    int index = (addr - QRX_CONTEXT(0,0));
-    regs.QRX_CONTEXT[index / 4] = val; // byte offset / 4 = uint32_t* offset
-    // #ifdef DEBUG_DEV
-      // int q_idx = ((index * 4) % 8192) / 4;
-      // int ctx_reg = (q_idx == 0) ? (index) : (index % (q_idx * 8192));
-      int q_idx = (index % 8192) / 4;
-      int ctx_reg = index / 8192;
-      printf("write QRX_CONTEXT(%d, %d) val %x\n", ctx_reg, q_idx, val);
-    // #endif
-  } else if (addr >= QRXFLXP_CNTXT(0) && addr <= QRXFLXP_CNTXT(2047)) {
-    regs.QRXFLXP_CNTXT[(addr - QRXFLXP_CNTXT(0)) / 4] = val;
-  } else if (addr >= GLFLXP_RXDID_FLX_WRD_0(0) &&
-             addr <= GLFLXP_RXDID_FLX_WRD_0(63)){
-    size_t idx = (addr - GLFLXP_RXDID_FLX_WRD_0(0)) / 4;
-    regs.flex_rxdid_0[idx] = val;
-  } else if (addr >= GLFLXP_RXDID_FLX_WRD_1(0) &&
-             addr <= GLFLXP_RXDID_FLX_WRD_1(63)){
-    size_t idx = (addr - GLFLXP_RXDID_FLX_WRD_1(0)) / 4;
-    regs.flex_rxdid_1[idx] = val;
-  } else if (addr >= GLFLXP_RXDID_FLX_WRD_2(0) &&
-             addr <= GLFLXP_RXDID_FLX_WRD_2(63)){
-    size_t idx = (addr - GLFLXP_RXDID_FLX_WRD_2(0)) / 4;
-    regs.flex_rxdid_2[idx] = val;
-  } else if (addr >= GLFLXP_RXDID_FLX_WRD_3(0) &&
-             addr <= GLFLXP_RXDID_FLX_WRD_3(63)){
-    size_t idx = (addr - GLFLXP_RXDID_FLX_WRD_3(0)) / 4;
-    regs.flex_rxdid_3[idx] = val;
-
-  } else if (addr >= GLPRT_BPRCL(0) && addr <= GLPRT_BPRCL(7)){
-    size_t idx = (addr - GLPRT_BPRCL(0))/8;
-    regs.GLPRT_BPRCL[idx] = val;
-  } else if (addr >= GLPRT_BPTCL(0) && addr <= GLPRT_BPTCL(7)){
-    size_t idx = (addr - GLPRT_BPTCL(0))/8;
-    regs.GLPRT_BPTCL[idx] = val;
-    } else if (addr >= GLPRT_CRCERRS(0) && addr <= GLPRT_CRCERRS(7)){
-    size_t idx = (addr - GLPRT_CRCERRS(0))/8;
-    regs.GLPRT_CRCERRS[idx] = val;
-    } else if (addr >= GLPRT_GORCL(0) && addr <= GLPRT_GORCL(7)){
-    size_t idx = (addr - GLPRT_GORCL(0))/8;
-    regs.GLPRT_GORCL[idx] = val;
-    } else if (addr >= GLPRT_GOTCL(0) && addr <= GLPRT_GOTCL(7)){
-    size_t idx = (addr - GLPRT_GOTCL(0))/8;
-    regs.GLPRT_GOTCL[idx] = val;
-    } else if (addr >= GLPRT_ILLERRC(0) && addr <= GLPRT_ILLERRC(7)){
-    size_t idx = (addr - GLPRT_ILLERRC(0))/8;
-    regs.GLPRT_ILLERRC[idx] = val;
-    } else if (addr >= GLPRT_LXOFFRXC(0) && addr <= GLPRT_LXOFFRXC(7)){
-    size_t idx = (addr - GLPRT_LXOFFRXC(0))/8;
-    regs.GLPRT_LXOFFRXC[idx] = val;
-    } else if (addr >= GLPRT_LXOFFTXC(0) && addr <= GLPRT_LXOFFTXC(7)){
-    size_t idx = (addr - GLPRT_LXOFFTXC(0))/8;
-    regs.GLPRT_LXOFFTXC[idx] = val;
-    } else if (addr >= GLPRT_LXONRXC(0) && addr <= GLPRT_LXONRXC(7)){
-    size_t idx = (addr - GLPRT_LXONRXC(0))/8;
-    regs.GLPRT_LXONRXC[idx] = val;
-    } else if (addr >= GLPRT_LXONTXC(0) && addr <= GLPRT_LXONTXC(7)){
-    size_t idx = (addr - GLPRT_LXONTXC(0))/8;
-    regs.GLPRT_LXONTXC[idx] = val;
-    } else if (addr >= GLPRT_MLFC(0) && addr <= GLPRT_MLFC(7)){
-    size_t idx = (addr - GLPRT_MLFC(0))/8;
-    regs.GLPRT_MLFC[idx] = val;
-    } else if (addr >= GLPRT_MPRCL(0) && addr <= GLPRT_MPRCL(7)){
-    size_t idx = (addr - GLPRT_MPRCL(0))/8;
-    regs.GLPRT_MPRCL[idx] = val;
-    } else if (addr >= GLPRT_MPTCL(0) && addr <= GLPRT_MPTCL(7)){
-    size_t idx = (addr - GLPRT_MPTCL(0))/8;
-    regs.GLPRT_MPTCL[idx] = val;
-    } else if (addr >= GLPRT_MRFC(0) && addr <= GLPRT_MRFC(7)){
-    size_t idx = (addr - GLPRT_MRFC(0))/8;
-    regs.GLPRT_MRFC[idx] = val;
-    } else if (addr >= GLPRT_PRC1023L(0) && addr <= GLPRT_PRC1023L(7)){
-    size_t idx = (addr - GLPRT_PRC1023L(0))/8;
-    regs.GLPRT_PRC1023L[idx] = val;
-    } else if (addr >= GLPRT_PRC127L(0) && addr <= GLPRT_PRC127L(7)){
-    size_t idx = (addr - GLPRT_PRC127L(0))/8;
-    regs.GLPRT_PRC127L[idx] = val;
-    } else if (addr >= GLPRT_PRC1522L(0) && addr <= GLPRT_PRC1522L(7)){
-    size_t idx = (addr - GLPRT_PRC1522L(0))/8;
-    regs.GLPRT_PRC1522L[idx] = val;
-    } else if (addr >= GLPRT_PRC255L(0) && addr <= GLPRT_PRC255L(7)){
-    size_t idx = (addr - GLPRT_PRC255L(0))/8;
-    regs.GLPRT_PRC255L[idx] = val;
-    } else if (addr >= GLPRT_PRC511L(0) && addr <= GLPRT_PRC511L(7)){
-    size_t idx = (addr - GLPRT_PRC511L(0))/8;
-    regs.GLPRT_PRC511L[idx] = val;
-    } else if (addr >= GLPRT_PRC64L(0) && addr <= GLPRT_PRC64L(7)){
-    size_t idx = (addr - GLPRT_PRC64L(0))/8;
-    regs.GLPRT_PRC64L[idx] = val;
-    } else if (addr >= GLPRT_PRC9522L(0) && addr <= GLPRT_PRC9522L(7)){
-    size_t idx = (addr - GLPRT_PRC9522L(0))/8;
-    regs.GLPRT_PRC9522L[idx] = val;
-    } else if (addr >= GLPRT_PTC1023L(0) && addr <= GLPRT_PTC1023L(7)){
-    size_t idx = (addr - GLPRT_PTC1023L(0))/8;
-    regs.GLPRT_PTC1023L[idx] = val;
-    } else if (addr >= GLPRT_PTC127L(0) && addr <= GLPRT_PTC127L(7)){
-    size_t idx = (addr - GLPRT_PTC127L(0))/8;
-    regs.GLPRT_PTC127L[idx] = val;
-    } else if (addr >= GLPRT_PTC1522L(0) && addr <= GLPRT_PTC1522L(7)){
-    size_t idx = (addr - GLPRT_PTC1522L(0))/8;
-    regs.GLPRT_PTC1522L[idx] = val;
-    } else if (addr >= GLPRT_PTC255L(0) && addr <= GLPRT_PTC255L(7)){
-    size_t idx = (addr - GLPRT_PTC255L(0))/8;
-    regs.GLPRT_PTC255L[idx] = val;
-    } else if (addr >= GLPRT_PTC511L(0) && addr <= GLPRT_PTC511L(7)){
-    size_t idx = (addr - GLPRT_PTC511L(0))/8;
-    regs.GLPRT_PTC511L[idx] = val;
-    } else if (addr >= GLPRT_PTC64L(0) && addr <= GLPRT_PTC64L(7)){
-    size_t idx = (addr - GLPRT_PTC64L(0))/8;
-    regs.GLPRT_PTC64L[idx] = val;
-    } else if (addr >= GLPRT_PTC9522L(0) && addr <= GLPRT_PTC9522L(7)){
-    size_t idx = (addr - GLPRT_PTC9522L(0))/8;
-    regs.GLPRT_PTC9522L[idx] = val;
-    } else if (addr >= GLPRT_RFC(0) && addr <= GLPRT_RFC(7)){
-    size_t idx = (addr - GLPRT_RFC(0))/8;
-    regs.GLPRT_RFC[idx] = val;
-    } else if (addr >= GLPRT_RJC(0) && addr <= GLPRT_RJC(7)){
-    size_t idx = (addr - GLPRT_RJC(0))/8;
-    regs.GLPRT_RJC[idx] = val;
-    } else if (addr >= GLPRT_RLEC(0) && addr <= GLPRT_RLEC(7)){
-    size_t idx = (addr - GLPRT_RLEC(0))/8;
-    regs.GLPRT_RLEC[idx] = val;
-    } else if (addr >= GLPRT_ROC(0) && addr <= GLPRT_ROC(7)){
-    size_t idx = (addr - GLPRT_ROC(0))/8;
-    regs.GLPRT_ROC[idx] = val;
-    } else if (addr >= GLPRT_RUC(0) && addr <= GLPRT_RUC(7)){
-    size_t idx = (addr - GLPRT_RUC(0))/8;
-    regs.GLPRT_RUC[idx] = val;
-    } else if (addr >= GLPRT_TDOLD(0) && addr <= GLPRT_TDOLD(7)){
-    size_t idx = (addr - GLPRT_TDOLD(0))/8;
-    regs.GLPRT_TDOLD[idx] = val;
-    } else if (addr >= GLPRT_UPRCL(0) && addr <= GLPRT_UPRCL(7)){
-    size_t idx = (addr - GLPRT_UPRCL(0))/8;
-    regs.GLPRT_UPRCL[idx] = val;
-    } else if (addr >= GLPRT_UPRCL(0) && addr <= GLPRT_UPRCL(7)){
-    size_t idx = (addr - GLPRT_UPRCL(0))/8;
-    regs.GLPRT_UPRCL[idx] = val;
-    } else if (addr >= GLV_BPRCL(0) && addr <= GLV_BPRCL(7)){
-    size_t idx = (addr - GLV_BPRCL(0))/8;
-    regs.GLV_BPRCL[idx] = val;
-    } else if (addr >= GLV_BPTCL(0) && addr <= GLV_BPTCL(7)){
-    size_t idx = (addr - GLV_BPTCL(0))/8;
-    regs.GLV_BPTCL[idx] = val;
-    } else if (addr >= GLV_GORCL(0) && addr <= GLV_GORCL(7)){
-    size_t idx = (addr - GLV_GORCL(0))/8;
-    regs.GLV_GORCL[idx] = val;
-    } else if (addr >= GLV_GOTCL(0) && addr <= GLV_GOTCL(7)){
-    size_t idx = (addr - GLV_GOTCL(0))/8;
-    regs.GLV_GOTCL[idx] = val;
-    } else if (addr >= GLV_MPRCL(0) && addr <= GLV_MPRCL(7)){
-    size_t idx = (addr - GLV_MPRCL(0))/8;
-    regs.GLV_MPRCL[idx] = val;
-    } else if (addr >= GLV_MPTCL(0) && addr <= GLV_MPTCL(7)){
-    size_t idx = (addr - GLV_MPTCL(0))/8;
-    regs.GLV_MPTCL[idx] = val;
-    } else if (addr >= GLV_RDPC(0) && addr <= GLV_RDPC(7)){
-    size_t idx = (addr - GLV_RDPC(0))/4;
-    regs.GLV_RDPC[idx] = val;
-    } else if (addr >= GLV_TEPC(0) && addr <= GLV_TEPC(7)){
-    size_t idx = (addr - GLV_TEPC(0))/4;
-    regs.GLV_TEPC[idx] = val;
-    } else if (addr >= GLV_UPRCL(0) && addr <= GLV_UPRCL(7)){
-    size_t idx = (addr - GLV_UPRCL(0))/8;
-    regs.GLV_UPRCL[idx] = val;
-    } else if (addr >= GLV_UPTCL(0) && addr <= GLV_UPTCL(7)){
-    size_t idx = (addr - GLV_UPTCL(0))/8;
-    regs.GLV_UPTCL[idx] = val;
-    } else {
+      return true;
+    }
+    case REG_OP_DYN_CTL: {
+      std::shared_lock ctrl(ctrl_mutex);
+      std::lock_guard vector(intevs[idx].mutex);
+      regs.pfint_dyn_ctln[idx] = val;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+void e810_bm::reg_mem_write32(uint64_t addr, uint32_t val) {
+  uint32_t idx;
+
+  const reg_range *range = reg_write_table().lookup(addr, idx);
+  if (range && reg_write_datapath(*range, idx, val))
+    return;
+
+  std::unique_lock ctrl(ctrl_mutex);
+  if (range) {
+    switch (range->op) {
+      case REG_OP_RX_CTRL:
+        regs.QRX_CTRL[idx] = val+4; // set queue enable status bit (given it was 0 before)
+        regs.qrx_ena[idx] = val;
+        lanmgr.qena_updated(idx, true);
+        printf("QRX_CTRL[%u] write %d\n", idx, val);
+        break;
+      case REG_OP_TQCTL:
+        regs.qint_tqctl[idx] = val;
+        lanmgr.qena_updated(idx, false);
+        break;
+      case REG_OP_CEQCTL:
+        regs.glint_ceqctl[idx] = val;
+        cem.qena_updated(idx);
+        break;
+      case REG_OP_RX_CONTEXT:
+        regs.QRX_CONTEXT[idx] = val;
+        printf("write QRX_CONTEXT(%u, %u) val %x\n", idx / 2048, idx % 2048, val);
+        break;
+      case REG_OP_RSS_KEY:
+        regs.pfqf_hkey[idx / 1024] = val;
+        lanmgr.rss_key_updated();
+        break;
+      case REG_OP_RSS_LUT:
+        regs.vsiqf_hlut[idx / 1024] = val;
+        break;
+      case REG_OP_RSS_HASH_CTL:
+        regs.vsiqf_hash_ctl = val;
+        break;
+      default:
+        reg_array(*range)[idx] = val;
+        break;
+    }
+  } else {
       #ifdef DEBUG_DEV
         std::cout << "write others " << addr << logger::endl;
         std::cout << "write others value " << val << logger::endl;
@@ -916,6 +619,10 @@ void e810_bm::reg_mem_write32(uint64_t addr, uint32_t val) {
         regs.glint_ctl = val;
         break;
 
+      case PFQF_HLUT_SIZE:
+        regs.pfqf_hlut_size = val;
+        break;
+
       case GLGEN_RSTCTL:
         regs.glgen_rstctl = val;
         break;
@@ -1230,6 +937,37 @@ void e810_bm::reset(bool indicate_done) {
   regs.glrpb_ghw = 0xF2000;
   regs.glrpb_phw = 0x1246;
   regs.glrpb_plw = 0x0846;
+
+  reg_mirror_sync();
+}
+
+const std::vector<std::pair<uint64_t, uint64_t>> &e810_bm::reg_mirror_ranges() {
+#define E810_MIRROR_RANGE(reg, nb_pages) \
+  {reg(0), (uint64_t)(nb_pages) << reg_table::PAGE_SHIFT},
+  static const std::vector<std::pair<uint64_t, uint64_t>> ranges = {
+    E810_MIRROR_PAGES(E810_MIRROR_RANGE)
+  };
+#undef E810_MIRROR_RANGE
+  return ranges;
+}
+
+void e810_bm::set_reg_mirror(uint8_t *mirror) {
+  reg_mirror = mirror;
+  reg_mirror_sync();
+}
+
+// Copy what trapped reads would return into the mirror. Must be called
+// whenever the model changes one of the mirrored registers: currently only on
+// reset, since the model does not count statistics.
+void e810_bm::reg_mirror_sync() {
+  if (!reg_mirror)
+    return;
+  for (auto &[offset, len] : reg_mirror_ranges()) {
+    for (uint64_t addr = offset; addr < offset + len; addr += 4) {
+      uint32_t val = reg_mem_read32(addr);
+      memcpy(reg_mirror + addr, &val, sizeof(val));
+    }
+  }
 }
 
 shadow_ram::shadow_ram(e810_bm &dev_) : dev(dev_), log("sram", dev_.runner_) {
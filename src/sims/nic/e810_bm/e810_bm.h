@@ -25,10 +25,18 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 
 #include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 extern "C" {
 #include <src/libsimbricks/simbricks/pcie/proto.h>
 }
@@ -37,6 +45,7 @@ extern "C" {
 #include "sims/nic/e810_bm/e810_base_wrapper.h"
 #include "sims/nic/e810_bm/e810_bm.h"
 #include "sims/nic/e810_bm/e810_ptp.h"
+#include "sims/nic/e810_bm/reg_table.h"
 
 // #define DEBUG_DEV
 // #define DEBUG_ADMINQ
@@ -65,6 +74,8 @@ class int_ev : public nicbm::TimedEvent {
  public:
   uint16_t vec;
   bool armed;
+  // serializes signaling the vector with writes to its GLINT_DYN_CTL
+  std::mutex mutex;
 
   int_ev();
 };
@@ -91,6 +102,24 @@ class logger : public std::ostream {
   logger &operator<<(void *str);
 };
 
+/**
+ * Cache of equally sized memory chunks. Freed chunks are kept for reuse
+ * instead of going back to the heap, up to max_cached of them. Chunks are
+ * allocated lazily, so unused queues do not cost memory.
+ */
+class slab_cache {
+ protected:
+  size_t obj_size;
+  size_t max_cached;
+  std::vector<void *> free_objs;
+
+ public:
+  slab_cache(size_t obj_size_, size_t max_cached_);
+  ~slab_cache();
+  void *alloc();
+  void free(void *obj);
+};
+
 /**
  * Base-class for descriptor queues (RX/TX, Admin RX/TX).
  *
@@ -150,6 +179,9 @@ class queue_base {
     void data_fetch(uint64_t addr, size_t len);
     virtual void data_fetched(uint64_t addr, size_t len);
     void data_write(uint64_t addr, size_t len, const void *buf);
+    // like data_write, but copies buf to the guest without a dma_data_wb
+    // buffer: buf only needs to stay valid during the call
+    void data_write_direct(uint64_t addr, size_t len, const void *buf);
     virtual void data_written(uint64_t addr, size_t len);
 
    public:
@@ -213,6 +245,17 @@ class queue_base {
  protected:
   e810_bm &dev;
   desc_ctx *desc_ctxs[MAX_ACTIVE_DESCS];
+
+  // recycled memory for the dma ops above and their payload buffers
+  slab_cache dma_op_cache;
+  slab_cache dma_buf_cache;
+  void *dma_buf_alloc(size_t len);
+  void dma_buf_free(void *buf, size_t len);
+  template <class T>
+  void dma_op_release(T *op) {
+    op->~T();
+    dma_op_cache.free(op);
+  }
   uint32_t active_first_pos;
   uint32_t active_first_idx;
   uint32_t active_cnt;
@@ -226,6 +269,8 @@ class queue_base {
 
 
   bool enabled;
+  // hold back descriptor writebacks (and thus interrupts) until cleared
+  bool wb_deferred;
   size_t desc_len;
 
   void ctxs_init();
@@ -594,6 +639,9 @@ class lan_queue_base : public queue_base {
 
   uint32_t reg_dummy_head;
 
+  // protects the ring state of this queue (see e810_bm::ctrl_mutex)
+  std::mutex mutex;
+
   lan_queue_base(lan &lanmgr_, const std::string &qtype, uint32_t &reg_tail,
                  size_t idx_, uint32_t &reg_ena_, uint32_t &fpm_basereg,
                  uint32_t &reg_intqctl, uint16_t ctx_size);
@@ -605,7 +653,7 @@ class lan_queue_base : public queue_base {
 
 class lan_queue_tx : public lan_queue_base {
  protected:
-  static const uint16_t MTU = 9024;
+  static const uint16_t MTU = 9728;
 
   class tx_desc_ctx : public desc_ctx {
    protected:
@@ -668,7 +716,8 @@ class lan_queue_rx : public lan_queue_base {
    public:
     explicit rx_desc_ctx(lan_queue_rx &queue_);
     virtual void process();
-    void packet_received(const void *data, size_t len, e810_timestamp_t timestamp, bool last);
+    void packet_received(const void *data, size_t len, e810_timestamp_t timestamp, bool last,
+                         const Driver::RxMeta &meta);
 
  };
 
@@ -687,25 +736,33 @@ class lan_queue_rx : public lan_queue_base {
                uint32_t &fpm_basereg, uint32_t &reg_intqctl);
 
   virtual void reset();
-  void packet_received(const void *data, size_t len, uint32_t hash);
+  void packet_received(const void *data, size_t len, const Driver::RxMeta &meta);
   bool ptp_should_sample_rx(const void *data, size_t len);
+  // Packets received between burst_begin() and burst_end() are written back
+  // with one descriptor writeback and signaled with one interrupt, unless
+  // the burst needs more than MAX_ACTIVE_DESCS descriptors.
+  bool in_burst() const { return wb_deferred; }
+  void burst_begin();
+  void burst_end();
 };
 
 class rss_key_cache {
  protected:
   static const size_t key_len = 52;
-  // big enough for 2x ipv6 (2x128 + 2x16)
-  static const size_t cache_len = 288;
+  // longest hash input: 2x ipv6 address + 2x port
+  static const size_t max_input_len = 36;
   bool cache_dirty;
   const uint32_t (&key)[key_len / 4];
-  uint32_t cache[cache_len];
+  // cache[i][b] is the hash of byte value b at offset i of the input
+  uint32_t cache[max_input_len][256];
 
   void build();
 
  public:
   explicit rss_key_cache(const uint32_t (&key_)[key_len / 4]);
   void set_dirty();
-  uint32_t hash_ipv4(uint32_t sip, uint32_t dip, uint16_t sp, uint16_t dp);
+  // Toeplitz hash of up to max_input_len bytes in network byte order
+  uint32_t hash(const uint8_t *input, size_t len);
 };
 
 // rx tx management
@@ -721,18 +778,34 @@ class lan {
   const size_t num_qs;
   lan_queue_rx **rxqs;
   lan_queue_tx **txqs;
-  size_t rss_last_queue = -1; // may be used to serve queues in round robin fashion. Consumers shall wrap to MIN_QUEUE value if this exceeds MAX_QUEUE value.
+
+  struct rx_burst_entry {
+    uint16_t queue;
+    Driver::RxMeta meta;
+  };
+  // reused by packets_received() to avoid allocations per burst
+  std::vector<rx_burst_entry> rx_burst;
+  std::vector<lan_queue_rx *> rx_burst_queues;
 
   bool rss_steering(const void *data, size_t len, uint16_t &queue,
                     uint32_t &hash);
+  uint16_t rss_lut_lookup(uint32_t hash);
+  bool rx_select_queue(const void *data, size_t len, std::optional<uint16_t> queue_hint,
+                       uint16_t &queue, Driver::RxMeta &rx_meta);
 
  public:
   lan(e810_bm &dev, size_t num_qs);
   void reset();
   void qena_updated(uint16_t idx, bool rx);
   void tail_updated(uint16_t idx, bool rx);
+  std::mutex &queue_mutex(uint16_t idx, bool rx);
   void rss_key_updated();
-  void packet_received(const void *data, size_t len, std::optional<uint16_t> queue_hint);
+  void set_rss_key(const void *key, size_t len);
+  void set_rss_lut(uint16_t flags, const void *lut, size_t len);
+  void vsi_updated(const struct ice_aqc_vsi_props &props);
+  void packet_received(const void *data, size_t len, std::optional<uint16_t> queue_hint,
+                       const Driver::RxMeta *meta);
+  void packets_received(const std::vector<nicbm::Runner::Device::EthFrame> &frames);
 };
 
 class completion_event_manager {
@@ -766,19 +839,81 @@ class shadow_ram {
 };
 
 class e810_switch {
-  std::map<uint64_t, uint16_t> mac_rules; // dst mac address (odd alignment/byte order...) -> dst queue idx
+  // header bytes a recipe can match on
+  static const size_t HDR_LEN = 56;
+  static const size_t FLOW_CACHE_SIZE = 512;
+
+  // masked header bytes at the offsets a recipe (or the flow cache) looks at
+  struct match_key {
+    uint8_t len;
+    uint8_t bytes[HDR_LEN];
+
+    bool operator==(const match_key &other) const {
+      return len == other.len && memcmp(bytes, other.bytes, len) == 0;
+    }
+  };
+  struct match_key_hash {
+    size_t operator()(const match_key &key) const {
+      return std::hash<std::string_view>()(std::string_view(
+          reinterpret_cast<const char *>(key.bytes), key.len));
+    }
+  };
+  struct rule_action {
+    uint32_t prio; // order the rule was added in. The first matching rule wins.
+    uint16_t queue;
+    uint16_t id; // rule index reported to the driver
+  };
+  // a rule as added by the driver, to find it again on removal
+  struct installed_rule {
+    uint16_t recipe;
+    match_key key;
+    rule_action action;
+    uint16_t etype;
+    bool offloaded; // the driver steers matching packets as well
+  };
+  // all rules of one recipe: one hash lookup per recipe (tuple space search)
+  struct rule_tuple {
+    std::vector<uint8_t> offsets; // bytes with a non-zero mask
+    std::vector<uint8_t> masks;
+    std::unordered_map<match_key, rule_action, match_key_hash> rules;
+  };
+  // exact match cache of classification results, including misses
+  struct flow_cache_entry {
+    uint64_t generation; // valid if equal to rules_generation
+    match_key key;
+    bool hit;
+    uint16_t queue;
+  };
+
+  std::unordered_map<uint64_t, uint16_t> mac_rules; // dst mac address (odd alignment/byte order...) -> dst queue idx
   std::map<uint16_t, uint16_t> ethertype_rules; // ethertype -> dst queue idx
-  std::vector<std::vector<uint8_t>*> rules; // list of (recipe idx, match data)
-  std::vector<uint16_t> rules_recipe_idx; // rules*[i] is for recipes[recipe_idx[i]]
-  std::vector<uint16_t> rules_dst_queues; // rules*[i] is for recipes[recipe_idx[i]]
+  std::vector<rule_tuple> tuples; // tuples[i] holds the rules for recipies[i]
+  std::unordered_map<uint16_t, installed_rule> rules_by_id;
+  uint32_t nb_rules = 0;
+  uint16_t next_rule_id = 0;
   std::vector<std::vector<uint8_t>> recipies;
   // recipe to only match ethertype:
   std::vector<uint8_t> recipe1 = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  // union of the bytes of all recipes and the dst mac (for mac_rules)
+  std::vector<uint8_t> flow_offsets;
+  std::vector<uint8_t> flow_masks;
+  std::vector<flow_cache_entry> flow_cache;
+  // Rules only change under the exclusive e810_bm::ctrl_mutex, but
+  // select_queue() runs under the shared one and fills the cache. Receivers
+  // that find the cache taken classify without it.
+  std::mutex flow_cache_mutex;
+  uint64_t rules_generation = 1;
   e810_bm &dev;
 
+  void add_recipe(const std::vector<uint8_t> &mask);
+  bool classify(const uint8_t *data, size_t len, uint16_t *queue);
+  static void mask_key(match_key &key, const std::vector<uint8_t> &offsets,
+                       const std::vector<uint8_t> &masks, const uint8_t *data,
+                       size_t len);
+
   public:
 
-  e810_switch(e810_bm &dev_) : dev(dev_) {
+  e810_switch(e810_bm &dev_) : flow_cache(FLOW_CACHE_SIZE), dev(dev_) {
    size_t excess_rules = 0;
    for (size_t i = 0; i < excess_rules; i++) {
     uint64_t mac = Util::rand();
@@ -786,18 +921,15 @@ class e810_switch {
    }
 
    // our default recipe
-   this->recipies.push_back(this->recipe1);
+   this->add_recipe(this->recipe1);
   };
 
-  ~e810_switch() {
-   for (auto rule : this->rules) {
-    delete rule;
-   }
-  }
-
+  // sets the rule index of add_sw_rules if the model classifies by the rule
   bool add_rule(struct ice_aqc_sw_rules_elem *add_sw_rules);
+  // remove the rule with the index returned by add_rule()
+  bool del_rule(uint16_t rule_id);
 
-  void select_queue(const void* data, size_t len, uint16_t* queue);
+  bool select_queue(const void* data, size_t len, uint16_t* queue);
 
   static void print_sw_rule(struct ice_aqc_sw_rules_elem *add_sw_rules);
 };
@@ -823,11 +955,12 @@ class e810_bm : public nicbm::Runner::Device {
   static const uint32_t NUM_QUEUES = 1536;
   static const uint32_t NUM_PFINTS = 2048;
   static const uint32_t NUM_VSIS = 383;
-  static const uint16_t MAX_MTU = 2048;
+  static const uint16_t MAX_MTU = 9728; // max frame size, like the real E810
   static const uint8_t NUM_ITR = 3;
   static const uint32_t NUM_RXDID = 64;
   static const uint16_t NUM_FD_GUAR = 8192;
   static const uint16_t NUM_FD_BEST_EFFORT = 8192;
+  static const uint64_t BAR_REGS_LEN = 64 * 1024 * 1024;
 
 
   struct e810_regs {
@@ -895,8 +1028,12 @@ class e810_bm : public nicbm::Runner::Device {
 
     uint32_t pfqf_ctl_0;
 
-    uint32_t pfqf_hkey[13];
-    uint32_t pfqf_hlut[128];
+    // RSS configuration of the (single) VSI, see lan::rss_steering
+    uint32_t pfqf_hkey[VSIQF_HKEY_MAX_INDEX + 1];
+    uint32_t pfqf_hlut[PFQF_HLUT_MAX_INDEX + 1];
+    uint32_t pfqf_hlut_size;
+    uint32_t vsiqf_hlut[VSIQF_HLUT_MAX_INDEX + 1];
+    uint32_t vsiqf_hash_ctl;
 
     uint32_t prtdcb_fccfg;
     uint32_t prtdcb_mflcn;
@@ -1024,15 +1161,31 @@ class e810_bm : public nicbm::Runner::Device {
                 size_t len) override;
   virtual void RegWrite32(uint8_t bar, uint64_t addr, uint32_t val);
   void DmaComplete(nicbm::DMAOp &op) override;
-  void EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len) override;
+  void EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len,
+             const Driver::RxMeta *meta = nullptr) override;
+  void EthRxBurst(uint8_t port, const std::vector<EthFrame> &frames) override;
   void Timed(nicbm::TimedEvent &ev) override;
   e810_timestamp_t ReadCurrentTimestamp();
 
   virtual void SignalInterrupt(uint16_t vector, uint8_t itr);
 
+  /** Page aligned {offset, len} ranges of the memory bar whose reads have no
+   * side effects (see E810_MIRROR_PAGES in e810_reg_ranges.h) */
+  static const std::vector<std::pair<uint64_t, uint64_t>> &reg_mirror_ranges();
+  /** Keep the registers of reg_mirror_ranges() up to date in mirror (a copy of
+   * the memory bar, BAR_REGS_LEN bytes), from where the guest reads them. */
+  void set_reg_mirror(uint8_t *mirror);
+
  protected:
   logger log;
+  // Locking: the datapath (packet reception, queue doorbells, GLINT_DYN_CTL)
+  // holds ctrl_mutex shared plus the mutex of the queue or interrupt vector
+  // it works on, so that different queues progress in parallel. Everything
+  // else (other registers, admin queues, reset) holds ctrl_mutex exclusively.
+  // Order: ctrl_mutex, then queue, then vector.
+  std::shared_mutex ctrl_mutex;
   e810_regs regs;
+  uint8_t *reg_mirror = nullptr;
   queue_admin_tx pf_atq;
   queue_admin_tx pf_mbx_atq;
   host_mem_cache hmc;
@@ -1065,12 +1218,24 @@ class e810_bm : public nicbm::Runner::Device {
   /** Write to the I/O bar */
   virtual void reg_io_write(uint64_t addr, uint32_t val);
 
+  /** Register arrays in the memory bar, see e810_reg_ranges.h */
+  static const reg_table &reg_read_table();
+  static const reg_table &reg_write_table();
+  uint32_t *reg_array(const reg_range &range) {
+    return reinterpret_cast<uint32_t *>(reinterpret_cast<uint8_t *>(&regs) +
+                                        range.arg);
+  }
+
   /** 32-bit read from the memory bar (should be the default) */
   virtual uint32_t reg_mem_read32(uint64_t addr);
   /** 32-bit write to the memory bar (should be the default) */
   virtual void reg_mem_write32(uint64_t addr, uint32_t val);
+  /** Writes to queue doorbells and interrupt vectors. Returns false for
+   * control plane registers. */
+  bool reg_write_datapath(const reg_range &range, uint32_t idx, uint32_t val);
 
   void reset(bool indicate_done);
+  void reg_mirror_sync();
 };
 
 
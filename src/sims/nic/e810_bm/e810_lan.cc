@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
@@ -94,101 +95,239 @@ void lan::tail_updated(uint16_t idx, bool rx) {
                           : static_cast<lan_queue_base &>(*txqs[idx]));
   if (q.is_enabled())
     q.reg_updated();
+
+  // the doorbell is fully processed: send out the packets it produced
+  if (!rx)
+    dev.vmux->EthFlush();
+}
+
+std::mutex &lan::queue_mutex(uint16_t idx, bool rx) {
+  return rx ? rxqs[idx]->mutex : txqs[idx]->mutex;
 }
 
 void lan::rss_key_updated() {
   rss_kc.set_dirty();
 }
 
+void lan::set_rss_key(const void *key, size_t len) {
+  // 40 byte standard key, optionally followed by the 12 byte extended key
+  memset(dev.regs.pfqf_hkey, 0, sizeof(dev.regs.pfqf_hkey));
+  memcpy(dev.regs.pfqf_hkey, key, std::min(len, sizeof(dev.regs.pfqf_hkey)));
+  rss_key_updated();
+}
+
+void lan::set_rss_lut(uint16_t flags, const void *lut, size_t len) {
+  uint16_t type = (flags & ICE_AQC_GSET_RSS_LUT_TABLE_TYPE_M) >>
+                  ICE_AQC_GSET_RSS_LUT_TABLE_TYPE_S;
+  uint16_t size = (flags & ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_M) >>
+                  ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_S;
+  const uint8_t *entries = reinterpret_cast<const uint8_t *>(lut);
+#ifdef DEBUG_LAN
+  std::cout << " set rss lut type=" << type << " size=" << size << " len="
+      << len << logger::endl;
+#endif
+
+  if (type == ICE_AQC_GSET_RSS_LUT_TABLE_TYPE_VSI) {
+    // one byte per entry in the registers, but only 4 bits are used
+    uint8_t *dst = reinterpret_cast<uint8_t *>(dev.regs.vsiqf_hlut);
+    len = std::min(len, sizeof(dev.regs.vsiqf_hlut));
+    for (size_t i = 0; i < len; i++)
+      dst[i] = entries[i] & VSIQF_HLUT_LUT0_M;
+  } else {
+    // global LUTs are not modelled, they are an alias of the PF LUT
+    dev.regs.pfqf_hlut_size = size;
+    memcpy(dev.regs.pfqf_hlut, entries,
+           std::min(len, sizeof(dev.regs.pfqf_hlut)));
+  }
+}
+
+void lan::vsi_updated(const struct ice_aqc_vsi_props &props) {
+  if (!(props.valid_sections & ICE_AQ_VSI_PROP_Q_OPT_VALID))
+    return;
+
+  // the q_opt_rss LUT types match the encoding of HASH_LUT_SEL
+  uint32_t lut_sel = (props.q_opt_rss & ICE_AQ_VSI_Q_OPT_RSS_LUT_M) >>
+                     ICE_AQ_VSI_Q_OPT_RSS_LUT_S;
+  dev.regs.vsiqf_hash_ctl &= ~VSIQF_HASH_CTL_HASH_LUT_SEL_M;
+  dev.regs.vsiqf_hash_ctl |= (lut_sel << VSIQF_HASH_CTL_HASH_LUT_SEL_S) &
+                             VSIQF_HASH_CTL_HASH_LUT_SEL_M;
+}
+
+/**
+ * Queue offset within the VSI for an RSS hash, from the LUT the VSI uses.
+ */
+uint16_t lan::rss_lut_lookup(uint32_t hash) {
+  uint32_t lut_sel = (dev.regs.vsiqf_hash_ctl & VSIQF_HASH_CTL_HASH_LUT_SEL_M)
+                     >> VSIQF_HASH_CTL_HASH_LUT_SEL_S;
+  uint32_t idx;
+
+  if (lut_sel == ICE_AQ_VSI_Q_OPT_RSS_LUT_VSI) {
+    idx = hash % (4 * (VSIQF_HLUT_MAX_INDEX + 1));
+    return (dev.regs.vsiqf_hlut[idx / 4] >> (8 * (idx % 4))) &
+           VSIQF_HLUT_LUT0_M;
+  }
+
+  // PF LUT (global LUTs alias the PF LUT, see set_rss_lut)
+  switch (dev.regs.pfqf_hlut_size & PFQF_HLUT_SIZE_HSIZE_M) {
+    case ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_128_FLAG:
+      idx = hash % ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_128;
+      break;
+    case ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_512_FLAG:
+      idx = hash % ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_512;
+      break;
+    default:
+      idx = hash % ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_2K;
+      break;
+  }
+  return (dev.regs.pfqf_hlut[idx / 4] >> (8 * (idx % 4))) & PFQF_HLUT_LUT0_M;
+}
+
 bool lan::rss_steering(const void *data, size_t len, uint16_t &queue,
                        uint32_t &hash) {
+  const uint8_t *pkt = reinterpret_cast<const uint8_t *>(data);
+  // hash input: source and destination address, then source and destination
+  // port for tcp/udp. All in network byte order.
+  uint8_t input[2 * IP6_ADDR_LEN + 2 * sizeof(uint16_t)];
+  size_t input_len;
+  size_t off = sizeof(headers::eth_hdr);
+  size_t l4_off = 0;  // 0 if the packet has no ports to hash
+  uint8_t proto;
   hash = 0;
 
-  const headers::pkt_tcp *tcp =
-      reinterpret_cast<const headers::pkt_tcp *>(data);
-  const headers::pkt_udp *udp =
-      reinterpret_cast<const headers::pkt_udp *>(data);
-  // should actually determine packet type and mask with enabled packet types
-  // TODO(antoinek): ipv6
-  if (tcp->eth.type == htons(ETH_TYPE_IP) && tcp->ip.proto == IP_PROTO_TCP) {
-    hash = rss_kc.hash_ipv4(ntohl(tcp->ip.src), ntohl(tcp->ip.dest),
-                            ntohs(tcp->tcp.src), ntohs(tcp->tcp.dest));
+  if (len < off)
+    return false;
+  uint16_t type =
+      ntohs(reinterpret_cast<const headers::eth_hdr *>(pkt)->type);
+  if (type == ETH_TYPE_VLAN) {
+    if (len < off + 4)
+      return false;
+    type = ntohs(*reinterpret_cast<const uint16_t *>(pkt + off + 2));
+    off += 4;
+  }
 
-    #ifdef DEBUG_LAN
-    std::cout << "TCP IP Ethernet" << logger::endl;
-    #endif
-  } else if (udp->eth.type == htons(ETH_TYPE_IP) &&
-             udp->ip.proto == IP_PROTO_UDP) {
-    hash = rss_kc.hash_ipv4(ntohl(udp->ip.src), ntohl(udp->ip.dest),
-                            ntohs(udp->udp.src), ntohs(udp->udp.dest));
-    #ifdef DEBUG_LAN
-    std::cout << "UDP IP Ethernet" << logger::endl;
-    #endif
-  } else if (udp->eth.type == htons(ETH_TYPE_IP)) {
-    hash = rss_kc.hash_ipv4(ntohl(udp->ip.src), ntohl(udp->ip.dest), 0, 0);
-    #ifdef DEBUG_LAN
-    std::cout << "UDP non-IP Ethernet" << logger::endl;
-    #endif
+  if (type == ETH_TYPE_IP && len >= off + IP_HLEN) {
+    const headers::ip_hdr *ip =
+        reinterpret_cast<const headers::ip_hdr *>(pkt + off);
+    memcpy(input, &ip->src, sizeof(ip->src));
+    memcpy(input + sizeof(ip->src), &ip->dest, sizeof(ip->dest));
+    input_len = sizeof(ip->src) + sizeof(ip->dest);
+    proto = ip->proto;
+    // only the first fragment has ports, so fragments are hashed by address
+    if (!(ntohs(ip->offset) & (IP_FLAG_MF | IP_OFFSET_M)))
+      l4_off = off + IPH_HL(ip) * 4;
+  } else if (type == ETH_TYPE_IPV6 && len >= off + IP6_HLEN) {
+    const headers::ip6_hdr *ip6 =
+        reinterpret_cast<const headers::ip6_hdr *>(pkt + off);
+    memcpy(input, ip6->src, IP6_ADDR_LEN);
+    memcpy(input + IP6_ADDR_LEN, ip6->dest, IP6_ADDR_LEN);
+    input_len = 2 * IP6_ADDR_LEN;
+    // packets with extension headers are hashed by address
+    proto = ip6->nexthdr;
+    l4_off = off + IP6_HLEN;
   } else {
-    #ifdef DEBUG_LAN
-    std::cout << "rss_stearing: non-matched, return false." << logger::endl;
-    #endif
+#ifdef DEBUG_LAN
+    std::cout << "rss_steering: non-matched, return false." << logger::endl;
+#endif
     return false;
   }
 
-//   uint16_t luts =
-//       (!(dev.regs.pfqf_ctl_0 & I40E_PFQF_CTL_0_HASHLUTSIZE_MASK) ? 128 : 512);
-//   uint16_t idx = hash % luts;
-//   queue = (dev.regs.pfqf_hlut[idx / 4] >> (8 * (idx % 4))) & 0x3f;
-// #ifdef DEBUG_LAN
-//   std::cout << "  q=" << queue << " h=" << hash << " i=" << idx << logger::endl;
-// #endif
-  return true;
-}
+  if ((proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) && l4_off &&
+      len >= l4_off + 2 * sizeof(uint16_t)) {
+    // tcp and udp headers both start with source and destination port
+    memcpy(input + input_len, pkt + l4_off, 2 * sizeof(uint16_t));
+    input_len += 2 * sizeof(uint16_t);
+  }
 
-void lan::packet_received(const void *data, size_t len, std::optional<uint16_t> queue_hint) {
+  hash = rss_kc.hash(input, input_len);
+  queue = dev.vsi0_first_queue + rss_lut_lookup(hash);
 #ifdef DEBUG_LAN
-  std::cout << " packet received len=" << len << logger::endl;
+  std::cout << "  q=" << queue << " h=" << hash << logger::endl;
 #endif
+  return true;
+}
 
+// Find the enabled rx queue of a packet. Returns false if it is to be dropped.
+bool lan::rx_select_queue(const void *data, size_t len, std::optional<uint16_t> queue_hint,
+                          uint16_t &queue, Driver::RxMeta &rx_meta) {
   uint32_t hash = 0;
   // if the driver uses VSIs, it reserves queue 0 as VSI control queue. 
   // Rss may have to account for that.
   // In other drivers, this dev.vsi0_first_queue + queue_id is called queue_register_id
-  uint16_t queue = dev.vsi0_first_queue + 0;
+  queue = dev.vsi0_first_queue + 0;
   if (auto q = queue_hint) {
     queue = dev.vsi0_first_queue + *q;
-  } else {
-    this->dev.bcam.select_queue(data, len, &queue);
+  } else if (!this->dev.bcam.select_queue(data, len, &queue)) {
+    // no switch rule forwards to a specific queue: spread flows over the
+    // queues of the VSI
+    if (rss_steering(data, len, queue, hash)) {
+      // the guest's own key beats the hash of the physical NIC
+      rx_meta.flags |= Driver::RxMeta::RSS_HASH;
+      rx_meta.rss_hash = hash;
+    }
   }
-  // rss_steering(data, len, queue, hash);
-  if (!rxqs[queue]->is_enabled()) {
+  if (queue >= num_qs || !rxqs[queue]->is_enabled()) {
     // if we receive on uninitialized queues, we throw errors
     #ifdef DEBUG_LAN
       std::cout << " dropped packet because queue " << queue << " is not ready."<< logger::endl;
     #endif
-    return; // silently drop packet
+    return false; // silently drop packet
   }
 
-  // Obacht! Ineffizient :*)
-  while (false) { // while true: deliver packets in round robin fashion to queues
-    // wrap if initialized to -1
-    this->rss_last_queue = this->rss_last_queue % this->num_qs;
-    // try next queue
-    this->rss_last_queue = (this->rss_last_queue + 1) % this->num_qs;
-    // if we wrapped, skip vsi0 first queues
-    this->rss_last_queue = std::max(this->rss_last_queue, dev.vsi0_first_queue);
+  #ifdef DEBUG_LAN
+    std::cout << "rx packet queue " << std::dec << queue << "."<< logger::endl;
+  #endif
+  return true;
+}
 
-    if (rxqs[this->rss_last_queue]->is_enabled()) {
-      queue = this->rss_last_queue;
-      break;
+void lan::packet_received(const void *data, size_t len, std::optional<uint16_t> queue_hint,
+                          const Driver::RxMeta *meta) {
+#ifdef DEBUG_LAN
+  std::cout << " packet received len=" << len << logger::endl;
+#endif
+
+  Driver::RxMeta rx_meta = meta ? *meta : Driver::RxMeta{};
+  uint16_t queue;
+  if (rx_select_queue(data, len, queue_hint, queue, rx_meta)) {
+    std::lock_guard guard(rxqs[queue]->mutex);
+    rxqs[queue]->packet_received(data, len, rx_meta);
+  }
+}
+
+void lan::packets_received(const std::vector<nicbm::Runner::Device::EthFrame> &frames) {
+#ifdef DEBUG_LAN
+  std::cout << " burst received cnt=" << frames.size() << logger::endl;
+#endif
+
+  // classify the whole burst first, so that every queue it touches writes
+  // back its descriptors and interrupts only once
+  rx_burst.resize(frames.size());
+  for (size_t i = 0; i < frames.size(); i++) {
+    auto &frame = frames[i];
+    auto &entry = rx_burst[i];
+    entry.meta = frame.meta ? *frame.meta : Driver::RxMeta{};
+    if (!rx_select_queue(frame.data, frame.len, frame.queue, entry.queue, entry.meta)) {
+      entry.queue = UINT16_MAX; // dropped
+      continue;
+    }
+    lan_queue_rx *rxq = rxqs[entry.queue];
+    if (!rxq->in_burst()) {
+      // no other thread takes several queue locks, so any order is fine
+      rxq->mutex.lock();
+      rxq->burst_begin();
+      rx_burst_queues.push_back(rxq);
     }
   }
 
-  #ifdef DEBUG_LAN
-    std::cout << "rx packet queue " << std::dec << queue << "."<< logger::endl;
-  #endif
-  rxqs[queue]->packet_received(data, len, hash);
+  for (size_t i = 0; i < frames.size(); i++) {
+    if (rx_burst[i].queue != UINT16_MAX)
+      rxqs[rx_burst[i].queue]->packet_received(frames[i].data, frames[i].len, rx_burst[i].meta);
+  }
+
+  for (lan_queue_rx *rxq : rx_burst_queues) {
+    rxq->burst_end();
+    rxq->mutex.unlock();
+  }
+  rx_burst_queues.clear();
 }
 
 lan_queue_base::lan_queue_base(lan &lanmgr_, const std::string &qtype,
@@ -246,6 +385,7 @@ void lan_queue_base::disable() {
 void lan_queue_base::interrupt() {
   uint32_t qctl = reg_intqctl; // regs.qint_rqctl
   int index = reg_intqctl & QINT_TQCTL_MSIX_INDX_M;
+  std::lock_guard vector(lanmgr.dev.intevs[index].mutex);
   uint32_t gctl = lanmgr.dev.regs.pfint_dyn_ctln[index];
 #ifdef DEBUG_LAN
   std::cout << "interrupt index= "<< index << logger::endl;
@@ -331,7 +471,7 @@ void lan_queue_rx::initialize() {
   bool longdesc = !!(((*hbsz_p) >> 12) & 0x1);
   desc_len = (longdesc ? 32 : 16);
   crc_strip = !!(((*hbsz_p) >> 13) & 0x1);
-  rxmax = (((*rxmax_p) >> 6) & ((1 << 14) - 1)) * 128;
+  rxmax = ((*rxmax_p) >> 6) & ((1 << 14) - 1); // bytes
 
 // #ifdef DEBUG_LAN
   std::cout << " lan_queue_rx " << this->qname << " initialize() -> iova 0x" << std::hex << base << logger::endl;
@@ -392,7 +532,7 @@ bool lan_queue_rx::ptp_should_sample_rx(const void *data, size_t len) {
 }
 
 void lan_queue_rx::packet_received(const void *data, size_t pktlen,
-                                   uint32_t h) {
+                                   const Driver::RxMeta &meta) {
   size_t num_descs = (pktlen + dbuff_size - 1) / dbuff_size;
   if (UNLIKELY(!enabled)) {
     std::cout << "rx queue is disabled "
@@ -401,6 +541,24 @@ void lan_queue_rx::packet_received(const void *data, size_t pktlen,
     return;
   }
 
+  // no LRO: frames beyond the max frame size the driver programmed are
+  // dropped, however many descriptors they would fit into
+  if (UNLIKELY(pktlen > rxmax)) {
+#ifdef DEBUG_LAN
+    std::cout << " packet larger than rxmax (" << pktlen << " > " << rxmax
+        << "), dropping packet" << logger::endl;
+#endif
+    return;
+  }
+
+  if (UNLIKELY(dcache.size() < num_descs && wb_deferred)) {
+    // the burst used up all active descriptors: write back the ones it
+    // filled so far, which frees them for fetching more
+    wb_deferred = false;
+    trigger();
+    wb_deferred = true;
+  }
+
   if (UNLIKELY(dcache.size() < num_descs)) {
 #ifdef DEBUG_LAN
     std::cout << " not enough rx descs (" << num_descs << ", dropping packet"
@@ -429,14 +587,24 @@ void lan_queue_rx::packet_received(const void *data, size_t pktlen,
 
     if (i == num_descs - 1) {
       // last packet
-      ctx.packet_received(buf, pktlen - dbuff_size * i, timestamp, true);
+      ctx.packet_received(buf, pktlen - dbuff_size * i, timestamp, true, meta);
     } else {
 
-      ctx.packet_received(buf, dbuff_size, timestamp, false);
+      ctx.packet_received(buf, dbuff_size, timestamp, false, meta);
     }
   }
 }
 
+void lan_queue_rx::burst_begin() {
+  wb_deferred = true;
+}
+
+void lan_queue_rx::burst_end() {
+  wb_deferred = false;
+  // one writeback of all descriptors filled during the burst
+  trigger();
+}
+
 lan_queue_rx::rx_desc_ctx::rx_desc_ctx(lan_queue_rx &queue_)
     : desc_ctx(queue_), rq(queue_) {
 }
@@ -449,13 +617,89 @@ void lan_queue_rx::rx_desc_ctx::process() {
   rq.dcache.push_back(this);
 }
 
+// hardware packet type (index into the ptype table of the guest driver)
+static uint16_t rx_ptype(const Driver::RxMeta &meta) {
+  using L3 = Driver::RxMeta::L3;
+  using L4 = Driver::RxMeta::L4;
+  if (meta.l3_type == L3::IPV4) {
+    switch (meta.l4_type) {
+      case L4::FRAG: return 22;
+      case L4::UDP: return 24;
+      case L4::TCP: return 26;
+      case L4::SCTP: return 27;
+      case L4::ICMP: return 28;
+      default: return 23; // IPv4 payload
+    }
+  } else if (meta.l3_type == L3::IPV6) {
+    switch (meta.l4_type) {
+      case L4::FRAG: return 88;
+      case L4::UDP: return 90;
+      case L4::TCP: return 92;
+      case L4::SCTP: return 93;
+      case L4::ICMP: return 94;
+      default: return 89; // IPv6 payload
+    }
+  }
+  return 0; // unknown
+}
+
 void lan_queue_rx::rx_desc_ctx::packet_received(const void *data, size_t pktlen,
-                                                e810_timestamp_t timestamp, bool last) {
+                                                e810_timestamp_t timestamp, bool last,
+                                                const Driver::RxMeta &meta) {
   union ice_32byte_rx_desc *rxd =
       reinterpret_cast<union ice_32byte_rx_desc *>(desc);
   union ice_32b_rx_flex_desc *flex_rxd =
       reinterpret_cast<union ice_32b_rx_flex_desc *>(desc);
   uint64_t addr = rxd->read.pkt_addr;
+  uint8_t rxdid = rq.dev.regs.QRXFLXP_CNTXT[rq.idx] & QRXFLXP_CNTXT_RXDID_IDX_M;
+  // only claim checked checksums if the physical NIC (or host) checked them
+  bool csum_known = meta.flags & (Driver::RxMeta::L3_CSUM_GOOD | Driver::RxMeta::L3_CSUM_BAD |
+                                  Driver::RxMeta::L4_CSUM_GOOD | Driver::RxMeta::L4_CSUM_BAD);
+
+  if (rxdid > ICE_RXDID_LEGACY_1) {
+    // flex descriptor: ptype, RSS hash (NIC profile), VLAN and checksum status
+    struct ice_32b_rx_flex_desc_nic *nic_rxd =
+        reinterpret_cast<struct ice_32b_rx_flex_desc_nic *>(desc);
+    uint16_t status = 1 << ICE_RX_FLEX_DESC_STATUS0_DD_S;
+    flex_rxd->wb.rxdid = rxdid;
+    flex_rxd->wb.mir_id_umb_cast = 0;
+    flex_rxd->wb.ptype_flex_flags0 = rx_ptype(meta) & ICE_RX_FLEX_DESC_PTYPE_M;
+    flex_rxd->wb.pkt_len = pktlen;
+    flex_rxd->wb.hdr_len_sph_flex_flags1 = 0;
+    flex_rxd->wb.l2tag1 = 0;
+    nic_rxd->rss_hash = 0;
+    if (meta.flags & Driver::RxMeta::RSS_HASH) {
+      status |= 1 << ICE_RX_FLEX_DESC_STATUS0_RSS_VALID_S;
+      nic_rxd->rss_hash = meta.rss_hash;
+    }
+    if (last) {
+      status |= 1 << ICE_RX_FLEX_DESC_STATUS0_EOF_S;
+      if (meta.flags & Driver::RxMeta::VLAN_STRIPPED) {
+        status |= 1 << ICE_RX_FLEX_DESC_STATUS0_L2TAG1P_S;
+        flex_rxd->wb.l2tag1 = meta.vlan_tci;
+      }
+      if (csum_known) {
+        status |= 1 << ICE_RX_FLEX_DESC_STATUS0_L3L4P_S;
+        if (meta.flags & Driver::RxMeta::L3_CSUM_BAD)
+          status |= 1 << ICE_RX_FLEX_DESC_STATUS0_XSUM_IPE_S;
+        if (meta.flags & Driver::RxMeta::L4_CSUM_BAD)
+          status |= 1 << ICE_RX_FLEX_DESC_STATUS0_XSUM_L4E_S;
+      }
+    }
+    flex_rxd->wb.status_error0 = status;
+
+    if (UNLIKELY(timestamp.ts_l)) {
+      // write to TS registers of flex context
+      flex_rxd->wb.flex_ts.ts_high_0 = (uint16_t) timestamp.time & 0xFFFF;
+      flex_rxd->wb.flex_ts.ts_high_1 = (uint16_t) ((timestamp.time >> 16) & 0xFFFF);
+      flex_rxd->wb.ts_low = (uint8_t)timestamp.ts_l;
+    }
+
+    data_write_direct(addr, pktlen, data);
+    return;
+  }
+
+  // legacy descriptor
   flex_rxd->wb.pkt_len = pktlen;
   rxd->wb.qword1.status_error_len |= (1 << ICE_RX_FLEX_DESC_STATUS0_DD_S);
   rxd->wb.qword1.status_error_len |= (pktlen << 38);
@@ -468,11 +712,19 @@ void lan_queue_rx::rx_desc_ctx::packet_received(const void *data, size_t pktlen,
   }
 
   if (last) {
-    rxd->wb.qword1.status_error_len |= (1 << ICE_RX_FLEX_DESC_STATUS0_EOF_S);
-    rxd->wb.qword1.status_error_len |= (1 << ICE_RX_FLEX_DESC_STATUS0_L3L4P_S);
+    rxd->wb.qword1.status_error_len |= (1 << ICE_RX_DESC_STATUS_EOF_S);
+    if (csum_known) {
+      rxd->wb.qword1.status_error_len |= (1 << ICE_RX_DESC_STATUS_L3L4P_S);
+      if (meta.flags & Driver::RxMeta::L3_CSUM_BAD)
+        rxd->wb.qword1.status_error_len |=
+            (1ULL << (ICE_RXD_QW1_ERROR_S + ICE_RX_DESC_ERROR_IPE_S));
+      if (meta.flags & Driver::RxMeta::L4_CSUM_BAD)
+        rxd->wb.qword1.status_error_len |=
+            (1ULL << (ICE_RXD_QW1_ERROR_S + ICE_RX_DESC_ERROR_L4E_S));
+    }
   }
 
-  data_write(addr, pktlen, data); 
+  data_write_direct(addr, pktlen, data);
 }
 
 lan_queue_tx::lan_queue_tx(lan &lanmgr_, uint32_t &reg_tail_, size_t idx_,
@@ -24,6 +24,7 @@ void PTPManager::set_enabled(uint32_t clock) {
 }
 
 e810_timestamp_t PTPManager::phc_read() {
+  std::lock_guard guard(this->clock_mutex);
   // Mediation: if device is emulated, use hw timestamp
   if (this->dev.vmux->device->isMediating()) {
     auto e810_dev = dynamic_pointer_cast<E810EmulatedDevice>(this->dev.vmux->device);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <mutex>
 #include "sims/nic/e810_bm/util.h"
 
 namespace e810 {
@@ -82,6 +83,8 @@ class PTPManager {
   e810_timestamp_t last_val;
   e810_timestamp_t offset;
   uint64_t inc_val;
+  // phc_read() runs concurrently on the rx and tx paths of different queues
+  std::mutex clock_mutex;
 
  public:
   PTPManager(e810_bm &dev);
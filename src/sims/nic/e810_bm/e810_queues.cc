@@ -28,17 +28,52 @@
 #include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <new>
 
 #include "sims/nic/e810_bm/e810_base_wrapper.h"
 #include "sims/nic/e810_bm/e810_bm.h"
 
 namespace e810 {
 
+#define MAX_DMA_SIZE ((size_t)9024)
+
+slab_cache::slab_cache(size_t obj_size_, size_t max_cached_)
+    : obj_size(obj_size_), max_cached(max_cached_) {
+}
+
+slab_cache::~slab_cache() {
+  for (void *obj : free_objs)
+    ::operator delete(obj);
+}
+
+void *slab_cache::alloc() {
+  if (free_objs.empty())
+    return ::operator new(obj_size);
+
+  void *obj = free_objs.back();
+  free_objs.pop_back();
+  return obj;
+}
+
+void slab_cache::free(void *obj) {
+  if (free_objs.size() >= max_cached) {
+    ::operator delete(obj);
+    return;
+  }
+  if (free_objs.capacity() == 0)
+    free_objs.reserve(max_cached);
+  free_objs.push_back(obj);
+}
+
 queue_base::queue_base(const std::string &qname_, uint32_t &reg_head_,
                        uint32_t &reg_tail_, e810_bm &dev_)
     : qname(qname_),
       log(qname_, dev_.runner_),
       dev(dev_),
+      dma_op_cache(std::max({sizeof(dma_fetch), sizeof(dma_wb),
+                             sizeof(dma_data_fetch), sizeof(dma_data_wb)}),
+                   2 * MAX_ACTIVE_DESCS + 2),
+      dma_buf_cache(MAX_DMA_SIZE, MAX_ACTIVE_DESCS + 2),
       active_first_pos(0),
       active_first_idx(0),
       active_cnt(0),
@@ -47,6 +82,7 @@ queue_base::queue_base(const std::string &qname_, uint32_t &reg_head_,
       reg_head(reg_head_),
       reg_tail(reg_tail_),
       enabled(false),
+      wb_deferred(false),
       desc_len(0) {
   for (size_t i = 0; i < MAX_ACTIVE_DESCS; i++) {
     desc_ctxs[i] = nullptr;
@@ -95,7 +131,8 @@ void queue_base::trigger_fetch() {
   active_cnt += fetch_cnt;
   
   // prepare & issue dma
-  dma_fetch *dma = new dma_fetch(*this, desc_len * fetch_cnt);
+  dma_fetch *dma =
+      new (dma_op_cache.alloc()) dma_fetch(*this, desc_len * fetch_cnt);
   dma->write_ = false;
   dma->dma_addr_ = base + next_idx * desc_len;
   dma->pos = first_pos;
@@ -133,7 +170,7 @@ void queue_base::trigger_process() {
 }
 
 void queue_base::trigger_writeback() {
-  if (!enabled)
+  if (!enabled || wb_deferred)
     return;
 
   // from first pos count number of processed descriptors
@@ -176,6 +213,7 @@ void queue_base::reset() {
 #endif
 
   enabled = false;
+  wb_deferred = false;
   active_first_pos = 0;
   active_first_idx = 0;
   active_cnt = 0;
@@ -217,9 +255,22 @@ void queue_base::interrupt() {
   
 }
 
+void *queue_base::dma_buf_alloc(size_t len) {
+  if (len > MAX_DMA_SIZE)
+    return new char[len];
+  return dma_buf_cache.alloc();
+}
+
+void queue_base::dma_buf_free(void *buf, size_t len) {
+  if (len > MAX_DMA_SIZE)
+    delete[]((char *)buf);
+  else
+    dma_buf_cache.free(buf);
+}
+
 void queue_base::do_writeback(uint32_t first_idx, uint32_t first_pos,
                               uint32_t cnt) {
-  dma_wb *dma = new dma_wb(*this, desc_len * cnt);
+  dma_wb *dma = new (dma_op_cache.alloc()) dma_wb(*this, desc_len * cnt);
   dma->write_ = true;
   dma->dma_addr_ = base + first_idx * desc_len;
   dma->pos = first_pos;
@@ -311,8 +362,6 @@ void queue_base::desc_ctx::processed() {
   state = DESC_PROCESSED;
 }
 
-#define MAX_DMA_SIZE ((size_t)9024)
-
 void queue_base::desc_ctx::data_fetch(uint64_t addr, size_t data_len) {
   if (data_capacity < data_len) {
 #ifdef DEBUG_QUEUES
@@ -321,12 +370,14 @@ void queue_base::desc_ctx::data_fetch(uint64_t addr, size_t data_len) {
     if (data_capacity != 0)
       delete[]((uint8_t *)data);
 
-    data = new uint8_t[data_len];
-    data_capacity = data_len;
+    // allocate for the largest single dma right away so that we do not
+    // reallocate every time a slightly larger packet comes along
+    data_capacity = std::max(data_len, MAX_DMA_SIZE);
+    data = new uint8_t[data_capacity];
   }
 
-  dma_data_fetch *dma =
-      new dma_data_fetch(*this, std::min(data_len, MAX_DMA_SIZE), data);
+  dma_data_fetch *dma = new (queue.dma_op_cache.alloc())
+      dma_data_fetch(*this, std::min(data_len, MAX_DMA_SIZE), data);
   dma->part_offset = 0;
   dma->total_len = data_len;
   dma->write_ = false;
@@ -347,7 +398,8 @@ void queue_base::desc_ctx::data_fetched(uint64_t addr, size_t len) {
 
 void queue_base::desc_ctx::data_write(uint64_t addr, size_t data_len,
                                       const void *buf) {
-  dma_data_wb *data_dma = new dma_data_wb(*this, data_len);
+  dma_data_wb *data_dma =
+      new (queue.dma_op_cache.alloc()) dma_data_wb(*this, data_len);
   data_dma->write_ = true;
   data_dma->dma_addr_ = addr;
   memcpy(data_dma->data_, buf, data_len);
@@ -355,6 +407,14 @@ void queue_base::desc_ctx::data_write(uint64_t addr, size_t data_len,
   queue.dev.vmux->IssueDma(*data_dma);
 }
 
+void queue_base::desc_ctx::data_write_direct(uint64_t addr, size_t data_len,
+                                             const void *buf) {
+  queue.dev.vmux->DmaWrite(addr, buf, data_len);
+  // complete just like dma_data_wb::done()
+  data_written(addr, data_len);
+  queue.trigger();
+}
+
 void queue_base::desc_ctx::data_written(uint64_t addr, size_t len) {
 #ifdef DEBUG_QUEUES
   std::cout << "data_written(addr=" << addr << " datalen=" << len << ")"
@@ -365,12 +425,12 @@ void queue_base::desc_ctx::data_written(uint64_t addr, size_t len) {
 
 queue_base::dma_fetch::dma_fetch(queue_base &queue_, size_t len)
     : queue(queue_) {
-  data_ = new char[len];
+  data_ = queue.dma_buf_alloc(len);
   len_ = len;
 }
 
 queue_base::dma_fetch::~dma_fetch() {
-  delete[]((char *)data_);
+  queue.dma_buf_free(data_, len_);
 }
 
 void queue_base::dma_fetch::done() {
@@ -387,8 +447,9 @@ void queue_base::dma_fetch::done() {
     ctx.state = desc_ctx::DESC_PREPARING;
     ctx.prepare();
   }
-  queue.trigger();
-  delete this;
+  queue_base &q = queue;
+  q.trigger();
+  q.dma_op_release(this);
 }
 
 queue_base::dma_data_fetch::dma_data_fetch(desc_ctx &ctx_, size_t len,
@@ -416,37 +477,40 @@ void queue_base::dma_data_fetch::done() {
     return;
   }
   ctx.data_fetched(dma_addr_ - part_offset, total_len);
-  ctx.queue.trigger();
-  delete this;
+  queue_base &q = ctx.queue;
+  q.trigger();
+  q.dma_op_release(this);
 }
 
 queue_base::dma_wb::dma_wb(queue_base &queue_, size_t len) : queue(queue_) {
-  data_ = new char[len];
+  data_ = queue.dma_buf_alloc(len);
   len_ = len;
 }
 
 queue_base::dma_wb::~dma_wb() {
-  delete[]((char *)data_);
+  queue.dma_buf_free(data_, len_);
 }
 
 void queue_base::dma_wb::done() {
   queue.writeback_done(pos, len_ / queue.desc_len);
-  queue.trigger();
-  delete this;
+  queue_base &q = queue;
+  q.trigger();
+  q.dma_op_release(this);
 }
 
 queue_base::dma_data_wb::dma_data_wb(desc_ctx &ctx_, size_t len) : ctx(ctx_) {
-  data_ = new char[len];
+  data_ = ctx.queue.dma_buf_alloc(len);
   len_ = len;
 }
 
 queue_base::dma_data_wb::~dma_data_wb() {
-  delete[]((char *)data_);
+  ctx.queue.dma_buf_free(data_, len_);
 }
 
 void queue_base::dma_data_wb::done() {
   ctx.data_written(dma_addr_, len_);
-  ctx.queue.trigger();
-  delete this;
+  queue_base &q = ctx.queue;
+  q.trigger();
+  q.dma_op_release(this);
 }
 }  // namespace e810
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "sims/nic/e810_bm/base/ice_hw_autogen.h"
+
+/*
+ * Register arrays of BAR0 handled by e810_bm::reg_mem_read32/write32, in the
+ * order they are matched.
+ *
+ * The lists are X-macros, expanded with
+ *   E810_REG(op, reg, field, n):  n registers at reg(0), reg(1), ... backed by
+ *                                 e810_regs::field (clamped to its size)
+ *   E810_REG_CONST(op, reg, n):   n registers without backing storage
+ * where op names an e810_reg_op without the REG_OP_ prefix.
+ */
+
+namespace e810 {
+
+enum e810_reg_op : uint8_t {
+  REG_OP_ARRAY,        // plain register file access
+  REG_OP_RXDID_FLAGS,  // read-only, supported descriptor layouts
+  REG_OP_TX_DOORBELL,
+  REG_OP_RX_TAIL,
+  REG_OP_DYN_CTL,      // GLINT_DYN_CTL, written under the lock of its vector
+  REG_OP_RX_CTRL,
+  REG_OP_TQCTL,
+  REG_OP_CEQCTL,
+  REG_OP_RX_CONTEXT,
+  // per-VSI RSS registers. The model has a single VSI, so all VSIs share one
+  // copy: VSIQF_HKEY(i, vsi) and VSIQF_HLUT(i, vsi) are word idx / 1024.
+  REG_OP_RSS_KEY,
+  REG_OP_RSS_LUT,
+  REG_OP_RSS_HASH_CTL,
+};
+
+}  // namespace e810
+
+// one-dimensional views of two-dimensional register arrays
+#define E810_GLINT_ITR0(_i) GLINT_ITR(0, _i)
+#define E810_GLINT_ITR1(_i) GLINT_ITR(1, _i)
+#define E810_GLINT_ITR2(_i) GLINT_ITR(2, _i)
+#define E810_QRX_CONTEXT(_i) QRX_CONTEXT(0, _i)  // QRX_CONTEXT(1, 0) == QRX_CONTEXT(0, 2048)
+#define E810_RXDID_FLAGS(_i) GLFLXP_RXDID_FLAGS(_i, 0)
+#define E810_VSIQF_HKEY(_i) VSIQF_HKEY((_i) / 1024, (_i) % 1024)
+#define E810_VSIQF_HLUT(_i) VSIQF_HLUT((_i) / 1024, (_i) % 1024)
+
+#define E810_RSS_REGS(E810_REG, E810_REG_CONST) \
+  E810_REG(ARRAY, PFQF_HLUT, pfqf_hlut, PFQF_HLUT_MAX_INDEX + 1) \
+  E810_REG_CONST(RSS_KEY, E810_VSIQF_HKEY, (VSIQF_HKEY_MAX_INDEX + 1) * 1024) \
+  E810_REG_CONST(RSS_LUT, E810_VSIQF_HLUT, (VSIQF_HLUT_MAX_INDEX + 1) * 1024) \
+  E810_REG_CONST(RSS_HASH_CTL, VSIQF_HASH_CTL, VSIQF_HASH_CTL_MAX_INDEX + 1)
+
+// statistics counters: low 32 bits only
+#define E810_COUNTER_REGS(E810_REG, glv_n) \
+  E810_REG(ARRAY, GLPRT_BPRCL, GLPRT_BPRCL, 8) \
+  E810_REG(ARRAY, GLPRT_BPTCL, GLPRT_BPTCL, 8) \
+  E810_REG(ARRAY, GLPRT_CRCERRS, GLPRT_CRCERRS, 8) \
+  E810_REG(ARRAY, GLPRT_GORCL, GLPRT_GORCL, 8) \
+  E810_REG(ARRAY, GLPRT_GOTCL, GLPRT_GOTCL, 8) \
+  E810_REG(ARRAY, GLPRT_ILLERRC, GLPRT_ILLERRC, 8) \
+  E810_REG(ARRAY, GLPRT_LXOFFRXC, GLPRT_LXOFFRXC, 8) \
+  E810_REG(ARRAY, GLPRT_LXOFFTXC, GLPRT_LXOFFTXC, 8) \
+  E810_REG(ARRAY, GLPRT_LXONRXC, GLPRT_LXONRXC, 8) \
+  E810_REG(ARRAY, GLPRT_LXONTXC, GLPRT_LXONTXC, 8) \
+  E810_REG(ARRAY, GLPRT_MLFC, GLPRT_MLFC, 8) \
+  E810_REG(ARRAY, GLPRT_MPRCL, GLPRT_MPRCL, 8) \
+  E810_REG(ARRAY, GLPRT_MPTCL, GLPRT_MPTCL, 8) \
+  E810_REG(ARRAY, GLPRT_MRFC, GLPRT_MRFC, 8) \
+  E810_REG(ARRAY, GLPRT_PRC1023L, GLPRT_PRC1023L, 8) \
+  E810_REG(ARRAY, GLPRT_PRC127L, GLPRT_PRC127L, 8) \
+  E810_REG(ARRAY, GLPRT_PRC1522L, GLPRT_PRC1522L, 8) \
+  E810_REG(ARRAY, GLPRT_PRC255L, GLPRT_PRC255L, 8) \
+  E810_REG(ARRAY, GLPRT_PRC511L, GLPRT_PRC511L, 8) \
+  E810_REG(ARRAY, GLPRT_PRC64L, GLPRT_PRC64L, 8) \
+  E810_REG(ARRAY, GLPRT_PRC9522L, GLPRT_PRC9522L, 8) \
+  E810_REG(ARRAY, GLPRT_PTC1023L, GLPRT_PTC1023L, 8) \
+  E810_REG(ARRAY, GLPRT_PTC127L, GLPRT_PTC127L, 8) \
+  E810_REG(ARRAY, GLPRT_PTC1522L, GLPRT_PTC1522L, 8) \
+  E810_REG(ARRAY, GLPRT_PTC255L, GLPRT_PTC255L, 8) \
+  E810_REG(ARRAY, GLPRT_PTC511L, GLPRT_PTC511L, 8) \
+  E810_REG(ARRAY, GLPRT_PTC64L, GLPRT_PTC64L, 8) \
+  E810_REG(ARRAY, GLPRT_PTC9522L, GLPRT_PTC9522L, 8) \
+  E810_REG(ARRAY, GLPRT_RFC, GLPRT_RFC, 8) \
+  E810_REG(ARRAY, GLPRT_RJC, GLPRT_RJC, 8) \
+  E810_REG(ARRAY, GLPRT_RLEC, GLPRT_RLEC, 8) \
+  E810_REG(ARRAY, GLPRT_ROC, GLPRT_ROC, 8) \
+  E810_REG(ARRAY, GLPRT_RUC, GLPRT_RUC, 8) \
+  E810_REG(ARRAY, GLPRT_TDOLD, GLPRT_TDOLD, 8) \
+  E810_REG(ARRAY, GLPRT_UPRCL, GLPRT_UPRCL, 8) \
+  E810_REG(ARRAY, GLPRT_UPTCL, GLPRT_UPTCL, 8) \
+  E810_REG(ARRAY, GLV_BPRCL, GLV_BPRCL, glv_n) \
+  E810_REG(ARRAY, GLV_BPTCL, GLV_BPTCL, glv_n) \
+  E810_REG(ARRAY, GLV_GORCL, GLV_GORCL, glv_n) \
+  E810_REG(ARRAY, GLV_GOTCL, GLV_GOTCL, glv_n) \
+  E810_REG(ARRAY, GLV_MPRCL, GLV_MPRCL, glv_n) \
+  E810_REG(ARRAY, GLV_MPTCL, GLV_MPTCL, glv_n) \
+  E810_REG(ARRAY, GLV_RDPC, GLV_RDPC, glv_n) \
+  E810_REG(ARRAY, GLV_TEPC, GLV_TEPC, glv_n) \
+  E810_REG(ARRAY, GLV_UPRCL, GLV_UPRCL, glv_n) \
+  E810_REG(ARRAY, GLV_UPTCL, GLV_UPTCL, glv_n)
+
+#define E810_READ_REGS(E810_REG, E810_REG_CONST) \
+  E810_REG(ARRAY, GLINT_DYN_CTL, pfint_dyn_ctln, 2047) \
+  E810_REG(ARRAY, QTX_COMM_HEAD, qtx_comm_head, 16384) \
+  E810_REG(ARRAY, PF0INT_ITR_0, pfint_itrn[0], 2048) \
+  E810_REG(ARRAY, PF0INT_ITR_1, pfint_itrn[1], 2048) \
+  E810_REG(ARRAY, PF0INT_ITR_2, pfint_itrn[2], 2048) \
+  E810_REG(ARRAY, QINT_TQCTL, qint_tqctl, 2048) \
+  E810_REG(ARRAY, QINT_RQCTL, qint_rqctl, 2048) \
+  E810_REG(ARRAY, GLINT_CEQCTL, glint_ceqctl, 2048) \
+  E810_REG(ARRAY, QRX_CTRL, QRX_CTRL, 2048) \
+  E810_REG(ARRAY, QRX_TAIL, qrx_tail, 2048) \
+  E810_REG(ARRAY, E810_GLINT_ITR0, GLINT_ITR0, 2048) \
+  E810_REG(ARRAY, E810_GLINT_ITR1, GLINT_ITR1, 2048) \
+  E810_REG(ARRAY, E810_GLINT_ITR2, GLINT_ITR2, 2048) \
+  E810_REG(ARRAY, E810_QRX_CONTEXT, QRX_CONTEXT, 8 * 2048) \
+  E810_REG(ARRAY, QRXFLXP_CNTXT, QRXFLXP_CNTXT, 2048) \
+  E810_REG(ARRAY, GLFLXP_RXDID_FLX_WRD_0, flex_rxdid_0, 64) \
+  E810_REG(ARRAY, GLFLXP_RXDID_FLX_WRD_1, flex_rxdid_1, 64) \
+  E810_REG(ARRAY, GLFLXP_RXDID_FLX_WRD_2, flex_rxdid_2, 64) \
+  E810_REG(ARRAY, GLFLXP_RXDID_FLX_WRD_3, flex_rxdid_3, 64) \
+  E810_REG_CONST(RXDID_FLAGS, E810_RXDID_FLAGS, 64 + 4 * 64) \
+  E810_RSS_REGS(E810_REG, E810_REG_CONST) \
+  E810_COUNTER_REGS(E810_REG, 768)
+
+#define E810_WRITE_REGS(E810_REG, E810_REG_CONST) \
+  E810_REG(DYN_CTL, GLINT_DYN_CTL, pfint_dyn_ctln, 2047) \
+  E810_REG(TX_DOORBELL, QTX_COMM_DBELL, QTX_COMM_DBELL, 2048) \
+  E810_REG(RX_TAIL, QRX_TAIL, qrx_tail, 256) \
+  E810_REG(RX_CTRL, QRX_CTRL, QRX_CTRL, 2048) \
+  E810_REG(ARRAY, PF0INT_ITR_0, pfint_itrn[0], 2048) \
+  E810_REG(ARRAY, PF0INT_ITR_1, pfint_itrn[1], 2048) \
+  E810_REG(ARRAY, PF0INT_ITR_2, pfint_itrn[2], 2048) \
+  E810_REG(TQCTL, QINT_TQCTL, qint_tqctl, 16384) \
+  E810_REG(ARRAY, QINT_RQCTL, qint_rqctl, 2048) \
+  E810_REG(CEQCTL, GLINT_CEQCTL, glint_ceqctl, 2018) \
+  E810_REG(ARRAY, E810_GLINT_ITR0, GLINT_ITR0, 2048) \
+  E810_REG(ARRAY, E810_GLINT_ITR1, GLINT_ITR1, 2048) \
+  E810_REG(ARRAY, E810_GLINT_ITR2, GLINT_ITR2, 2048) \
+  E810_REG(RX_CONTEXT, E810_QRX_CONTEXT, QRX_CONTEXT, 8 * 2048) \
+  E810_REG(ARRAY, QRXFLXP_CNTXT, QRXFLXP_CNTXT, 2048) \
+  E810_REG(ARRAY, GLFLXP_RXDID_FLX_WRD_0, flex_rxdid_0, 64) \
+  E810_REG(ARRAY, GLFLXP_RXDID_FLX_WRD_1, flex_rxdid_1, 64) \
+  E810_REG(ARRAY, GLFLXP_RXDID_FLX_WRD_2, flex_rxdid_2, 64) \
+  E810_REG(ARRAY, GLFLXP_RXDID_FLX_WRD_3, flex_rxdid_3, 64) \
+  E810_RSS_REGS(E810_REG, E810_REG_CONST) \
+  E810_COUNTER_REGS(E810_REG, 8)
+
+// BAR0 pages holding nothing but statistics counters (according to
+// ice_hw_autogen.h), as E810_PAGES(first register, number of 4 KiB pages).
+// Reads of them have no side effects, so the device maps them into the guest
+// (see e810_bm::set_reg_mirror()). GLV_RDPC is not among them: it shares its
+// page with VF registers.
+#define E810_MIRROR_PAGES(E810_PAGES) \
+  E810_PAGES(GLV_GOTCL, 2) \
+  E810_PAGES(GLV_UPTCL, 6) /* GLV_UPTC, GLV_MPTC, GLV_BPTC */ \
+  E810_PAGES(GLV_TEPC, 1) \
+  E810_PAGES(GLPRT_GORCL, 2) /* all GLPRT counters */ \
+  E810_PAGES(GLV_GORCL, 8) /* GLV_GORC, GLV_UPRC, GLV_MPRC, GLV_BPRC */
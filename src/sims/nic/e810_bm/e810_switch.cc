@@ -21,6 +21,7 @@ bool e810_switch::add_rule(struct ice_aqc_sw_rules_elem *add_sw_rules) {
       add_sw_rules->pdata.lkup_tx_rx.recipe_id != recipe_idx || // we only support recipe 0 (hardcoded in firmware)
       add_sw_rules->pdata.lkup_tx_rx.hdr_len != this->recipies[recipe_idx].size() // depends on the recipe 0 (should be 56)
       ) {
+    add_sw_rules->pdata.lkup_tx_rx.index = 0;
     return false; // rule too complicated: not supported by this emulator
   }
 
@@ -36,56 +37,120 @@ bool e810_switch::add_rule(struct ice_aqc_sw_rules_elem *add_sw_rules) {
   // ethertype rules
   uint16_t etype = be16toh(hdr->h_proto);
   this->ethertype_rules[etype] = queue_id;
-  std::vector<uint8_t> *rule = new std::vector<uint8_t>();
-  for (size_t i = 0; i < this->recipies[recipe_idx].size(); i++) {
-    uint8_t mask = this->recipies[recipe_idx][i];
-    uint8_t byte = mask & add_sw_rules->pdata.lkup_tx_rx.hdr[i];
-    rule->push_back(byte);
-  }
-  this->rules.push_back(rule);
-  this->rules_recipe_idx.push_back(recipe_idx);
-  this->rules_dst_queues.push_back(queue_id);
+  rule_tuple &tuple = this->tuples[recipe_idx];
+  match_key key;
+  mask_key(key, tuple.offsets, tuple.masks, add_sw_rules->pdata.lkup_tx_rx.hdr,
+           add_sw_rules->pdata.lkup_tx_rx.hdr_len);
+  uint16_t rule_id = this->next_rule_id;
+  while (this->rules_by_id.count(rule_id))
+    rule_id++;
+  this->next_rule_id = rule_id + 1;
+  rule_action action{this->nb_rules++, (uint16_t)queue_id, rule_id};
+  add_sw_rules->pdata.lkup_tx_rx.index = rule_id;
+  // like the linear rule list did, an earlier rule with the same match wins
+  tuple.rules.emplace(key, action);
+  this->rules_generation++;
   bool installed_rule = this->dev.vmux->device->add_switch_etype_rule(device_id, etype, queue_id - this->dev.vsi0_first_queue);
+  this->rules_by_id[rule_id] = {recipe_idx, key, action, etype, installed_rule};
 
   return installed_rule;
 }
 
+bool e810_switch::del_rule(uint16_t rule_id) {
+  auto it = this->rules_by_id.find(rule_id);
+  if (it == this->rules_by_id.end())
+    return false;
+  installed_rule rule = it->second;
+  this->rules_by_id.erase(it);
+
+  rule_tuple &tuple = this->tuples[rule.recipe];
+  auto active = tuple.rules.find(rule.key);
+  if (active != tuple.rules.end() && active->second.id == rule_id) {
+    // an older rule with the same match shadowed by this one takes over
+    tuple.rules.erase(active);
+    const rule_action *next = nullptr;
+    for (auto &[id, other] : this->rules_by_id) {
+      if (other.recipe == rule.recipe && other.key == rule.key &&
+          (!next || other.action.prio < next->prio))
+        next = &other.action;
+    }
+    if (next)
+      tuple.rules.emplace(rule.key, *next);
+  }
+  this->rules_generation++;
+
+  if (rule.offloaded) {
+    auto device = this->dev.vmux->device;
+    if (!device->del_switch_etype_rule(device->device_id, rule.etype,
+                                       rule.action.queue - this->dev.vsi0_first_queue))
+      cout << "warning: could not remove offloaded switch rule " << rule_id
+           << logger::endl;
+  }
+  return true;
+}
+
+void e810_switch::add_recipe(const std::vector<uint8_t> &mask) {
+  rule_tuple tuple;
+  for (size_t i = 0; i < mask.size() && i < HDR_LEN; i++) {
+    if (mask[i]) {
+      tuple.offsets.push_back(i);
+      tuple.masks.push_back(mask[i]);
+    }
+  }
+  this->recipies.push_back(mask);
+  this->tuples.push_back(std::move(tuple));
+
+  // the flow cache key covers everything any rule can look at
+  uint8_t flow_mask[HDR_LEN] = {};
+  memset(flow_mask, 0xff, ETH_ALEN); // dst mac for mac_rules
+  for (const auto &t : this->tuples) {
+    for (size_t i = 0; i < t.offsets.size(); i++)
+      flow_mask[t.offsets[i]] |= t.masks[i];
+  }
+  this->flow_offsets.clear();
+  this->flow_masks.clear();
+  for (size_t i = 0; i < HDR_LEN; i++) {
+    if (flow_mask[i]) {
+      this->flow_offsets.push_back(i);
+      this->flow_masks.push_back(flow_mask[i]);
+    }
+  }
+  this->rules_generation++;
+}
+
 /**
- * set queue if a switching rule applies
+ * gather the masked bytes at offsets. Bytes past the end of data are 0.
  */
-void e810_switch::select_queue(const void* data, size_t len, uint16_t* queue) {
-  // assume firmware recipe 0
-  // match ethertype, src_mac, dst_ac, vlan, logical port, ...
-  if (len < sizeof(struct ethhdr)) {
-    return;
-  }
-  struct ethhdr* packet_hdr = (struct ethhdr*) data;
+void e810_switch::mask_key(match_key &key, const std::vector<uint8_t> &offsets,
+                           const std::vector<uint8_t> &masks,
+                           const uint8_t *data, size_t len) {
+  key.len = offsets.size();
+  for (size_t i = 0; i < offsets.size(); i++)
+    key.bytes[i] = offsets[i] < len ? (data[offsets[i]] & masks[i]) : 0;
+}
 
+bool e810_switch::classify(const uint8_t *data, size_t len, uint16_t *queue) {
   // check mac rules
-  uint64_t dst_mac = 0xFFFFFFFFFFFF & *(uint64_t*)(packet_hdr->h_dest);
+  uint64_t dst_mac = 0xFFFFFFFFFFFF & *(uint64_t*)(data);
   if (auto search = this->mac_rules.find(dst_mac); search != this->mac_rules.end()) {
     *queue = search->second; // return map entry, if it exists
-    return;
+    return true;
   }
 
-  for (size_t rule_idx = 0; rule_idx < this->rules.size(); rule_idx++) {
-    uint16_t recipe_idx = this->rules_recipe_idx[rule_idx];
-    auto rule = *this->rules[rule_idx];
-    // based on recipies[recipe_idx], data, and rule, we can determine if the rule matches
-    bool rule_matches = true;
-    for (size_t i = 0; i < this->recipies[recipe_idx].size(); i++) {
-      uint8_t mask = this->recipies[recipe_idx][i];
-      uint8_t masked = mask & ((uint8_t*)data)[i];
-      bool byte_matches = masked == rule[i];
-      if (!byte_matches) {
-        rule_matches = false;
-        break;
-      }
-    }
-    if (rule_matches) {
-      *queue = this->rules_dst_queues[rule_idx];
-      return;
-    }
+  const rule_action *best = nullptr;
+  match_key key;
+  for (auto &tuple : this->tuples) {
+    if (tuple.rules.empty())
+      continue;
+    mask_key(key, tuple.offsets, tuple.masks, data, len);
+    auto search = tuple.rules.find(key);
+    if (search != tuple.rules.end() &&
+        (!best || search->second.prio < best->prio))
+      best = &search->second;
+  }
+  if (best) {
+    *queue = best->queue;
+    return true;
   }
 
   // uint16_t ethertype = be16toh(packet_hdr->h_proto);
@@ -93,6 +158,37 @@ void e810_switch::select_queue(const void* data, size_t len, uint16_t* queue) {
   //   *queue = search->second; // return map entry, if it exists
   //   return;
   // }
+  return false;
+}
+
+/**
+ * set queue if a switching rule applies. Returns whether one did.
+ */
+bool e810_switch::select_queue(const void* data, size_t len, uint16_t* queue) {
+  // assume firmware recipe 0
+  // match ethertype, src_mac, dst_ac, vlan, logical port, ...
+  if (len < sizeof(struct ethhdr)) {
+    return false;
+  }
+  const uint8_t *hdr = reinterpret_cast<const uint8_t *>(data);
+
+  std::unique_lock cache_lock(this->flow_cache_mutex, std::try_to_lock);
+  if (!cache_lock.owns_lock())
+    return classify(hdr, len, queue);
+
+  match_key flow;
+  mask_key(flow, this->flow_offsets, this->flow_masks, hdr, len);
+  flow_cache_entry &entry =
+      this->flow_cache[match_key_hash()(flow) % FLOW_CACHE_SIZE];
+  if (entry.generation != this->rules_generation || !(entry.key == flow)) {
+    entry.generation = this->rules_generation;
+    entry.key = flow;
+    entry.hit = classify(hdr, len, &entry.queue);
+  }
+
+  if (entry.hit)
+    *queue = entry.queue;
+  return entry.hit;
 }
 
 void e810_switch::print_sw_rule(struct ice_aqc_sw_rules_elem *add_sw_rules) {
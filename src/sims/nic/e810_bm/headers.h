@@ -36,6 +36,8 @@ namespace headers {
 #define ETH_TYPE_IP 0x0800
 #define ETH_TYPE_ARP 0x0806
 #define ETH_TYPE_PTP 0x88F7
+#define ETH_TYPE_VLAN 0x8100
+#define ETH_TYPE_IPV6 0x86DD
 
 struct eth_addr {
   uint8_t addr[ETH_ADDR_LEN];
@@ -97,6 +99,29 @@ struct ip_hdr {
   uint32_t dest;
 } __attribute__((packed));
 
+#define IP_FLAG_MF 0x2000
+#define IP_OFFSET_M 0x1fff
+
+/******************************************************************************/
+/* IPv6 */
+
+#define IP6_ADDR_LEN 16
+#define IP6_HLEN 40
+
+struct ip6_hdr {
+  /* version / traffic class / flow label */
+  uint32_t _v_tc_fl;
+  /* payload length */
+  uint16_t len;
+  /* next header */
+  uint8_t nexthdr;
+  /* hop limit */
+  uint8_t hoplim;
+  /* source and destination IP addresses */
+  uint8_t src[IP6_ADDR_LEN];
+  uint8_t dest[IP6_ADDR_LEN];
+} __attribute__((packed));
+
 /******************************************************************************/
 /* ARP */
 
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cassert>
+#include <vector>
+
+namespace e810 {
+
+/**
+ * An array of `count` registers, where register i lives at
+ * first + i * (1 << stride_shift).
+ */
+struct reg_range {
+  uint64_t first;
+  uint32_t count;
+  uint8_t stride_shift;
+  uint8_t op;    // what to do on access. Up to the user of the table.
+  uint32_t arg;  // e.g. offset of the backing array in the register file
+};
+
+/**
+ * Page-indexed lookup table for register ranges.
+ *
+ * Every 4K page of the BAR gets the list of ranges that have a register in
+ * it, so a lookup only looks at the (typically one) range of the accessed
+ * page. Ranges overlapping the same address are matched in the order they
+ * were passed in.
+ */
+class reg_table {
+ public:
+  static const unsigned PAGE_SHIFT = 12;
+
+ protected:
+  const reg_range *ranges;
+  uint64_t nb_pages;
+  // per page: X << 8 | number of ranges in the page. If the page has a single
+  // range (the common case), X is its index. Otherwise, the page's ranges are
+  // listed in page_ranges, starting at X.
+  std::vector<uint32_t> pages;
+  std::vector<uint16_t> page_ranges;
+
+  static uint64_t range_last(const reg_range &r) {
+    return r.first + ((uint64_t)(r.count - 1) << r.stride_shift);
+  }
+
+  static const reg_range *match(const reg_range &r, uint64_t addr,
+                                uint32_t &idx) {
+    uint64_t off = addr - r.first;  // wraps around if addr < first
+    if (off & ((1ULL << r.stride_shift) - 1))
+      return nullptr;
+    off >>= r.stride_shift;
+    if (off >= r.count)
+      return nullptr;
+    idx = off;
+    return &r;
+  }
+
+ public:
+  reg_table(const reg_range *ranges_, size_t nb_ranges, uint64_t bar_size)
+      : ranges(ranges_), nb_pages(bar_size >> PAGE_SHIFT) {
+    std::vector<std::vector<uint16_t>> per_page(nb_pages);
+    for (size_t i = 0; i < nb_ranges; i++) {
+      const reg_range &r = ranges[i];
+      if (r.count == 0)
+        continue;
+      uint64_t last_page = range_last(r) >> PAGE_SHIFT;
+      for (uint64_t p = r.first >> PAGE_SHIFT; p <= last_page && p < nb_pages; p++)
+        per_page[p].push_back(i);
+    }
+
+    // flatten, preserving the order of ranges
+    pages.resize(nb_pages);
+    for (uint64_t p = 0; p < nb_pages; p++) {
+      assert(per_page[p].size() <= 0xff);
+      assert(page_ranges.size() <= 0xffffff);
+      if (per_page[p].size() == 1) {
+        pages[p] = (uint32_t)per_page[p][0] << 8 | 1;
+        continue;
+      }
+      pages[p] = (uint32_t)page_ranges.size() << 8 | per_page[p].size();
+      page_ranges.insert(page_ranges.end(), per_page[p].begin(), per_page[p].end());
+    }
+  }
+
+  /**
+   * Find the range containing the register at addr.
+   * Returns nullptr if there is none. Otherwise idx is set to the index of
+   * the register within the range.
+   */
+  const reg_range *lookup(uint64_t addr, uint32_t &idx) const {
+    uint64_t page = addr >> PAGE_SHIFT;
+    if (page >= nb_pages)
+      return nullptr;
+
+    uint32_t info = pages[page];
+    uint32_t nb_candidates = info & 0xff;
+    if (nb_candidates == 1)
+      return match(ranges[info >> 8], addr, idx);
+
+    const uint16_t *candidates = page_ranges.data() + (info >> 8);
+    for (uint32_t i = 0; i < nb_candidates; i++) {
+      const reg_range *r = match(ranges[candidates[i]], addr, idx);
+      if (r)
+        return r;
+    }
+    return nullptr;
+  }
+};
+
+}  // namespace e810
@@ -22,6 +22,8 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <cassert>
+
 #include "sims/nic/e810_bm/e810_bm.h"
 
 namespace e810 {
@@ -35,18 +37,30 @@ void rss_key_cache::build() {
   uint32_t result = (((uint32_t)k[0]) << 24) | (((uint32_t)k[1]) << 16) |
                     (((uint32_t)k[2]) << 8) | ((uint32_t)k[3]);
 
+  // window[i] is what a set bit i of the input xors into the hash: the 32
+  // key bits starting at bit i
+  uint32_t window[max_input_len * 8];
   uint32_t idx = 32;
   size_t i;
 
-  for (i = 0; i < cache_len; i++, idx++) {
+  for (i = 0; i < max_input_len * 8; i++, idx++) {
     uint8_t shift = (idx % 8);
     uint32_t bit;
 
-    cache[i] = result;
+    window[i] = result;
     bit = ((k[idx / 8] << shift) & 0x80) ? 1 : 0;
     result = ((result << 1) | bit);
   }
 
+  // combine the windows of all set bits for every possible input byte
+  for (i = 0; i < max_input_len; i++) {
+    cache[i][0] = 0;
+    for (uint32_t b = 1; b < 256; b++) {
+      uint32_t msb = 31 - __builtin_clz(b);
+      cache[i][b] = cache[i][b & ~(1U << msb)] ^ window[i * 8 + 7 - msb];
+    }
+  }
+
   cache_dirty = false;
 }
 
@@ -54,36 +68,15 @@ void rss_key_cache::set_dirty() {
   cache_dirty = true;
 }
 
-uint32_t rss_key_cache::hash_ipv4(uint32_t sip, uint32_t dip, uint16_t sp,
-                                  uint16_t dp) {
-  static const uint32_t MSB32 = 0x80000000;
-  static const uint32_t MSB16 = 0x8000;
+uint32_t rss_key_cache::hash(const uint8_t *input, size_t len) {
   uint32_t res = 0;
-  int i;
 
   if (cache_dirty)
     build();
 
-  for (i = 0; i < 32; i++) {
-    if (sip & MSB32)
-      res ^= cache[i];
-    sip <<= 1;
-  }
-  for (i = 0; i < 32; i++) {
-    if (dip & MSB32)
-      res ^= cache[32 + i];
-    dip <<= 1;
-  }
-  for (i = 0; i < 16; i++) {
-    if (sp & MSB16)
-      res ^= cache[64 + i];
-    sp <<= 1;
-  }
-  for (i = 0; i < 16; i++) {
-    if (dp & MSB16)
-      res ^= cache[80 + i];
-    dp <<= 1;
-  }
+  assert(len <= max_input_len);
+  for (size_t i = 0; i < len; i++)
+    res ^= cache[i][input[i]];
 
   return res;
 }
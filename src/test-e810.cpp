@@ -0,0 +1,347 @@
+/*
+ * Tests of the e810 behavioral model against a scripted guest (see
+ * e810-guest.hpp).
+ *
+ * Usage: test-e810
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syslog.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "e810-guest.hpp"
+#include "util.hpp"
+
+using namespace e810_guest;
+
+static int failures = 0;
+
+#define EXPECT(cond)                                                        \
+  do {                                                                      \
+    if (!(cond)) {                                                          \
+      printf("%s:%d: %s: expected %s\n", __FILE__, __LINE__, __func__, #cond); \
+      failures++;                                                           \
+    }                                                                       \
+  } while (0)
+
+static const size_t PKT_LEN = 128;
+
+static bool qword1_bit(union ice_32byte_rx_desc *desc, unsigned bit) {
+  return desc->wb.qword1.status_error_len & (1ULL << bit);
+}
+
+static bool rx_error(union ice_32byte_rx_desc *desc, unsigned error_bit) {
+  return qword1_bit(desc, ICE_RXD_QW1_ERROR_S + error_bit);
+}
+
+// legacy descriptors report checksum results of the physical NIC in L3L4P
+// and the IPE/L4E error bits
+static void test_legacy_rx_checksum() {
+  auto driver = std::make_shared<SinkDriver>();
+  E810Harness harness(driver, std::make_shared<GuestDevice>(driver));
+  E810Guest &guest = *harness.guest;
+  guest.rxq_setup(0);
+
+  std::vector<uint8_t> pkt(PKT_LEN);
+  build_packet(pkt.data(), pkt.size(), 0);
+
+  Driver::RxMeta unchecked;
+  Driver::RxMeta good;
+  good.flags = Driver::RxMeta::L3_CSUM_GOOD | Driver::RxMeta::L4_CSUM_GOOD;
+  Driver::RxMeta bad_l4;
+  bad_l4.flags = Driver::RxMeta::L3_CSUM_GOOD | Driver::RxMeta::L4_CSUM_BAD;
+  Driver::RxMeta bad_both;
+  bad_both.flags = Driver::RxMeta::L3_CSUM_BAD | Driver::RxMeta::L4_CSUM_BAD;
+
+  std::vector<nicbm::Runner::Device::EthFrame> frames = {
+    { {}, pkt.data(), pkt.size(), &unchecked },
+    { {}, pkt.data(), pkt.size(), &good },
+    { {}, pkt.data(), pkt.size(), &bad_l4 },
+    { {}, pkt.data(), pkt.size(), &bad_both },
+  };
+  guest.model->EthRxBurst(0, frames);
+  for (uint32_t i = 0; i < frames.size(); i++)
+    EXPECT(guest.rx_done(0, i));
+
+  union ice_32byte_rx_desc *desc = guest.rx_desc(0, 0);
+  EXPECT(qword1_bit(desc, ICE_RX_DESC_STATUS_EOF_S));
+  EXPECT(!qword1_bit(desc, ICE_RX_DESC_STATUS_L3L4P_S));
+
+  desc = guest.rx_desc(0, 1);
+  EXPECT(qword1_bit(desc, ICE_RX_DESC_STATUS_L3L4P_S));
+  EXPECT(!rx_error(desc, ICE_RX_DESC_ERROR_IPE_S));
+  EXPECT(!rx_error(desc, ICE_RX_DESC_ERROR_L4E_S));
+
+  desc = guest.rx_desc(0, 2);
+  EXPECT(qword1_bit(desc, ICE_RX_DESC_STATUS_L3L4P_S));
+  EXPECT(!rx_error(desc, ICE_RX_DESC_ERROR_IPE_S));
+  EXPECT(rx_error(desc, ICE_RX_DESC_ERROR_L4E_S));
+
+  desc = guest.rx_desc(0, 3);
+  EXPECT(qword1_bit(desc, ICE_RX_DESC_STATUS_L3L4P_S));
+  EXPECT(rx_error(desc, ICE_RX_DESC_ERROR_IPE_S));
+  EXPECT(rx_error(desc, ICE_RX_DESC_ERROR_L4E_S));
+}
+
+// frames larger than the max frame size of the queue are dropped, even if
+// they would fit into the rx descriptors
+static void test_rx_max_frame() {
+  auto driver = std::make_shared<SinkDriver>();
+  E810Harness harness(driver, std::make_shared<GuestDevice>(driver));
+  E810Guest &guest = *harness.guest;
+  guest.rxq_setup(0, 1522);
+
+  std::vector<uint8_t> pkt(4000);
+  build_packet(pkt.data(), 1518, 0);
+  guest.model->EthRx(0, {}, pkt.data(), 1518);
+  EXPECT(guest.rx_done(0, 0));
+
+  build_packet(pkt.data(), pkt.size(), 0);
+  guest.model->EthRx(0, {}, pkt.data(), pkt.size());
+  EXPECT(!guest.rx_done(0, 1));
+
+  build_packet(pkt.data(), PKT_LEN, 0);
+  guest.model->EthRx(0, {}, pkt.data(), PKT_LEN);
+  EXPECT(guest.rx_done(0, 1));
+  EXPECT(!guest.rx_done(0, 2));
+}
+
+// one burst may use more descriptors than the model keeps active
+// (queue_base::MAX_ACTIVE_DESCS): 64 frames of 3 descriptors each
+static void test_rx_burst_beyond_active_descs() {
+  const uint32_t NB_FRAMES = 64;
+  const size_t FRAME_LEN = 2 * BUF_SIZE + 100;
+  auto driver = std::make_shared<SinkDriver>();
+  E810Harness harness(driver, std::make_shared<GuestDevice>(driver));
+  E810Guest &guest = *harness.guest;
+  guest.rxq_setup(0);
+
+  std::vector<uint8_t> pkt(FRAME_LEN);
+  build_packet(pkt.data(), pkt.size(), 0);
+  std::vector<nicbm::Runner::Device::EthFrame> frames(NB_FRAMES, { {}, pkt.data(), pkt.size(), nullptr });
+  guest.model->EthRxBurst(0, frames);
+
+  uint32_t descs = NB_FRAMES * 3;
+  EXPECT(descs > 128); // queue_base::MAX_ACTIVE_DESCS
+  for (uint32_t i = 0; i < descs; i++)
+    EXPECT(guest.rx_done(0, i));
+  EXPECT(!guest.rx_done(0, descs));
+}
+
+// Verification suite of the Microsoft RSS specification
+static const uint8_t RSS_KEY[52] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+  0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+  0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+struct RssVector {
+  const char *src;
+  uint16_t src_port;
+  const char *dst;
+  uint16_t dst_port;
+  uint32_t hash_ip;  // addresses only
+  uint32_t hash_tcp; // addresses and ports
+};
+
+static const RssVector RSS_VECTORS[] = {
+  { "66.9.149.187", 2794, "161.142.100.80", 1766, 0x323e8fc2, 0x51ccc178 },
+  { "199.92.111.2", 14230, "65.69.140.83", 4739, 0xd718262a, 0xc626b0ea },
+  { "24.19.198.95", 12898, "12.22.207.184", 38024, 0xd2d0a5de, 0x5c2b394a },
+  { "38.27.205.30", 48228, "209.142.163.6", 2217, 0x82989176, 0xafc7327f },
+  { "153.39.163.191", 44251, "202.188.127.2", 1303, 0x5d1809c5, 0x10e828a2 },
+  { "3ffe:2501:200:1fff::7", 2794, "3ffe:2501:200:3::1", 1766, 0x2cc18cd5, 0x40207d3d },
+  { "3ffe:501:8::260:97ff:fe40:efab", 14230, "ff02::1", 4739, 0x0f0c461c, 0xdde51bbf },
+  { "3ffe:1900:4545:3:200:f8ff:fe21:67cf", 44251, "fe80::200:f8ff:fe21:67cf", 38024, 0x4b61e985, 0x02d1feef },
+};
+
+// hash input of v: source and destination address, then ports. Returns its length.
+static size_t rss_input(const RssVector &v, uint8_t *input, bool ports) {
+  int af = strchr(v.src, ':') ? AF_INET6 : AF_INET;
+  size_t addr_len = af == AF_INET6 ? 16 : 4;
+  inet_pton(af, v.src, input);
+  inet_pton(af, v.dst, input + addr_len);
+  size_t len = 2 * addr_len;
+  if (ports) {
+    uint16_t port = htons(v.src_port);
+    memcpy(input + len, &port, 2);
+    port = htons(v.dst_port);
+    memcpy(input + len + 2, &port, 2);
+    len += 4;
+  }
+  return len;
+}
+
+// the Toeplitz hash reproduces the published results
+static void test_rss_hash_vectors() {
+  uint32_t key[13];
+  memcpy(key, RSS_KEY, sizeof(key));
+  e810::rss_key_cache kc(key);
+
+  for (const RssVector &v : RSS_VECTORS) {
+    uint8_t input[36];
+    size_t len = rss_input(v, input, false);
+    EXPECT(kc.hash(input, len) == v.hash_ip);
+    len = rss_input(v, input, true);
+    EXPECT(kc.hash(input, len) == v.hash_tcp);
+  }
+}
+
+// TCP/IPv4 packet of an IPv4 vector
+static void build_rss_packet(uint8_t *buf, size_t pkt_len, const RssVector &v) {
+  build_packet(buf, pkt_len, 0);
+  headers::pkt_udp *pkt = reinterpret_cast<headers::pkt_udp *>(buf);
+  pkt->ip.proto = IP_PROTO_TCP;
+  inet_pton(AF_INET, v.src, &pkt->ip.src);
+  inet_pton(AF_INET, v.dst, &pkt->ip.dest);
+  pkt->udp.src = htons(v.src_port);
+  pkt->udp.dest = htons(v.dst_port);
+}
+
+// packets go to the queue the LUT entry of their hash names, for the VSI LUT
+// and the PF LUT
+static void test_rss_lut() {
+  for (bool pf_lut : { false, true }) {
+    auto driver = std::make_shared<SinkDriver>();
+    E810Harness harness(driver, std::make_shared<GuestDevice>(driver));
+    E810Guest &guest = *harness.guest;
+    guest.rxq_setup(0);
+    guest.rxq_setup(1);
+    guest.adminq_command(ice_aqc_opc_set_rss_key, RSS_KEY, sizeof(RSS_KEY));
+
+    // no pattern the hash modulo the LUT size could hit by accident
+    size_t lut_size = pf_lut ? ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_128 : 4 * (VSIQF_HLUT_MAX_INDEX + 1);
+    std::vector<uint8_t> lut(lut_size);
+    for (size_t i = 0; i < lut_size; i++)
+      lut[i] = (i / 3) % MAX_RX_QUEUES;
+    struct ice_aqc_get_set_rss_lut params = {};
+    if (pf_lut) {
+      guest.reg_write(VSIQF_HASH_CTL(0), ICE_AQ_VSI_Q_OPT_RSS_LUT_PF << VSIQF_HASH_CTL_HASH_LUT_SEL_S);
+      params.flags = (ICE_AQC_GSET_RSS_LUT_TABLE_TYPE_PF << ICE_AQC_GSET_RSS_LUT_TABLE_TYPE_S) |
+                     (ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_128_FLAG << ICE_AQC_GSET_RSS_LUT_TABLE_SIZE_S);
+    }
+    guest.adminq_command(ice_aqc_opc_set_rss_lut, lut.data(), lut.size(), &params);
+
+    uint32_t nb_rx[MAX_RX_QUEUES] = {};
+    std::vector<uint8_t> pkt(PKT_LEN);
+    for (const RssVector &v : RSS_VECTORS) {
+      if (strchr(v.src, ':'))
+        continue;
+      build_rss_packet(pkt.data(), pkt.size(), v);
+      guest.model->EthRx(0, {}, pkt.data(), pkt.size());
+      uint16_t queue = lut[v.hash_tcp % lut_size];
+      EXPECT(guest.rx_done(queue, nb_rx[queue]));
+      nb_rx[queue]++;
+    }
+    for (uint16_t q = 0; q < MAX_RX_QUEUES; q++)
+      EXPECT(!guest.rx_done(q, nb_rx[q]));
+  }
+}
+
+// records the rules the model offloads to the driver
+class RuleRecordingDevice : public GuestDevice {
+public:
+  std::vector<std::pair<uint16_t, uint16_t>> etype_rules; // (ethertype, queue)
+
+  RuleRecordingDevice(std::shared_ptr<Driver> driver) : GuestDevice(driver) {}
+
+  bool add_switch_etype_rule(int vm_id, uint16_t ethertype, uint16_t dst_queue) {
+    this->etype_rules.push_back({ ethertype, dst_queue });
+    return true;
+  }
+
+  bool del_switch_etype_rule(int vm_id, uint16_t ethertype, uint16_t dst_queue) {
+    for (auto it = this->etype_rules.begin(); it != this->etype_rules.end(); it++) {
+      if (*it == std::make_pair(ethertype, dst_queue)) {
+        this->etype_rules.erase(it);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// add_sw_rules element forwarding ethertype etype to queue. Returns the
+// length of the element.
+static uint16_t etype_rule(std::vector<uint8_t> &buf, uint16_t etype, uint16_t queue) {
+  const uint16_t hdr_len = 56; // recipe 0
+  buf.assign(sizeof(struct ice_aqc_sw_rules_elem) + hdr_len, 0);
+  struct ice_aqc_sw_rules_elem *elem = reinterpret_cast<struct ice_aqc_sw_rules_elem *>(buf.data());
+  elem->type = ICE_AQC_SW_RULES_T_LKUP_RX;
+  elem->pdata.lkup_tx_rx.recipe_id = 0;
+  elem->pdata.lkup_tx_rx.act = (ICE_SINGLE_ACT_TO_Q << ICE_SINGLE_ACT_TYPE_S) |
+                               (queue << ICE_SINGLE_ACT_Q_INDEX_S);
+  elem->pdata.lkup_tx_rx.hdr_len = hdr_len;
+  elem->pdata.lkup_tx_rx.hdr[12] = etype >> 8;
+  elem->pdata.lkup_tx_rx.hdr[13] = etype & 0xff;
+  return buf.size();
+}
+
+// a removed switch rule no longer steers packets, in the model and the driver
+static void test_switch_rule_removal() {
+  const uint16_t ETYPE_PTP = 0x88f7;
+  auto driver = std::make_shared<SinkDriver>();
+  auto device = std::make_shared<RuleRecordingDevice>(driver);
+  E810Harness harness(driver, device);
+  E810Guest &guest = *harness.guest;
+  guest.rxq_setup(0);
+  guest.rxq_setup(1);
+
+  std::vector<uint8_t> pkt(PKT_LEN);
+  build_packet(pkt.data(), pkt.size(), 0);
+  pkt[12] = ETYPE_PTP >> 8;
+  pkt[13] = ETYPE_PTP & 0xff;
+
+  std::vector<uint8_t> rule;
+  uint16_t len = etype_rule(rule, ETYPE_PTP, 1);
+  struct ice_aq_desc *desc = guest.adminq_submit(ice_aqc_opc_add_sw_rules, rule.data(), len);
+  EXPECT(!(desc->flags & ICE_AQ_FLAG_ERR));
+  uint16_t rule_id = guest.at<struct ice_aqc_sw_rules_elem>(ATQ_BUF)->pdata.lkup_tx_rx.index;
+  EXPECT(device->etype_rules.size() == 1);
+
+  guest.model->EthRx(0, {}, pkt.data(), pkt.size());
+  EXPECT(guest.rx_done(1, 0));
+  EXPECT(!guest.rx_done(0, 0));
+
+  // the ice driver passes only the index to remove a rule
+  struct ice_aqc_sw_rules_elem remove = {};
+  remove.type = ICE_AQC_SW_RULES_T_LKUP_RX;
+  remove.pdata.lkup_tx_rx.index = rule_id;
+  desc = guest.adminq_submit(ice_aqc_opc_remove_sw_rules, &remove, sizeof(remove));
+  EXPECT(desc->retval == 0);
+  EXPECT(device->etype_rules.empty());
+
+  guest.model->EthRx(0, {}, pkt.data(), pkt.size());
+  EXPECT(guest.rx_done(0, 0));
+  EXPECT(!guest.rx_done(1, 1));
+
+  // the rule is gone: removing it again fails
+  remove.pdata.lkup_tx_rx.index = rule_id;
+  desc = guest.adminq_submit(ice_aqc_opc_remove_sw_rules, &remove, sizeof(remove));
+  EXPECT(desc->retval == ICE_AQ_RC_ENOENT);
+}
+
+int main(int argc, char **argv) {
+  // the model logs every DMA at LOG_DEBUG
+  LOG_LEVEL = LOG_ERR;
+
+  test_legacy_rx_checksum();
+  test_rx_max_frame();
+  test_rx_burst_beyond_active_descs();
+  test_rss_hash_vectors();
+  test_rss_lut();
+  test_switch_rule_removal();
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Tests of the software classification of FlowManager rules.
+ *
+ * Usage: test-flow-manager
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "src/drivers/flow-manager.hpp"
+
+static int failures = 0;
+
+#define EXPECT(cond)                                                        \
+  do {                                                                      \
+    if (!(cond)) {                                                          \
+      printf("%s:%d: %s: expected %s\n", __FILE__, __LINE__, __func__, #cond); \
+      failures++;                                                           \
+    }                                                                       \
+  } while (0)
+
+static const uint8_t VM_MAC[6] = { 0x52, 0x54, 0x00, 0x00, 0x00, 0x01 };
+static const uint8_t PTP_MAC[6] = { 0x01, 0x1b, 0x19, 0x00, 0x00, 0x00 };
+static const uint16_t ETYPE_IPV4 = 0x0800;
+static const uint16_t ETYPE_PTP = 0x88f7;
+
+static FlowManager::SwRule rule(const uint8_t mac[6], uint16_t etype, uint16_t etype_mask, uint16_t queue) {
+  FlowManager::SwRule rule = { .match = { .etype = etype, .etype_mask = etype_mask }, .queue = queue };
+  memcpy(rule.match.dst_mac, mac, 6);
+  return rule;
+}
+
+static std::vector<char> packet(const uint8_t mac[6], uint16_t etype) {
+  std::vector<char> pkt(64);
+  memcpy(pkt.data(), mac, 6);
+  pkt[12] = etype >> 8;
+  pkt[13] = etype & 0xff;
+  return pkt;
+}
+
+static std::optional<uint16_t> classify(const FlowManager::SwRules &rules, const std::vector<char> &pkt) {
+  return FlowManager::classify(rules, pkt.data(), pkt.size());
+}
+
+// a wildcard rule must not hide a more specific rule on the same MAC, in
+// whichever order the rules were added
+static void test_specific_before_wildcard() {
+  for (bool wildcard_first : { true, false }) {
+    FlowManager::SwRules rules;
+    if (wildcard_first)
+      rules.push_back(rule(PTP_MAC, 0, 0, 1));
+    rules.push_back(rule(PTP_MAC, ETYPE_PTP, 0xffff, 2));
+    if (!wildcard_first)
+      rules.push_back(rule(PTP_MAC, 0, 0, 1));
+    FlowManager::sort_rules(rules);
+
+    EXPECT(classify(rules, packet(PTP_MAC, ETYPE_PTP)) == 2);
+    EXPECT(classify(rules, packet(PTP_MAC, ETYPE_IPV4)) == 1);
+  }
+}
+
+// rules match on their own dst MAC, not the one of the VM
+static void test_dst_mac() {
+  FlowManager::SwRules rules = {
+    rule(PTP_MAC, ETYPE_PTP, 0xffff, 3),
+    rule(VM_MAC, ETYPE_PTP, 0xffff, 2),
+  };
+  FlowManager::sort_rules(rules);
+
+  EXPECT(classify(rules, packet(PTP_MAC, ETYPE_PTP)) == 3);
+  EXPECT(classify(rules, packet(VM_MAC, ETYPE_PTP)) == 2);
+  EXPECT(!classify(rules, packet(VM_MAC, ETYPE_IPV4)));
+}
+
+int main(int argc, char **argv) {
+  test_specific_before_wildcard();
+  test_dst_mac();
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
@@ -309,6 +309,27 @@ public:
     return true;
   }
 
+  /// NUMA node of the first cpu in cpu_set, or -1 if unknown
+  static int cpuset_numa_node(const cpu_set_t &cpu_set) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &cpu_set))
+        continue;
+      std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+      DIR *dir = opendir(path.c_str());
+      if (!dir)
+        return -1;
+      int node = -1;
+      struct dirent *entry;
+      while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+          break;
+      }
+      closedir(dir);
+      return node;
+    }
+    return -1;
+  }
+
   static void delay_cycles(size_t cycles) {
     for (size_t i = 0; i <= cycles; i++) {
       asm("nop");
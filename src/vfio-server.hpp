@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <dirent.h>
 #include <err.h>
@@ -27,6 +29,7 @@
 #include <sys/types.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
 #include "src/caps.hpp"
 #include "src/devices/vmux-device.hpp"
@@ -37,8 +40,6 @@ extern "C" {
 #include "libvfio-user.h"
 }
 
-constexpr bool USE_DMA_MAP_HACK = false;
-
 class VfioUserServer;
 
 // break cyclic import: define empty classes (defined in device.hpp)
@@ -61,6 +62,22 @@ public:
   std::set<void *> mapped;
   std::map<void *, dma_sg_t *> sgs;
   std::map<void *, iovec *> mappings;
+  // register guest memory with DPDK, so that the NIC can read from it (vDPDK
+  // zero-copy tx). Set up before the guest connects.
+  bool dpdk_dma_map = false;
+
+  // IOVA translation index: `mappings` flattened into a vector sorted by iova,
+  // with regions merged that are contiguous in both iova and our address space.
+  // Rebuilt on every (un)map. Readers (model, vdpdk threads) are kept out by
+  // vfu_ctx_mutex and the devices' DMA locks while map/unmap callbacks run.
+  struct DmaRegion {
+    uintptr_t iova_start;
+    uintptr_t iova_end; // exclusive
+    uintptr_t vaddr;
+  };
+  std::vector<DmaRegion> dma_regions;
+  // changes with every rebuild; unique across all VfioUserServers
+  std::atomic<uint64_t> dma_generation = 0;
 
   /** In the constructor, we leak the raw device pointer into vfu to be
    * used as private context passed into callbacks. This variable makes
@@ -379,9 +396,11 @@ public:
     }
 
     // TODO: temporary hack, move this out of here
-    if constexpr (USE_DMA_MAP_HACK) {
-      printf("MAP DPDK DMA\n");
-      __builtin_dump_struct(mapping, &printf);
+    if (vfu->dpdk_dma_map) {
+      if_log_level(LOG_DEBUG, {
+        printf("MAP DPDK DMA\n");
+        __builtin_dump_struct(mapping, &printf);
+      });
       struct rte_eth_dev_info info;
       if (rte_eth_dev_info_get(0, &info) != 0) {
         die("Failed rte_eth_dev_info_get");
@@ -398,6 +417,7 @@ public:
     vfu->sgs[info->vaddr] = sgl;
     vfu->mappings[info->iova.iov_base] = mapping;
     vfu->mapped.insert(info->vaddr);
+    vfu->rebuild_dma_index();
     __builtin_dump_struct(info, &printf);
     __builtin_dump_struct(mapping, &printf);
 
@@ -433,7 +453,7 @@ public:
     }
 
     // TODO: temporary hack, move this out of here
-    if constexpr (USE_DMA_MAP_HACK) {
+    if (vfu->dpdk_dma_map) {
       auto &mapping = vfu->mappings[info->iova.iov_base];
       struct rte_eth_dev_info info;
       if (rte_eth_dev_info_get(0, &info) != 0) {
@@ -450,6 +470,7 @@ public:
     vfu->mappings.erase(info->iova.iov_base);
     vfu->mapped.erase(info->vaddr);
     vfu->sgs.erase(info->vaddr);
+    vfu->rebuild_dma_index();
 
     // TODO should probably return with vfu_sgl_put()
 
@@ -457,30 +478,115 @@ public:
   }
 
   /* Convert dma addr (iova) to addr where it is locally mapped
+   * The whole access must be contiguous in our address space. Use
+   * dma_local_sgl() for accesses that may span multiple regions.
    */
   void *dma_local_addr(uintptr_t dma_address, size_t len) {
-    for (auto mapping = this->mappings.crbegin(); mapping != this->mappings.crend(); ++mapping) {
-      const auto &[iova_start_, segment] = *mapping;
-      uintptr_t vaddr_start = (uintptr_t)segment->iov_base;
-      uintptr_t vaddr_end = (uintptr_t)segment->iov_base + segment->iov_len;
-      uintptr_t iova_start = (uintptr_t)iova_start_;
-      uintptr_t iova_end = iova_start + segment->iov_len;
-      if (iova_start <= dma_address && dma_address < iova_end) {
-        if (dma_address + len > iova_end) {
-          die("DMA too big too handle without implementing loops here");
+    const DmaRegion *region = this->dma_find_region(dma_address);
+    if (!region) {
+      this->dma_dump_unmapped(dma_address, len);
+      return NULL;
+    }
+    if (dma_address + len > region->iova_end) {
+      die("DMA too big too handle without implementing loops here. Use dma_local_sgl.");
+    }
+    return (void *)(region->vaddr + (dma_address - region->iova_start));
+  }
+
+  /* Convert dma addr (iova) to a list of local buffers, one per region the
+   * access touches.
+   * Returns the number of iovecs used, or 0 if (parts of) the access are not
+   * mapped or more than max_iov iovecs would be needed.
+   */
+  size_t dma_local_sgl(uintptr_t dma_address, size_t len, struct iovec *iov,
+                       size_t max_iov) {
+    size_t nb_iov = 0;
+    while (len > 0) {
+      const DmaRegion *region = this->dma_find_region(dma_address);
+      if (!region) {
+        this->dma_dump_unmapped(dma_address, len);
+        return 0;
+      }
+      if (nb_iov == max_iov) {
+        printf("DMA access at iova %lu needs more than %zu segments\n", dma_address, max_iov);
+        return 0;
+      }
+      size_t seg_len = std::min(len, (size_t)(region->iova_end - dma_address));
+      iov[nb_iov].iov_base = (void *)(region->vaddr + (dma_address - region->iova_start));
+      iov[nb_iov].iov_len = seg_len;
+      nb_iov++;
+      dma_address += seg_len;
+      len -= seg_len;
+    }
+    return nb_iov;
+  }
+
+  void rebuild_dma_index() {
+    std::vector<DmaRegion> regions;
+    regions.reserve(this->mappings.size());
+    // mappings is ordered by iova already
+    for (const auto &[iova_start, segment] : this->mappings) {
+      DmaRegion region = {
+        .iova_start = (uintptr_t)iova_start,
+        .iova_end = (uintptr_t)iova_start + segment->iov_len,
+        .vaddr = (uintptr_t)segment->iov_base,
+      };
+      if (!regions.empty()) {
+        DmaRegion &prev = regions.back();
+        if (prev.iova_end == region.iova_start &&
+            prev.vaddr + (prev.iova_end - prev.iova_start) == region.vaddr) {
+          prev.iova_end = region.iova_end;
+          continue;
         }
-        size_t offset = dma_address - iova_start;
-        return (void *)(vaddr_start + offset);
       }
+      regions.push_back(region);
+    }
+    this->dma_regions = std::move(regions);
+    this->dma_generation.store(++dma_generation_counter, std::memory_order_release);
+  }
+
+private:
+  // last translated region of this thread. Zero-initialized like any
+  // thread_local, which matches no address.
+  struct DmaCache {
+    uint64_t generation;
+    DmaRegion region;
+  };
+  static inline thread_local DmaCache dma_cache;
+  static inline std::atomic<uint64_t> dma_generation_counter = 0;
+
+  const DmaRegion *dma_find_region(uintptr_t dma_address) {
+    uint64_t generation = this->dma_generation.load(std::memory_order_acquire);
+    DmaCache &cache = dma_cache;
+    if (likely(cache.generation == generation &&
+               cache.region.iova_start <= dma_address &&
+               dma_address < cache.region.iova_end)) {
+      return &cache.region;
     }
 
+    // find the last region starting at or before dma_address
+    auto it = std::upper_bound(this->dma_regions.begin(), this->dma_regions.end(),
+        dma_address, [](uintptr_t addr, const DmaRegion &region) {
+          return addr < region.iova_start;
+        });
+    if (it == this->dma_regions.begin())
+      return NULL;
+    --it;
+    if (dma_address >= it->iova_end)
+      return NULL;
+
+    cache.generation = generation;
+    cache.region = *it;
+    return &cache.region;
+  }
+
+  void dma_dump_unmapped(uintptr_t dma_address, size_t len) {
     printf("No mapping for iova: %lu %lu \n", dma_address, len);
 
     for (const auto &[iova_start_, segment] : this->mappings) {
     
     printf("mappings: %lu %p %lu \n", (uintptr_t) iova_start_, segment->iov_base, segment->iov_len);
     }
-    return NULL;
   }
 
 private: